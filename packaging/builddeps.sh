@@ -65,6 +65,8 @@ if dpkg-vendor --derives-from Debian; then
         gnome-desktop-testing \
         gnupg \
         libgit2-glib-1.0-dev \
+        libgpgme-dev \
+        libssl-dev \
         libtool \
         meson \
         pkg-config \
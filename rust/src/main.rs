@@ -8,12 +8,13 @@
 
 use structopt::StructOpt;
 
-use anyhow::{anyhow, bail, Result};
+use anyhow::{anyhow, bail, Context, Result};
 use std::io::Write;
 use std::process::Command;
+use std::thread;
+use std::time::Instant;
 
-use git2::{Commit, Object, ObjectType, Oid, Repository, Submodule, Tree};
-use openssl::hash::{DigestBytes, Hasher};
+use git2::{Oid, Repository, StatusOptions};
 
 const EVTAG_SHA512: &str = "Git-EVTag-v0-SHA512:";
 #[derive(Debug, StructOpt)]
@@ -23,7 +24,38 @@ struct VerifyOpts {
     tagname: String,
 
     /// Don't verify the GPG signature
+    #[structopt(long = "no-signature")]
     no_signature: bool,
+
+    /// Number of threads reading objects ahead of the checksum (default: number of CPUs)
+    #[structopt(short = "j", long = "jobs")]
+    jobs: Option<usize>,
+}
+
+#[derive(Debug, StructOpt)]
+#[structopt(rename_all = "kebab-case")]
+struct SignOpts {
+    /// Git tag name
+    tagname: String,
+
+    /// Commit to tag (default: HEAD); the C implementation always tags HEAD
+    rev: Option<String>,
+
+    /// Don't create a tag, just compute and print evtag data
+    #[structopt(long = "print-only")]
+    print_only: bool,
+
+    /// Don't create a GPG signature
+    #[structopt(long = "no-signature")]
+    no_signature: bool,
+
+    /// Use the given GPG KEYID
+    #[structopt(short = "u", long = "local-user")]
+    local_user: Option<String>,
+
+    /// Number of threads reading objects ahead of the checksum (default: number of CPUs)
+    #[structopt(short = "j", long = "jobs")]
+    jobs: Option<usize>,
 }
 
 #[derive(Debug, StructOpt)]
@@ -33,74 +65,505 @@ struct VerifyOpts {
 enum Opt {
     /// Verify a signature
     Verify(VerifyOpts),
+    /// Create a new GPG signed tag
+    Sign(SignOpts),
 }
 
 mod algorithm {
     use super::*;
 
-    fn checksum_object(repo: &Repository, object: &Object, hash: &mut Hasher) -> Result<()> {
-        let odb = repo.odb()?;
-        let object = odb.read(object.id())?;
-        let contentbuf = object.data();
-        let header = format!("{} {}", object.kind().str(), contentbuf.len());
-        hash.write_all(header.as_bytes())?;
-        let nulbyte: [u8; 1] = [0; 1];
-        hash.write_all(&nulbyte)?;
-        hash.write_all(contentbuf)?;
-        Ok(())
-    }
-
-    fn checksum_submodule(submodule: &Submodule, hash: &mut Hasher) -> Result<()> {
-        let subrepo = submodule.open()?;
-        let sub_head = submodule.workdir_id().expect("Failed to find workdir id");
-        let commit = subrepo.find_commit(sub_head)?;
-        checksum_commit_contents(&subrepo, &commit, hash)?;
-        Ok(())
-    }
-
-    fn checksum_tree(repo: &Repository, tree: &Tree, hash: &mut Hasher) -> Result<()> {
-        checksum_object(repo, tree.as_object(), hash)?;
-        for entry in tree.iter() {
-            match entry
-                .kind()
-                .expect("I have no idea what a None entry would be...")
-            {
-                ObjectType::Blob => {
-                    let object = repo.find_object(entry.id(), entry.kind())?;
-                    checksum_object(repo, &object, hash)?
+    use git2::{ObjectType, Odb};
+    use openssl::hash::{DigestBytes, Hasher, MessageDigest};
+    use std::collections::{HashMap, VecDeque};
+    use std::io::Read;
+    use std::path::PathBuf;
+    use std::sync::{mpsc, Arc, Mutex};
+
+    /// Blobs larger than this are streamed rather than read whole
+    const STREAM_THRESHOLD: usize = 8 * 1024 * 1024;
+    /// How far each reader thread may get ahead of the checksum
+    const PENDING_PER_JOB: usize = 16;
+
+    #[derive(Debug, Default)]
+    pub(crate) struct Stats {
+        submodules: u32,
+        commits: u32,
+        commit_bytes: u64,
+        trees: u32,
+        tree_bytes: u64,
+        blobs: u32,
+        blob_bytes: u64,
+    }
+
+    impl Stats {
+        fn add(&mut self, kind: ObjectType, len: usize) {
+            let len = len as u64;
+            match kind {
+                ObjectType::Commit => {
+                    self.commits += 1;
+                    self.commit_bytes += len;
                 }
                 ObjectType::Tree => {
-                    let tree = repo.find_tree(entry.id())?;
-                    checksum_tree(repo, &tree, hash)?;
+                    self.trees += 1;
+                    self.tree_bytes += len;
                 }
-                ObjectType::Commit => {
-                    let submodule = repo.find_submodule(entry.name().expect("entry name"))?;
-                    checksum_submodule(&submodule, hash)?;
+                _ => {
+                    self.blobs += 1;
+                    self.blob_bytes += len;
+                }
+            }
+        }
+
+        /// The same comment as the C implementation adds to the tag
+        pub(crate) fn comment(&self) -> String {
+            format!(
+                "# git-evtag comment: submodules={} commits={} ({}) trees={} ({}) blobs={} ({})",
+                self.submodules,
+                self.commits,
+                self.commit_bytes,
+                self.trees,
+                self.tree_bytes,
+                self.blobs,
+                self.blob_bytes
+            )
+        }
+    }
+
+    /// The Git-EVTag-v0 checksum being computed
+    pub(crate) struct EvTag {
+        hash: Hasher,
+        jobs: usize,
+        pub(crate) stats: Stats,
+    }
+
+    impl EvTag {
+        pub(crate) fn new(jobs: usize) -> Result<EvTag> {
+            Ok(EvTag {
+                hash: Hasher::new(MessageDigest::sha512())?,
+                jobs,
+                stats: Stats::default(),
+            })
+        }
+
+        fn checksum_header(&mut self, kind: ObjectType, len: usize) -> Result<()> {
+            // The canonical header of the object, including its NUL byte
+            let header = format!("{} {}\0", kind.str(), len);
+            self.hash.write_all(header.as_bytes())?;
+            self.stats.add(kind, len);
+            Ok(())
+        }
+
+        fn checksum_object(&mut self, kind: ObjectType, data: &[u8]) -> Result<()> {
+            self.checksum_header(kind, data.len())?;
+            self.hash.write_all(data)?;
+            Ok(())
+        }
+
+        /// Adds `commit_oid`, its tree and everything under it, including
+        /// the submodules checked out in `repo`
+        pub(crate) fn checksum_commit(&mut self, repo: &Repository, commit_oid: Oid) -> Result<()> {
+            let odb = repo.odb()?;
+            let mut reader = Reader::new(self.jobs);
+            let mut walk = Walk {
+                evtag: self,
+                repo,
+                repo_path: Arc::new(repo.path().to_path_buf()),
+                odb: &odb,
+                reader: &mut reader,
+            };
+            walk.commit_contents(commit_oid)?;
+            walk.flush()
+        }
+
+        pub(crate) fn finish(mut self) -> Result<DigestBytes> {
+            Ok(self.hash.finish()?)
+        }
+    }
+
+    enum Loaded {
+        Data(ObjectType, Vec<u8>),
+        /// Too large to read whole; the checksum streams it instead
+        Large,
+    }
+
+    type ReadResult = std::result::Result<Loaded, git2::Error>;
+    type ReadJob = (Arc<PathBuf>, Oid, mpsc::SyncSender<ReadResult>);
+
+    enum Pending {
+        /// Trees and commits, which the walk has read already
+        Ready(ObjectType, Vec<u8>),
+        Blob(Oid, mpsc::Receiver<ReadResult>),
+    }
+
+    /// Reads blobs from `jobs` threads ahead of the checksum, which consumes
+    /// them strictly in walk order.  The threads are shared by the
+    /// submodules, and each opens a repository the first time it reads
+    /// from it.  With a single job, blobs are read as the walk reaches them.
+    struct Reader {
+        jobs: Option<mpsc::Sender<ReadJob>>,
+        threads: Vec<thread::JoinHandle<()>>,
+        pending: VecDeque<Pending>,
+        max_pending: usize,
+    }
+
+    /// Only loose objects can be streamed, so opening a stream is tried
+    /// first, rather than looking up the size of every blob: for a packed
+    /// one it fails without reading anything, and the blob is read whole.
+    fn read_blob(odb: &Odb, oid: Oid) -> ReadResult {
+        if let Ok((mut reader, len, kind)) = odb.reader(oid) {
+            if len > STREAM_THRESHOLD {
+                return Ok(Loaded::Large);
+            }
+            let mut data = Vec::with_capacity(len);
+            reader
+                .read_to_end(&mut data)
+                .map_err(|e| git2::Error::from_str(&e.to_string()))?;
+            if data.len() != len {
+                return Err(git2::Error::from_str(&format!(
+                    "Unexpected end of stream reading object {}",
+                    oid
+                )));
+            }
+            return Ok(Loaded::Data(kind, data));
+        }
+        let object = odb.read(oid)?;
+        Ok(Loaded::Data(object.kind(), object.data().to_vec()))
+    }
+
+    fn reader_thread(jobs: Arc<Mutex<mpsc::Receiver<ReadJob>>>) {
+        let mut repos: HashMap<Arc<PathBuf>, std::result::Result<Repository, git2::Error>> =
+            HashMap::new();
+        loop {
+            let job = jobs.lock().expect("reader lock").recv();
+            let (path, oid, reply) = match job {
+                Ok(job) => job,
+                Err(_) => break,
+            };
+            let repo = repos
+                .entry(Arc::clone(&path))
+                .or_insert_with(|| Repository::open(path.as_path()));
+            let result = match repo {
+                Ok(repo) => repo.odb().and_then(|odb| read_blob(&odb, oid)),
+                Err(e) => Err(git2::Error::from_str(e.message())),
+            };
+            // The walk may have given up on an error
+            let _ = reply.send(result);
+        }
+    }
+
+    impl Reader {
+        fn new(jobs: usize) -> Reader {
+            let mut reader = Reader {
+                jobs: None,
+                threads: Vec::new(),
+                pending: VecDeque::new(),
+                max_pending: jobs * PENDING_PER_JOB,
+            };
+            if jobs > 1 {
+                let (sender, receiver) = mpsc::channel();
+                let receiver = Arc::new(Mutex::new(receiver));
+                for _ in 0..jobs {
+                    let receiver = Arc::clone(&receiver);
+                    reader
+                        .threads
+                        .push(thread::spawn(move || reader_thread(receiver)));
+                }
+                reader.jobs = Some(sender);
+            }
+            reader
+        }
+    }
+
+    impl Drop for Reader {
+        fn drop(&mut self) {
+            self.jobs.take();
+            self.pending.clear();
+            for thread in self.threads.drain(..) {
+                let _ = thread.join();
+            }
+        }
+    }
+
+    /// Walks one repository; each object is read once, from a single odb
+    struct Walk<'a, 'r> {
+        evtag: &'a mut EvTag,
+        repo: &'r Repository,
+        /// Tells the reader threads which repository to read from
+        repo_path: Arc<PathBuf>,
+        odb: &'r Odb<'r>,
+        reader: &'a mut Reader,
+    }
+
+    /// The tree of a raw commit object, which always comes first
+    fn parse_commit_tree(data: &[u8]) -> Result<Oid> {
+        let hexsz = 2 * 20;
+        if data.len() < 5 + hexsz + 1 || !data.starts_with(b"tree ") || data[5 + hexsz] != b'\n' {
+            bail!("Invalid commit object");
+        }
+        Ok(Oid::from_str(std::str::from_utf8(&data[5..5 + hexsz])?)?)
+    }
+
+    /// The mode, name and id of each entry of a raw tree object
+    fn parse_tree(data: &[u8]) -> Result<Vec<(u32, &[u8], Oid)>> {
+        let mut entries = Vec::new();
+        let mut rest = data;
+        while !rest.is_empty() {
+            let space = rest
+                .iter()
+                .position(|&b| b == b' ')
+                .ok_or_else(|| anyhow!("Invalid tree object"))?;
+            let mode = std::str::from_utf8(&rest[..space])
+                .ok()
+                .and_then(|m| u32::from_str_radix(m, 8).ok())
+                .ok_or_else(|| anyhow!("Invalid mode in tree object"))?;
+            rest = &rest[space + 1..];
+            let nul = rest
+                .iter()
+                .position(|&b| b == 0)
+                .ok_or_else(|| anyhow!("Invalid tree object"))?;
+            if rest.len() < nul + 1 + 20 {
+                bail!("Truncated tree object");
+            }
+            let oid = Oid::from_bytes(&rest[nul + 1..nul + 1 + 20])?;
+            entries.push((mode, &rest[..nul], oid));
+            rest = &rest[nul + 1 + 20..];
+        }
+        Ok(entries)
+    }
+
+    impl<'a, 'r> Walk<'a, 'r> {
+        fn commit_contents(&mut self, commit_oid: Oid) -> Result<()> {
+            let odb = self.odb;
+            let commit = odb.read(commit_oid)?;
+            if commit.kind() != ObjectType::Commit {
+                bail!("{} is not a commit", commit_oid);
+            }
+            let tree_oid = parse_commit_tree(commit.data())?;
+            self.push_ready(ObjectType::Commit, commit.data())?;
+            let mut path = String::new();
+            self.tree(tree_oid, &mut path)
+        }
+
+        fn tree(&mut self, tree_oid: Oid, path: &mut String) -> Result<()> {
+            let odb = self.odb;
+            let tree = odb.read(tree_oid)?;
+            self.push_ready(ObjectType::Tree, tree.data())?;
+            let pathlen = path.len();
+            for (mode, name, oid) in parse_tree(tree.data())? {
+                match mode & 0o170000 {
+                    0o040000 => {
+                        path.push_str(&String::from_utf8_lossy(name));
+                        path.push('/');
+                        self.tree(oid, path)?;
+                    }
+                    0o160000 => {
+                        path.push_str(&String::from_utf8_lossy(name));
+                        self.submodule(path, oid)?;
+                    }
+                    _ => self.push_blob(oid)?,
+                }
+                path.truncate(pathlen);
+            }
+            Ok(())
+        }
+
+        /// The commit is the gitlink in the tree, and the repository the
+        /// one checked out at `path`, relative to this repository
+        fn submodule(&mut self, path: &str, commit_oid: Oid) -> Result<()> {
+            // Queued blobs may need this repository's odb to be streamed,
+            // and the reader is shared with the submodule
+            self.flush()?;
+            self.evtag.stats.submodules += 1;
+            let submodule = self
+                .repo
+                .find_submodule(path)
+                .with_context(|| format!("Looking up submodule {}", path))?;
+            let subrepo = submodule
+                .open()
+                .with_context(|| format!("Opening submodule {}", path))?;
+            let subodb = subrepo.odb()?;
+            let mut walk = Walk {
+                evtag: &mut *self.evtag,
+                repo: &subrepo,
+                repo_path: Arc::new(subrepo.path().to_path_buf()),
+                odb: &subodb,
+                reader: &mut *self.reader,
+            };
+            walk.commit_contents(commit_oid)?;
+            walk.flush()
+        }
+
+        fn push(&mut self, pending: Pending) -> Result<()> {
+            self.reader.pending.push_back(pending);
+            if self.reader.pending.len() > self.reader.max_pending {
+                self.consume_one()?;
+            }
+            Ok(())
+        }
+
+        fn push_ready(&mut self, kind: ObjectType, data: &[u8]) -> Result<()> {
+            if self.reader.pending.is_empty() {
+                self.evtag.checksum_object(kind, data)
+            } else {
+                self.push(Pending::Ready(kind, data.to_vec()))
+            }
+        }
+
+        fn push_blob(&mut self, oid: Oid) -> Result<()> {
+            let receiver = match self.reader.jobs {
+                None => return self.checksum_blob(oid),
+                Some(ref jobs) => {
+                    let (reply, receiver) = mpsc::sync_channel(1);
+                    jobs.send((Arc::clone(&self.repo_path), oid, reply))
+                        .map_err(|_| anyhow!("Reader threads exited"))?;
+                    receiver
+                }
+            };
+            self.push(Pending::Blob(oid, receiver))
+        }
+
+        fn checksum_blob(&mut self, oid: Oid) -> Result<()> {
+            match read_blob(self.odb, oid)? {
+                Loaded::Data(kind, data) => self.evtag.checksum_object(kind, &data),
+                Loaded::Large => self.stream_blob(oid),
+            }
+        }
+
+        fn stream_blob(&mut self, oid: Oid) -> Result<()> {
+            let odb = self.odb;
+            match odb.reader(oid) {
+                Ok((mut reader, len, kind)) => {
+                    self.evtag.checksum_header(kind, len)?;
+                    let copied = std::io::copy(&mut reader, &mut self.evtag.hash)?;
+                    if copied != len as u64 {
+                        bail!("Unexpected end of stream reading object {}", oid);
+                    }
+                    Ok(())
+                }
+                // Only loose objects support streaming
+                Err(_) => {
+                    let object = odb.read(oid)?;
+                    self.evtag.checksum_object(object.kind(), object.data())
                 }
-                ObjectType::Tag => {}
-                ObjectType::Any => panic!("Found an Any type?"),
             }
         }
-        Ok(())
+
+        fn consume_one(&mut self) -> Result<()> {
+            match self.reader.pending.pop_front() {
+                None => Ok(()),
+                Some(Pending::Ready(kind, data)) => self.evtag.checksum_object(kind, &data),
+                Some(Pending::Blob(oid, receiver)) => match receiver.recv()?? {
+                    Loaded::Data(kind, data) => self.evtag.checksum_object(kind, &data),
+                    Loaded::Large => self.stream_blob(oid),
+                },
+            }
+        }
+
+        fn flush(&mut self) -> Result<()> {
+            while !self.reader.pending.is_empty() {
+                self.consume_one()?;
+            }
+            Ok(())
+        }
+    }
+}
+
+/// --jobs defaults to the number of CPUs
+fn n_jobs(jobs: Option<usize>) -> usize {
+    jobs.unwrap_or_else(|| thread::available_parallelism().map_or(1, |n| n.get()))
+}
+
+fn compute_evtag(repo: &Repository, specified_oid: Oid, jobs: usize) -> Result<(String, String)> {
+    let mut evtag = algorithm::EvTag::new(jobs)?;
+    evtag.checksum_commit(repo, specified_oid)?;
+    let comment = evtag.stats.comment();
+    Ok((hex::encode(evtag.finish()?), comment))
+}
+
+fn check_working_tree(repo: &Repository) -> Result<()> {
+    if repo.is_bare() {
+        return Ok(());
+    }
+    let statuses = repo.statuses(Some(&mut StatusOptions::new()))?;
+    if let Some(entry) = statuses.iter().next() {
+        bail!(
+            "Attempting to tag or verify dirty tree ({})",
+            entry.path().unwrap_or("???")
+        );
+    }
+    Ok(())
+}
+
+fn sign(args: &SignOpts) -> Result<()> {
+    let repo = Repository::discover(".")?;
+    check_working_tree(&repo)?;
+    let rev = args.rev.as_deref().unwrap_or("HEAD");
+    let specified_oid = repo
+        .revparse_single(rev)
+        .and_then(|obj| obj.peel_to_commit())
+        .with_context(|| format!("Resolving {}", rev))?
+        .id();
+
+    let start = Instant::now();
+    let (checksum, comment) = compute_evtag(&repo, specified_oid, n_jobs(args.jobs))?;
+    let elapsed = start.elapsed();
+
+    if args.print_only {
+        println!("{}", comment);
+        println!("{} {}", EVTAG_SHA512, checksum);
+        return Ok(());
+    }
+
+    // Created with a random name and O_EXCL, so it can't be raced in a
+    // shared temporary directory; removed on drop unless kept below
+    let mut tempfile = tempfile::Builder::new()
+        .prefix("git-evtag-")
+        .suffix(".md")
+        .tempfile()?;
+    let temppath = tempfile.path().to_path_buf();
+    write!(
+        tempfile,
+        "\n\n# git-evtag comment: Computed checksum in {:.1}s\n{}\n{} {}\n",
+        elapsed.as_secs_f64(),
+        comment,
+        EVTAG_SHA512,
+        checksum
+    )?;
+    tempfile.flush()?;
+
+    let editor = std::env::var_os("EDITOR").unwrap_or_else(|| "vi".into());
+    let status = Command::new(&editor).arg(&temppath).status()?;
+    if !status.success() {
+        bail!("{:?} exited with error {:?}", editor, status);
     }
 
-    fn checksum_commit_contents(
-        repo: &Repository,
-        commit: &Commit,
-        hash: &mut Hasher,
-    ) -> Result<()> {
-        checksum_object(repo, commit.as_object(), hash)?;
-        let tree = commit.tree()?;
-        checksum_tree(repo, &tree, hash)?;
-        Ok(())
+    let message = std::fs::read_to_string(&temppath)?;
+    if !message.lines().any(|l| l.starts_with(EVTAG_SHA512)) {
+        bail!("Aborting tag due to deleted Git-EVTag line");
     }
 
-    pub(crate) fn compute_evtag(repo: &Repository, specified_oid: Oid) -> Result<DigestBytes> {
-        let mut hash = Hasher::new(openssl::hash::MessageDigest::sha512())?;
-        let commit = repo.find_commit(specified_oid)?;
-        algorithm::checksum_commit_contents(repo, &commit, &mut hash)?;
-        Ok(hash.finish()?)
+    let mut gittag = Command::new("git");
+    gittag.arg("tag");
+    if !args.no_signature {
+        gittag.arg("-s");
+    }
+    if let Some(ref keyid) = args.local_user {
+        gittag.arg("--local-user").arg(keyid);
+    }
+    gittag
+        .arg("-F")
+        .arg(&temppath)
+        .arg(&args.tagname)
+        .arg(specified_oid.to_string());
+    let status = gittag.status()?;
+    if !status.success() {
+        let (_, temppath) = tempfile.keep()?;
+        eprintln!("Saved tag message in: {}", temppath.display());
+        bail!("git tag exited with error {:?}", status);
     }
+    tempfile.close()?;
+
+    Ok(())
 }
 
 fn verify(args: &VerifyOpts) -> Result<()> {
@@ -113,16 +576,6 @@ fn verify(args: &VerifyOpts) -> Result<()> {
     let specified_oid = obj.id();
     let tag_oid_hexstr = format!("{}", tag.id());
 
-    if !args.no_signature {
-        let status = Command::new("git")
-            .arg("verify-tag")
-            .arg(tag_oid_hexstr)
-            .status()?;
-        if !status.success() {
-            bail!("verify-tag exited with error {:?}", status);
-        }
-    }
-
     let message = tag
         .message()
         .ok_or_else(|| anyhow!("No tag message found"))?;
@@ -131,7 +584,28 @@ fn verify(args: &VerifyOpts) -> Result<()> {
         .find_map(|l| l.strip_prefix(EVTAG_SHA512).map(|s| s.trim().to_string()))
         .ok_or_else(|| anyhow!("No {} found in tag message", EVTAG_SHA512))?;
 
-    let expected_checksum = hex::encode(algorithm::compute_evtag(&repo, specified_oid)?);
+    // The signature is checked while the checksum is computed
+    let verify_tag = if args.no_signature {
+        None
+    } else {
+        Some(
+            Command::new("git")
+                .arg("verify-tag")
+                .arg(tag_oid_hexstr)
+                .spawn()?,
+        )
+    };
+
+    let computed = compute_evtag(&repo, specified_oid, n_jobs(args.jobs));
+    // Reap git verify-tag even when the checksum failed
+    let verify_status = verify_tag.map(|mut child| child.wait()).transpose()?;
+    let (expected_checksum, _) = computed?;
+
+    if let Some(status) = verify_status {
+        if !status.success() {
+            bail!("verify-tag exited with error {:?}", status);
+        }
+    }
 
     if expected_checksum != found_checksum {
         anyhow::bail!(
@@ -151,5 +625,6 @@ fn verify(args: &VerifyOpts) -> Result<()> {
 fn main() -> Result<()> {
     match Opt::from_args() {
         Opt::Verify(ref opts) => verify(opts),
+        Opt::Sign(ref opts) => sign(opts),
     }
 }
@@ -0,0 +1,691 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "evtag-core.h"
+
+#include <string.h>
+#include <sys/stat.h>
+#ifdef HAVE_OPENSSL
+/* For SHA512_CTX; see openssl_ctx_sha512_save() */
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+/* Unless libcrypto was built without the deprecated APIs */
+#if !defined(OPENSSL_NO_DEPRECATED_3_0)
+#define HAVE_OPENSSL_SHA512_CTX 1
+#endif
+#endif
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+static gpointer
+glib_sha512_new (void)
+{
+  return g_checksum_new (G_CHECKSUM_SHA512);
+}
+
+static void
+glib_sha512_update (gpointer ctx, const guint8 *data, gsize len)
+{
+  g_checksum_update (ctx, data, len);
+}
+
+static void
+glib_sha512_finish (gpointer ctx, guint8 *digest)
+{
+  gsize len = EVTAG_SHA512_DIGEST_LEN;
+  g_checksum_get_digest (ctx, digest, &len);
+  g_assert (len == EVTAG_SHA512_DIGEST_LEN);
+}
+
+static void
+glib_sha512_free (gpointer ctx)
+{
+  g_checksum_free (ctx);
+}
+
+static const EvTagHashBackend glib_sha512_backend = {
+  "glib", glib_sha512_new, glib_sha512_update, glib_sha512_finish, glib_sha512_free, NULL, NULL
+};
+
+/* FIPS 180-4 SHA-512, with nothing but the state in the context */
+#define EVTAG_SHA512_BLOCK_LEN 128
+
+typedef struct {
+  guint64 h[8];
+  /* Bytes hashed so far; those past the last whole block are in @buf */
+  guint64 len;
+  guint8 buf[EVTAG_SHA512_BLOCK_LEN];
+} EvTagSha512;
+
+static const guint64 sha512_k[80] = {
+  G_GUINT64_CONSTANT (0x428a2f98d728ae22), G_GUINT64_CONSTANT (0x7137449123ef65cd),
+  G_GUINT64_CONSTANT (0xb5c0fbcfec4d3b2f), G_GUINT64_CONSTANT (0xe9b5dba58189dbbc),
+  G_GUINT64_CONSTANT (0x3956c25bf348b538), G_GUINT64_CONSTANT (0x59f111f1b605d019),
+  G_GUINT64_CONSTANT (0x923f82a4af194f9b), G_GUINT64_CONSTANT (0xab1c5ed5da6d8118),
+  G_GUINT64_CONSTANT (0xd807aa98a3030242), G_GUINT64_CONSTANT (0x12835b0145706fbe),
+  G_GUINT64_CONSTANT (0x243185be4ee4b28c), G_GUINT64_CONSTANT (0x550c7dc3d5ffb4e2),
+  G_GUINT64_CONSTANT (0x72be5d74f27b896f), G_GUINT64_CONSTANT (0x80deb1fe3b1696b1),
+  G_GUINT64_CONSTANT (0x9bdc06a725c71235), G_GUINT64_CONSTANT (0xc19bf174cf692694),
+  G_GUINT64_CONSTANT (0xe49b69c19ef14ad2), G_GUINT64_CONSTANT (0xefbe4786384f25e3),
+  G_GUINT64_CONSTANT (0x0fc19dc68b8cd5b5), G_GUINT64_CONSTANT (0x240ca1cc77ac9c65),
+  G_GUINT64_CONSTANT (0x2de92c6f592b0275), G_GUINT64_CONSTANT (0x4a7484aa6ea6e483),
+  G_GUINT64_CONSTANT (0x5cb0a9dcbd41fbd4), G_GUINT64_CONSTANT (0x76f988da831153b5),
+  G_GUINT64_CONSTANT (0x983e5152ee66dfab), G_GUINT64_CONSTANT (0xa831c66d2db43210),
+  G_GUINT64_CONSTANT (0xb00327c898fb213f), G_GUINT64_CONSTANT (0xbf597fc7beef0ee4),
+  G_GUINT64_CONSTANT (0xc6e00bf33da88fc2), G_GUINT64_CONSTANT (0xd5a79147930aa725),
+  G_GUINT64_CONSTANT (0x06ca6351e003826f), G_GUINT64_CONSTANT (0x142929670a0e6e70),
+  G_GUINT64_CONSTANT (0x27b70a8546d22ffc), G_GUINT64_CONSTANT (0x2e1b21385c26c926),
+  G_GUINT64_CONSTANT (0x4d2c6dfc5ac42aed), G_GUINT64_CONSTANT (0x53380d139d95b3df),
+  G_GUINT64_CONSTANT (0x650a73548baf63de), G_GUINT64_CONSTANT (0x766a0abb3c77b2a8),
+  G_GUINT64_CONSTANT (0x81c2c92e47edaee6), G_GUINT64_CONSTANT (0x92722c851482353b),
+  G_GUINT64_CONSTANT (0xa2bfe8a14cf10364), G_GUINT64_CONSTANT (0xa81a664bbc423001),
+  G_GUINT64_CONSTANT (0xc24b8b70d0f89791), G_GUINT64_CONSTANT (0xc76c51a30654be30),
+  G_GUINT64_CONSTANT (0xd192e819d6ef5218), G_GUINT64_CONSTANT (0xd69906245565a910),
+  G_GUINT64_CONSTANT (0xf40e35855771202a), G_GUINT64_CONSTANT (0x106aa07032bbd1b8),
+  G_GUINT64_CONSTANT (0x19a4c116b8d2d0c8), G_GUINT64_CONSTANT (0x1e376c085141ab53),
+  G_GUINT64_CONSTANT (0x2748774cdf8eeb99), G_GUINT64_CONSTANT (0x34b0bcb5e19b48a8),
+  G_GUINT64_CONSTANT (0x391c0cb3c5c95a63), G_GUINT64_CONSTANT (0x4ed8aa4ae3418acb),
+  G_GUINT64_CONSTANT (0x5b9cca4f7763e373), G_GUINT64_CONSTANT (0x682e6ff3d6b2b8a3),
+  G_GUINT64_CONSTANT (0x748f82ee5defb2fc), G_GUINT64_CONSTANT (0x78a5636f43172f60),
+  G_GUINT64_CONSTANT (0x84c87814a1f0ab72), G_GUINT64_CONSTANT (0x8cc702081a6439ec),
+  G_GUINT64_CONSTANT (0x90befffa23631e28), G_GUINT64_CONSTANT (0xa4506cebde82bde9),
+  G_GUINT64_CONSTANT (0xbef9a3f7b2c67915), G_GUINT64_CONSTANT (0xc67178f2e372532b),
+  G_GUINT64_CONSTANT (0xca273eceea26619c), G_GUINT64_CONSTANT (0xd186b8c721c0c207),
+  G_GUINT64_CONSTANT (0xeada7dd6cde0eb1e), G_GUINT64_CONSTANT (0xf57d4f7fee6ed178),
+  G_GUINT64_CONSTANT (0x06f067aa72176fba), G_GUINT64_CONSTANT (0x0a637dc5a2c898a6),
+  G_GUINT64_CONSTANT (0x113f9804bef90dae), G_GUINT64_CONSTANT (0x1b710b35131c471b),
+  G_GUINT64_CONSTANT (0x28db77f523047d84), G_GUINT64_CONSTANT (0x32caab7b40c72493),
+  G_GUINT64_CONSTANT (0x3c9ebe0a15c9bebc), G_GUINT64_CONSTANT (0x431d67c49c100d4c),
+  G_GUINT64_CONSTANT (0x4cc5d4becb3e42b6), G_GUINT64_CONSTANT (0x597f299cfc657e2a),
+  G_GUINT64_CONSTANT (0x5fcb6fab3ad6faec), G_GUINT64_CONSTANT (0x6c44198c4a475817)
+};
+
+#define SHA512_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static guint64
+load_be64 (const guint8 *p)
+{
+  guint64 v;
+  memcpy (&v, p, sizeof (v));
+  return GUINT64_FROM_BE (v);
+}
+
+static void
+store_be64 (guint8  *p,
+            guint64  v)
+{
+  v = GUINT64_TO_BE (v);
+  memcpy (p, &v, sizeof (v));
+}
+
+static void
+builtin_sha512_block (EvTagSha512  *ctx,
+                      const guint8 *block)
+{
+  guint64 w[80];
+  guint64 a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+  guint64 e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+  guint i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = load_be64 (block + i * 8);
+  for (i = 16; i < 80; i++)
+    {
+      guint64 s0 = SHA512_ROTR (w[i-15], 1) ^ SHA512_ROTR (w[i-15], 8) ^ (w[i-15] >> 7);
+      guint64 s1 = SHA512_ROTR (w[i-2], 19) ^ SHA512_ROTR (w[i-2], 61) ^ (w[i-2] >> 6);
+      w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+  for (i = 0; i < 80; i++)
+    {
+      guint64 t1 = h + (SHA512_ROTR (e, 14) ^ SHA512_ROTR (e, 18) ^ SHA512_ROTR (e, 41)) +
+        ((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+      guint64 t2 = (SHA512_ROTR (a, 28) ^ SHA512_ROTR (a, 34) ^ SHA512_ROTR (a, 39)) +
+        ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+  ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+  ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+static gpointer
+builtin_sha512_new (void)
+{
+  static const guint64 iv[8] = {
+    G_GUINT64_CONSTANT (0x6a09e667f3bcc908), G_GUINT64_CONSTANT (0xbb67ae8584caa73b),
+    G_GUINT64_CONSTANT (0x3c6ef372fe94f82b), G_GUINT64_CONSTANT (0xa54ff53a5f1d36f1),
+    G_GUINT64_CONSTANT (0x510e527fade682d1), G_GUINT64_CONSTANT (0x9b05688c2b3e6c1f),
+    G_GUINT64_CONSTANT (0x1f83d9abfb41bd6b), G_GUINT64_CONSTANT (0x5be0cd19137e2179)
+  };
+  EvTagSha512 *ctx = g_new0 (EvTagSha512, 1);
+
+  memcpy (ctx->h, iv, sizeof (iv));
+  return ctx;
+}
+
+static void
+builtin_sha512_update (gpointer ctx, const guint8 *data, gsize len)
+{
+  EvTagSha512 *sha = ctx;
+  gsize buflen = sha->len % EVTAG_SHA512_BLOCK_LEN;
+
+  sha->len += len;
+  if (buflen > 0)
+    {
+      gsize n = MIN (len, EVTAG_SHA512_BLOCK_LEN - buflen);
+
+      memcpy (sha->buf + buflen, data, n);
+      data += n;
+      len -= n;
+      if (buflen + n < EVTAG_SHA512_BLOCK_LEN)
+        return;
+      builtin_sha512_block (sha, sha->buf);
+    }
+  for (; len >= EVTAG_SHA512_BLOCK_LEN; data += EVTAG_SHA512_BLOCK_LEN, len -= EVTAG_SHA512_BLOCK_LEN)
+    builtin_sha512_block (sha, data);
+  memcpy (sha->buf, data, len);
+}
+
+static void
+builtin_sha512_finish (gpointer ctx, guint8 *digest)
+{
+  EvTagSha512 *sha = ctx;
+  gsize buflen = sha->len % EVTAG_SHA512_BLOCK_LEN;
+  guint i;
+
+  /* The padding ends with the length in bits as a 128 bit number */
+  sha->buf[buflen++] = 0x80;
+  if (buflen > EVTAG_SHA512_BLOCK_LEN - 16)
+    {
+      memset (sha->buf + buflen, 0, EVTAG_SHA512_BLOCK_LEN - buflen);
+      builtin_sha512_block (sha, sha->buf);
+      buflen = 0;
+    }
+  memset (sha->buf + buflen, 0, EVTAG_SHA512_BLOCK_LEN - 16 - buflen);
+  store_be64 (sha->buf + EVTAG_SHA512_BLOCK_LEN - 16, sha->len >> 61);
+  store_be64 (sha->buf + EVTAG_SHA512_BLOCK_LEN - 8, sha->len << 3);
+  builtin_sha512_block (sha, sha->buf);
+
+  for (i = 0; i < 8; i++)
+    store_be64 (digest + i * 8, sha->h[i]);
+}
+
+static void
+builtin_sha512_free (gpointer ctx)
+{
+  g_free (ctx);
+}
+
+/* The state is the eight 64 bit words of the hash and the byte count,
+ * big-endian, followed by the bytes past the last whole block.  Every
+ * backend that can be saved uses this format, so a checkpoint can be
+ * resumed with another one.
+ */
+static GBytes *
+sha512_state_pack (const guint64 *h,
+                   guint64        len,
+                   const guint8  *buf)
+{
+  gsize buflen = len % EVTAG_SHA512_BLOCK_LEN;
+  guint8 *state = g_malloc (9 * 8 + buflen);
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    store_be64 (state + i * 8, h[i]);
+  store_be64 (state + 8 * 8, len);
+  memcpy (state + 9 * 8, buf, buflen);
+  return g_bytes_new_take (state, 9 * 8 + buflen);
+}
+
+static gboolean
+sha512_state_unpack (GBytes  *state,
+                     guint64 *h,
+                     guint64 *out_len,
+                     guint8  *buf)
+{
+  gsize len;
+  const guint8 *data = g_bytes_get_data (state, &len);
+  guint i;
+
+  if (len < 9 * 8 || len != 9 * 8 + load_be64 (data + 8 * 8) % EVTAG_SHA512_BLOCK_LEN)
+    return FALSE;
+  *out_len = load_be64 (data + 8 * 8);
+  for (i = 0; i < 8; i++)
+    h[i] = load_be64 (data + i * 8);
+  memcpy (buf, data + 9 * 8, len - 9 * 8);
+  return TRUE;
+}
+
+static GBytes *
+builtin_sha512_save (gpointer ctx)
+{
+  EvTagSha512 *sha = ctx;
+
+  return sha512_state_pack (sha->h, sha->len, sha->buf);
+}
+
+static gboolean
+builtin_sha512_restore (gpointer ctx, GBytes *state)
+{
+  EvTagSha512 *sha = ctx;
+
+  return sha512_state_unpack (state, sha->h, &sha->len, sha->buf);
+}
+
+const EvTagHashBackend evtag_builtin_sha512_backend = {
+  "builtin", builtin_sha512_new, builtin_sha512_update, builtin_sha512_finish, builtin_sha512_free,
+  builtin_sha512_save, builtin_sha512_restore
+};
+
+#ifdef HAVE_OPENSSL
+static gpointer
+openssl_sha512_new (void)
+{
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new ();
+  if (!ctx || !EVP_DigestInit_ex (ctx, EVP_sha512 (), NULL))
+    g_error ("Failed to initialize OpenSSL SHA-512");
+  return ctx;
+}
+
+static void
+openssl_sha512_update (gpointer ctx, const guint8 *data, gsize len)
+{
+  if (!EVP_DigestUpdate (ctx, data, len))
+    g_error ("OpenSSL SHA-512 update failed");
+}
+
+static void
+openssl_sha512_finish (gpointer ctx, guint8 *digest)
+{
+  unsigned int len = 0;
+  if (!EVP_DigestFinal_ex (ctx, digest, &len) || len != EVTAG_SHA512_DIGEST_LEN)
+    g_error ("OpenSSL SHA-512 finalization failed");
+}
+
+static void
+openssl_sha512_free (gpointer ctx)
+{
+  EVP_MD_CTX_free (ctx);
+}
+
+static const EvTagHashBackend openssl_sha512_backend = {
+  "openssl", openssl_sha512_new, openssl_sha512_update, openssl_sha512_finish, openssl_sha512_free,
+  NULL, NULL
+};
+#endif
+
+#ifdef HAVE_OPENSSL_SHA512_CTX
+/* EVP hides the state of the hash, but the older SHA512_CTX API, which
+ * OpenSSL 3 deprecates but still ships, has it in the open and uses
+ * the same assembly; so --checkpoint doesn't have to fall back to the
+ * portable code.  Nl and Nh count bits, and the bytes past the last
+ * whole block are in u.p.
+ */
+static gpointer
+openssl_ctx_sha512_new (void)
+{
+  SHA512_CTX *ctx = g_new0 (SHA512_CTX, 1);
+  if (!SHA512_Init (ctx))
+    g_error ("Failed to initialize OpenSSL SHA-512");
+  return ctx;
+}
+
+static void
+openssl_ctx_sha512_update (gpointer ctx, const guint8 *data, gsize len)
+{
+  if (!SHA512_Update (ctx, data, len))
+    g_error ("OpenSSL SHA-512 update failed");
+}
+
+static void
+openssl_ctx_sha512_finish (gpointer ctx, guint8 *digest)
+{
+  if (!SHA512_Final (digest, ctx))
+    g_error ("OpenSSL SHA-512 finalization failed");
+}
+
+static void
+openssl_ctx_sha512_free (gpointer ctx)
+{
+  g_free (ctx);
+}
+
+static GBytes *
+openssl_ctx_sha512_save (gpointer ctx)
+{
+  SHA512_CTX *sha = ctx;
+  guint64 h[8];
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    h[i] = sha->h[i];
+  return sha512_state_pack (h, (sha->Nl >> 3) | (sha->Nh << 61), sha->u.p);
+}
+
+static gboolean
+openssl_ctx_sha512_restore (gpointer ctx, GBytes *state)
+{
+  SHA512_CTX *sha = ctx;
+  guint64 h[8];
+  guint64 len;
+  guint i;
+
+  G_STATIC_ASSERT (sizeof (sha->u.p) == EVTAG_SHA512_BLOCK_LEN);
+
+  if (!sha512_state_unpack (state, h, &len, sha->u.p))
+    return FALSE;
+  for (i = 0; i < 8; i++)
+    sha->h[i] = h[i];
+  sha->Nl = len << 3;
+  sha->Nh = len >> 61;
+  sha->num = len % EVTAG_SHA512_BLOCK_LEN;
+  return TRUE;
+}
+
+static const EvTagHashBackend openssl_ctx_sha512_backend = {
+  "openssl-ctx", openssl_ctx_sha512_new, openssl_ctx_sha512_update, openssl_ctx_sha512_finish,
+  openssl_ctx_sha512_free, openssl_ctx_sha512_save, openssl_ctx_sha512_restore
+};
+#endif
+
+const EvTagHashBackend *const evtag_hash_backends[] = {
+#ifdef HAVE_OPENSSL
+  &openssl_sha512_backend,
+#endif
+  &glib_sha512_backend,
+  /* Only when selected, or for --checkpoint */
+#ifdef HAVE_OPENSSL_SHA512_CTX
+  &openssl_ctx_sha512_backend,
+#endif
+  &evtag_builtin_sha512_backend,
+  NULL
+};
+
+/* Purely informational; libcrypto does its own dispatch on these */
+const char *
+evtag_hash_cpu_features (void)
+{
+  static char *features;
+
+  if (g_once_init_enter (&features))
+    {
+      GString *buf = g_string_new ("");
+
+#if defined(__x86_64__) && defined(__GNUC__)
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx2"))
+        g_string_append (buf, " avx2");
+      if (__builtin_cpu_supports ("avx512f"))
+        g_string_append (buf, " avx512f");
+#endif
+#if defined(__aarch64__) && defined(__linux__) && defined(HWCAP_SHA512)
+      if (getauxval (AT_HWCAP) & HWCAP_SHA512)
+        g_string_append (buf, " sha512");
+#endif
+      if (buf->len == 0)
+        g_string_append (buf, " generic");
+
+      g_once_init_leave (&features, g_strdup (buf->str + 1));
+      g_string_free (buf, TRUE);
+    }
+
+  return features;
+}
+
+/* Returns the first compiled-in backend, unless overridden with
+ * $GIT_EVTAG_SHA512_BACKEND.
+ */
+const EvTagHashBackend *
+evtag_hash_backend (void)
+{
+  const char *override = g_getenv ("GIT_EVTAG_SHA512_BACKEND");
+  const EvTagHashBackend *const *iter;
+
+  if (override)
+    {
+      for (iter = evtag_hash_backends; *iter; iter++)
+        {
+          if (strcmp ((*iter)->name, override) == 0)
+            return *iter;
+        }
+      g_printerr ("warning: Unknown SHA-512 backend '%s'\n", override);
+    }
+
+  return evtag_hash_backends[0];
+}
+
+/* For --checkpoint: the selected backend if its state can be saved,
+ * otherwise the first one that can.
+ */
+const EvTagHashBackend *
+evtag_hash_backend_with_save (void)
+{
+  const EvTagHashBackend *const *iter;
+
+  if (evtag_hash_backend ()->save)
+    return evtag_hash_backend ();
+  for (iter = evtag_hash_backends; *iter; iter++)
+    {
+      if ((*iter)->save)
+        return *iter;
+    }
+  g_assert_not_reached ();
+}
+
+EvTagHash *
+evtag_hash_new_with_backend (const EvTagHashBackend *backend)
+{
+  EvTagHash *hash = g_new0 (EvTagHash, 1);
+  hash->backend = backend;
+  hash->ctx = hash->backend->new ();
+  return hash;
+}
+
+EvTagHash *
+evtag_hash_new (void)
+{
+  return evtag_hash_new_with_backend (evtag_hash_backend ());
+}
+
+void
+evtag_hash_update (EvTagHash    *hash,
+                   const guint8 *data,
+                   gsize         len)
+{
+  g_assert (hash->hexdigest[0] == '\0');
+  hash->backend->update (hash->ctx, data, len);
+}
+
+void
+evtag_digest_to_hex (const guint8 *digest,
+                     char         *hexdigest)
+{
+  static const char hexchars[] = "0123456789abcdef";
+  guint i;
+
+  for (i = 0; i < EVTAG_SHA512_DIGEST_LEN; i++)
+    {
+      hexdigest[i*2] = hexchars[digest[i] >> 4];
+      hexdigest[i*2+1] = hexchars[digest[i] & 0xf];
+    }
+  hexdigest[EVTAG_SHA512_DIGEST_LEN * 2] = '\0';
+}
+
+/* Like g_checksum_get_digest(); no further updates are allowed */
+void
+evtag_hash_get_digest (EvTagHash *hash,
+                       guint8    *digest)
+{
+  g_assert (hash->hexdigest[0] == '\0');
+  hash->backend->finish (hash->ctx, digest);
+  evtag_digest_to_hex (digest, hash->hexdigest);
+}
+
+/* Like g_checksum_get_string(); no further updates are allowed */
+const char *
+evtag_hash_get_string (EvTagHash *hash)
+{
+  if (hash->hexdigest[0] == '\0')
+    {
+      guint8 digest[EVTAG_SHA512_DIGEST_LEN];
+      evtag_hash_get_digest (hash, digest);
+    }
+
+  return hash->hexdigest;
+}
+
+void
+evtag_hash_free (EvTagHash *hash)
+{
+  hash->backend->free (hash->ctx);
+  g_free (hash);
+}
+
+/* The header that goes before the contents of an object, both in its
+ * id and in the checksums.  Returns its length, with the trailing NUL.
+ */
+gsize
+evtag_object_header (git_otype  otype,
+                     gsize      size,
+                     char      *header)
+{
+  return g_snprintf (header, EVTAG_OBJECT_HEADER_MAX, "%s %" G_GSIZE_FORMAT,
+                     git_object_type2string (otype), size) + 1;
+}
+
+/* Callers hash the data of the object right after */
+void
+evtag_checksum_object_header (EvTagChecksum *checksum,
+                              git_otype      otype,
+                              gsize          size)
+{
+  char header[EVTAG_OBJECT_HEADER_MAX];
+  gsize headerlen;
+
+  headerlen = evtag_object_header (otype, size, header);
+  evtag_hash_update (checksum->hash, (guint8*)header, headerlen);
+
+  switch (otype)
+    {
+    case GIT_OBJ_BLOB:
+      checksum->n_blobs++;
+      checksum->blob_bytes += size + headerlen;
+      break;
+    case GIT_OBJ_COMMIT:
+      checksum->n_commits++;
+      checksum->commit_bytes += size + headerlen;
+      break;
+    case GIT_OBJ_TREE:
+      checksum->n_trees++;
+      checksum->tree_bytes += size + headerlen;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+void
+evtag_checksum_object (EvTagChecksum *checksum,
+                       git_otype      otype,
+                       const guint8  *data,
+                       gsize          size)
+{
+  evtag_checksum_object_header (checksum, otype, size);
+  evtag_hash_update (checksum->hash, data, size);
+}
+
+void
+evtag_checksum_odb_object (EvTagChecksum  *checksum,
+                           git_odb_object *object)
+{
+  evtag_checksum_object (checksum, git_odb_object_type (object),
+                         git_odb_object_data (object), git_odb_object_size (object));
+}
+
+/* The same as libgit2's git_tree_entry_filemode() */
+static guint32
+normalize_filemode (guint32 mode)
+{
+  if ((mode & S_IFMT) == GIT_FILEMODE_TREE)
+    return GIT_FILEMODE_TREE;
+  if (mode & 0111)
+    return GIT_FILEMODE_BLOB_EXECUTABLE;
+  if ((mode & S_IFMT) == GIT_FILEMODE_COMMIT)
+    return GIT_FILEMODE_COMMIT;
+  if ((mode & S_IFMT) == GIT_FILEMODE_LINK)
+    return GIT_FILEMODE_LINK;
+  return GIT_FILEMODE_BLOB;
+}
+
+git_otype
+evtag_tree_entry_type (const EvTagTreeEntry *entry)
+{
+  if (entry->mode == GIT_FILEMODE_COMMIT)
+    return GIT_OBJ_COMMIT;
+  if (entry->mode == GIT_FILEMODE_TREE)
+    return GIT_OBJ_TREE;
+  return GIT_OBJ_BLOB;
+}
+
+/* Each entry is "MODE NAME\0" followed by the raw object id.  Returns
+ * %FALSE if the tree is corrupt.
+ */
+gboolean
+evtag_parse_tree_data (const char *data,
+                       gsize       len,
+                       GArray     *entries)
+{
+  const char *p = data;
+  const char *end = data + len;
+
+  while (p < end)
+    {
+      EvTagTreeEntry entry;
+      guint32 mode = 0;
+      const char *nul;
+
+      while (p < end && *p >= '0' && *p <= '7')
+        mode = (mode << 3) | (*p++ - '0');
+      if (p == end || *p != ' ')
+        return FALSE;
+      p++;
+      nul = memchr (p, '\0', end - p);
+      if (!nul || nul == p || end - (nul + 1) < GIT_OID_RAWSZ)
+        return FALSE;
+
+      entry.name = p;
+      entry.oid = (const git_oid*)(nul + 1);
+      entry.mode = normalize_filemode (mode);
+      g_array_append_val (entries, entry);
+      p = nul + 1 + GIT_OID_RAWSZ;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,116 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The parts of git-evtag that hash objects, without the repository
+ * walk around them, so that they can be linked into the
+ * microbenchmarks in tests/ as well.
+ */
+
+#pragma once
+
+#include <git2.h>
+#include <glib.h>
+
+/* SHA-512 is a large share of the runtime for repositories that are
+ * mostly blobs, so it goes through a small abstraction that prefers
+ * libcrypto (which has assembly implementations selected at runtime
+ * for the CPU) and falls back to GChecksum.  Neither lets us get at
+ * the state of the hash, which --checkpoint needs to save and restore;
+ * it uses libcrypto's older SHA512_CTX API, or a portable
+ * implementation without libcrypto.
+ */
+#define EVTAG_SHA512_DIGEST_LEN 64
+
+typedef struct {
+  const char *name;
+  gpointer (*new) (void);
+  void (*update) (gpointer ctx, const guint8 *data, gsize len);
+  void (*finish) (gpointer ctx, guint8 *digest);
+  void (*free) (gpointer ctx);
+  /* Optional; see sha512_state_pack() */
+  GBytes *(*save) (gpointer ctx);
+  gboolean (*restore) (gpointer ctx, GBytes *state);
+} EvTagHashBackend;
+
+typedef struct {
+  const EvTagHashBackend *backend;
+  gpointer ctx;
+  char hexdigest[EVTAG_SHA512_DIGEST_LEN * 2 + 1];
+} EvTagHash;
+
+extern const EvTagHashBackend *const evtag_hash_backends[];
+extern const EvTagHashBackend evtag_builtin_sha512_backend;
+
+const char *evtag_hash_cpu_features (void);
+const EvTagHashBackend *evtag_hash_backend (void);
+const EvTagHashBackend *evtag_hash_backend_with_save (void);
+
+EvTagHash *evtag_hash_new_with_backend (const EvTagHashBackend *backend);
+EvTagHash *evtag_hash_new (void);
+void evtag_hash_update (EvTagHash    *hash,
+                        const guint8 *data,
+                        gsize         len);
+void evtag_hash_get_digest (EvTagHash *hash,
+                            guint8    *digest);
+const char *evtag_hash_get_string (EvTagHash *hash);
+void evtag_hash_free (EvTagHash *hash);
+
+void evtag_digest_to_hex (const guint8 *digest,
+                          char         *hexdigest);
+
+/* A Git-EVTag-v0 checksum being computed, with the counters that go in
+ * the comment of the tag; the bytes include the object headers.
+ */
+typedef struct {
+  EvTagHash *hash;
+  guint n_commits;
+  guint64 commit_bytes;
+  guint n_trees;
+  guint64 tree_bytes;
+  guint n_blobs;
+  guint64 blob_bytes;
+} EvTagChecksum;
+
+void evtag_checksum_object_header (EvTagChecksum *checksum,
+                                   git_otype      otype,
+                                   gsize          size);
+void evtag_checksum_object (EvTagChecksum *checksum,
+                            git_otype      otype,
+                            const guint8  *data,
+                            gsize          size);
+void evtag_checksum_odb_object (EvTagChecksum  *checksum,
+                                git_odb_object *object);
+
+/* Long enough for "commit <any gsize>" and the NUL */
+#define EVTAG_OBJECT_HEADER_MAX 32
+
+gsize evtag_object_header (git_otype  otype,
+                           gsize      size,
+                           char      *header);
+
+typedef struct {
+  /* Point into the tree object */
+  const char *name;
+  const git_oid *oid;
+  guint32 mode;
+} EvTagTreeEntry;
+
+git_otype evtag_tree_entry_type (const EvTagTreeEntry *entry);
+gboolean evtag_parse_tree_data (const char *data,
+                                gsize       len,
+                                GArray     *entries);
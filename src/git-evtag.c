@@ -19,9 +19,23 @@
 #include "config.h"
 
 #include <git2.h>
+#include <git2/sys/repository.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_GPGME
+#include <gpgme.h>
+#endif
+
+#include "evtag-core.h"
 
 #if !GLIB_CHECK_VERSION(2, 70, 0)
 /* The functionality of check_wait_status was available under a misleading
@@ -31,8 +45,18 @@
 #endif
 
 #define EVTAG_SHA512 "Git-EVTag-v0-SHA512:"
+#define EVTAG_V1_SHA512 "Git-EVTag-v1-SHA512:"
 #define LEGACY_EVTAG_ARCHIVE_TAR "ExtendedVerify-SHA256-archive-tar:"
 #define LEGACY_EVTAG_ARCHIVE_TAR_GITVERSION "ExtendedVerify-git-version:"
+#define LEGACY_EVTAG_ARCHIVE_TAR_WRITER "ExtendedVerify-archive-writer:"
+
+/* Blobs larger than this are hashed from a stream in chunks, rather
+ * than being loaded into memory all at once.
+ */
+#define EVTAG_STREAM_THRESHOLD (8 * 1024 * 1024)
+#define EVTAG_STREAM_CHUNK_SIZE (64 * 1024)
+/* How much of the objects read ahead with --jobs can wait to be hashed */
+#define EVTAG_PIPELINE_MAX_BYTES (64 * 1024 * 1024)
 
 struct EvTag;
 
@@ -45,10 +69,12 @@ typedef struct {
 
 SUBCOMMANDPROTO(sign);
 SUBCOMMANDPROTO(verify);
+SUBCOMMANDPROTO(compute_from_tree);
 
 static Subcommand commands[] = {
   { "sign", git_evtag_builtin_sign },
   { "verify", git_evtag_builtin_verify },
+  { "compute-from-tree", git_evtag_builtin_compute_from_tree },
   { NULL, NULL }
 };
 
@@ -58,6 +84,25 @@ static gboolean opt_print_only;
 static gboolean opt_no_signature;
 static gboolean opt_with_legacy_archive_tag;
 static char *opt_keyid;
+static int opt_jobs;
+static gboolean opt_no_cache;
+static gboolean opt_manifest_cache;
+static gboolean opt_all;
+static char *opt_tags_pattern;
+static char *opt_submodule_store;
+static char *opt_dirty_check;
+static char *opt_stats_json;
+static gboolean opt_progress;
+static int opt_timeout;
+static int opt_object_cache_size = 64;
+static int opt_readahead;
+static gboolean opt_with_v1;
+static char *opt_bundle;
+static char **opt_submodule_bundles;
+static char **opt_submodule_commits;
+static int opt_strip_components;
+static char *opt_checkpoint;
+static int opt_checkpoint_interval;
 
 static GOptionEntry global_entries[] = {
   { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version information and exit", NULL },
@@ -70,12 +115,52 @@ static GOptionEntry sign_options[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print statistics on what we're hashing", NULL },
   { "local-user", 'u', 0, G_OPTION_ARG_STRING, &opt_keyid, "Use the given GPG KEYID", "KEYID" },
   { "with-legacy-archive-tag", 'u', 0, G_OPTION_ARG_NONE, &opt_with_legacy_archive_tag, "Also append a legacy variant of the checksum using `git archive`", NULL },
+  { "with-v1", 0, 0, G_OPTION_ARG_NONE, &opt_with_v1, "Also append a Git-EVTag-v1 checksum", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of threads reading objects ahead of the checksum (default: number of CPUs)", "N" },
+  { "manifest-cache", 0, 0, G_OPTION_ARG_NONE, &opt_manifest_cache, "Use and update cached manifests of the objects in each tree", NULL },
+  { "submodule-store", 0, 0, G_OPTION_ARG_FILENAME, &opt_submodule_store, "Look for submodule repositories in DIR/NAME", "DIR" },
+  { "dirty-check", 0, 0, G_OPTION_ARG_STRING, &opt_dirty_check, "How to check that the working tree matches HEAD: full (default), stat (trust index stat data, in parallel) or none", "MODE" },
+  { "stats-json", 0, 0, G_OPTION_ARG_FILENAME, &opt_stats_json, "Write timings and counters as JSON to FILE", "FILE" },
+  { "progress", 0, 0, G_OPTION_ARG_NONE, &opt_progress, "Report progress on stderr even if it is not a terminal", NULL },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &opt_timeout, "Give up after SECONDS", "SECONDS" },
+  { "object-cache-size", 0, 0, G_OPTION_ARG_INT, &opt_object_cache_size, "Keep up to MIB megabytes of objects that are read more than once (default: 64, 0 to disable)", "MIB" },
+  { "readahead", 0, 0, G_OPTION_ARG_INT, &opt_readahead, "Ask the kernel to read packed objects ahead of the walk, N at a time", "N" },
+  { "checkpoint", 0, 0, G_OPTION_ARG_FILENAME, &opt_checkpoint, "Save the state of the checksum to FILE as it goes, and resume from it", "FILE" },
+  { "checkpoint-interval", 0, 0, G_OPTION_ARG_INT, &opt_checkpoint_interval, "Save a checkpoint every N tree entries (default: 100000)", "N" },
   { NULL }
 };
 
 static GOptionEntry verify_options[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print statistics on what we're hashing", NULL },
   { "no-signature", 0, 0, G_OPTION_ARG_NONE, &opt_no_signature, "Do create or verify GPG signature", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of threads reading objects ahead of the checksum (default: number of CPUs)", "N" },
+  { "no-cache", 0, 0, G_OPTION_ARG_NONE, &opt_no_cache, "Always recompute the checksum, and don't record it in the cache", NULL },
+  { "manifest-cache", 0, 0, G_OPTION_ARG_NONE, &opt_manifest_cache, "Use and update cached manifests of the objects in each tree", NULL },
+  { "all", 0, 0, G_OPTION_ARG_NONE, &opt_all, "Verify all tags", NULL },
+  { "tags", 0, 0, G_OPTION_ARG_STRING, &opt_tags_pattern, "Verify all tags matching the glob PATTERN", "PATTERN" },
+  { "submodule-store", 0, 0, G_OPTION_ARG_FILENAME, &opt_submodule_store, "Look for submodule repositories in DIR/NAME", "DIR" },
+  { "dirty-check", 0, 0, G_OPTION_ARG_STRING, &opt_dirty_check, "How to check that the working tree matches HEAD: full (default), stat (trust index stat data, in parallel) or none", "MODE" },
+  { "stats-json", 0, 0, G_OPTION_ARG_FILENAME, &opt_stats_json, "Write timings and counters as JSON to FILE", "FILE" },
+  { "progress", 0, 0, G_OPTION_ARG_NONE, &opt_progress, "Report progress on stderr even if it is not a terminal", NULL },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &opt_timeout, "Give up after SECONDS", "SECONDS" },
+  { "object-cache-size", 0, 0, G_OPTION_ARG_INT, &opt_object_cache_size, "Keep up to MIB megabytes of objects that are read more than once (default: 64, 0 to disable)", "MIB" },
+  { "readahead", 0, 0, G_OPTION_ARG_INT, &opt_readahead, "Ask the kernel to read packed objects ahead of the walk, N at a time", "N" },
+  { "with-legacy-archive-tag", 0, 0, G_OPTION_ARG_NONE, &opt_with_legacy_archive_tag, "Also verify the legacy checksum of `git archive` output", NULL },
+  { "bundle", 0, 0, G_OPTION_ARG_FILENAME, &opt_bundle, "Verify tags from a git bundle or pack FILE instead of the current repository", "FILE" },
+  { "submodule-bundle", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_submodule_bundles, "Take submodule objects from the bundle or pack FILE (may be repeated)", "FILE" },
+  { "checkpoint", 0, 0, G_OPTION_ARG_FILENAME, &opt_checkpoint, "Save the state of the checksum to FILE as it goes, and resume from it", "FILE" },
+  { "checkpoint-interval", 0, 0, G_OPTION_ARG_INT, &opt_checkpoint_interval, "Save a checkpoint every N tree entries (default: 100000)", "N" },
+  { NULL }
+};
+
+static GOptionEntry compute_from_tree_options[] = {
+  { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print statistics on what we're hashing", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of threads hashing files (default: number of CPUs)", "N" },
+  { "submodule-commit", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_submodule_commits, "The directory PATH is a submodule, with the raw commit object in FILE (may be repeated)", "PATH=FILE" },
+  { "strip-components", 0, 0, G_OPTION_ARG_INT, &opt_strip_components, "Remove N leading directories from the paths in the archive", "N" },
+  { "stats-json", 0, 0, G_OPTION_ARG_FILENAME, &opt_stats_json, "Write timings and counters as JSON to FILE", "FILE" },
+  { "progress", 0, 0, G_OPTION_ARG_NONE, &opt_progress, "Report progress on stderr even if it is not a terminal", NULL },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &opt_timeout, "Give up after SECONDS", "SECONDS" },
   { NULL }
 };
 
@@ -100,6 +185,14 @@ option_context_parse (GOptionContext *context,
   if (opt_version)
     {
       g_print ("%s\n  +default\n", PACKAGE_STRING);
+#ifdef HAVE_OPENSSL
+      g_print ("  +openssl\n");
+#endif
+#ifdef HAVE_GPGME
+      g_print ("  +gpgme\n");
+#endif
+      g_print ("  sha512: %s (cpu: %s)\n", evtag_hash_backend ()->name,
+               evtag_hash_cpu_features ());
       exit (EXIT_SUCCESS);
     }
 
@@ -154,715 +247,8196 @@ handle_libgit_ret (int r, GError **error)
   return FALSE;
 }
 
-struct EvTag {
-  git_repository *top_repo;
-
-  GChecksum *checksum;
-  guint n_submodules;
-  guint n_commits;
-  guint64 commit_bytes;
-  guint n_trees;
-  guint64 tree_bytes;
-  guint n_blobs;
-  guint64 blob_bytes;
+/* Where the time goes, for --stats-json.  Reading and hashing are
+ * timed for each object, and reading the clocks that often would cost
+ * about as much as hashing a small object, so those phases are only
+ * timed when the statistics were asked for.  The others always keep
+ * their wall time, which some tag comments report, and CPU time only
+ * with the statistics.  CPU time is taken from the clock of the
+ * calling thread, the whole process, or waited-for child processes,
+ * depending on where the work of the phase happens.  Reads done by
+ * the read-ahead threads add up their busy time, so can exceed the
+ * total.
+ */
+typedef enum {
+  EVTAG_PHASE_DIRTY_CHECK,
+  EVTAG_PHASE_SUBMODULE_OPEN,
+  EVTAG_PHASE_ODB_READ,
+  EVTAG_PHASE_HASH,
+  EVTAG_PHASE_CHECKSUM,
+  EVTAG_PHASE_GPG_VERIFY,
+  EVTAG_PHASE_TAG_SPAWN,
+  EVTAG_PHASE_LEGACY_ARCHIVE,
+  EVTAG_PHASE_V1_CHECKSUM,
+  EVTAG_PHASE_BUNDLE_INDEX,
+  EVTAG_PHASE_TREE_IDS,
+  EVTAG_N_PHASES
+} EvTagPhase;
+
+typedef enum {
+  EVTAG_CPU_THREAD,
+  EVTAG_CPU_PROCESS,
+  EVTAG_CPU_CHILDREN
+} EvTagCpuClock;
+
+static const struct {
+  const char *name;
+  EvTagCpuClock clock;
+  gboolean per_object;
+} evtag_phase_info[EVTAG_N_PHASES] = {
+  { "dirty-check", EVTAG_CPU_PROCESS, FALSE },
+  { "submodule-open", EVTAG_CPU_PROCESS, FALSE },
+  { "odb-read", EVTAG_CPU_THREAD, TRUE },
+  { "hash", EVTAG_CPU_THREAD, TRUE },
+  { "checksum", EVTAG_CPU_PROCESS, FALSE },
+  { "gpg-verify", EVTAG_CPU_CHILDREN, FALSE },
+  { "tag-spawn", EVTAG_CPU_CHILDREN, FALSE },
+  /* Also per object, but the legacy checksum costs far more */
+  { "legacy-archive", EVTAG_CPU_THREAD, FALSE },
+  { "v1-checksum", EVTAG_CPU_PROCESS, FALSE },
+  { "bundle-index", EVTAG_CPU_THREAD, FALSE },
+  { "tree-ids", EVTAG_CPU_PROCESS, FALSE },
 };
 
-static void
-checksum_odb_object (struct EvTag  *self,
-                     git_odb_object *object)
-{
-  git_otype otype = git_odb_object_type (object);
-  const char *otypestr = git_object_type2string (otype);
-  size_t size = git_odb_object_size (object);
-  char *header;
-  size_t headerlen;
+typedef struct {
+  guint64 wall_usec;
+  guint64 cpu_usec;
+  guint64 count;
+} EvTagPhaseStats;
+
+typedef struct {
+  EvTagPhase phase;
+  gint64 wall;
+  gint64 cpu;
+  gboolean running;
+} EvTagTimer;
 
-  header = g_strdup_printf ("%s %" G_GSIZE_FORMAT, otypestr, size);
-  /* Also include the trailing NUL byte */
-  headerlen = strlen (header) + 1;
-  g_checksum_update (self->checksum, (guint8*)header, headerlen);
-  g_free (header);
+#define EVTAG_N_LARGEST 10
 
-  switch (otype)
+typedef struct {
+  git_oid oid;
+  git_otype otype;
+  guint64 size;
+} EvTagLargeObject;
+
+static gint64
+evtag_cpu_time (EvTagCpuClock clock)
+{
+  struct rusage usage;
+  struct timespec ts;
+
+  switch (clock)
     {
-    case GIT_OBJ_BLOB:
-      self->n_blobs++;
-      self->blob_bytes += size + headerlen;
+    case EVTAG_CPU_THREAD:
+      if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+      return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+    case EVTAG_CPU_PROCESS:
+      (void) getrusage (RUSAGE_SELF, &usage);
       break;
-    case GIT_OBJ_COMMIT:
-      self->n_commits++;
-      self->commit_bytes += size + headerlen;
-      break;
-    case GIT_OBJ_TREE:
-      self->n_trees++;
-      self->tree_bytes += size + headerlen;
+    case EVTAG_CPU_CHILDREN:
+      (void) getrusage (RUSAGE_CHILDREN, &usage);
       break;
     default:
       g_assert_not_reached ();
     }
 
-  g_checksum_update (self->checksum, git_odb_object_data (object), size);
+  return ((gint64)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+    usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
 }
 
-struct TreeWalkData {
-  gboolean caught_error;
-  struct EvTag *evtag;
-  git_repository *repo;
-  git_odb *odb;
-  GCancellable *cancellable;
-  GError **error;
-};
-
-static gboolean
-checksum_object_id (struct TreeWalkData  *twdata,
-                    const git_oid *oid,
-                    GError       **error)
+/* Doesn't read the clocks for a per-object phase without --stats-json;
+ * the timer then measures nothing.
+ */
+static void
+evtag_timer_start (EvTagTimer *timer,
+                   EvTagPhase  phase)
 {
-  gboolean ret = FALSE;
-  int r;
-  git_odb_object *odbobj = NULL;
-
-  r = git_odb_read (&odbobj, twdata->odb, oid);
-  if (!handle_libgit_ret (r, error))
-    goto out;
+  timer->phase = phase;
+  timer->running = opt_stats_json || !evtag_phase_info[phase].per_object;
+  timer->wall = timer->running ? g_get_monotonic_time () : 0;
+  timer->cpu = opt_stats_json ? evtag_cpu_time (evtag_phase_info[phase].clock) : 0;
+}
 
-  checksum_odb_object (twdata->evtag, odbobj);
-  
-  ret = TRUE;
- out:
-  if (odbobj)
-    git_odb_object_free (odbobj);
-  return ret;
+/* Usable from any thread */
+static void
+evtag_timer_elapsed (EvTagTimer *timer,
+                     guint64    *out_wall,
+                     guint64    *out_cpu)
+{
+  *out_wall = timer->running ? g_get_monotonic_time () - timer->wall : 0;
+  *out_cpu = opt_stats_json ? evtag_cpu_time (evtag_phase_info[timer->phase].clock) - timer->cpu : 0;
 }
 
-static int
-checksum_submodule (struct TreeWalkData *twdata, git_submodule *sm);
+/* --timeout is enforced by a thread which cancels the command once the
+ * deadline passes; the checksum, dirty check and batch verification
+ * check the cancellable as they go.
+ */
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  gint64 deadline;
+  gboolean done;
+  gboolean expired;
+  GCancellable *cancellable;
+  GThread *thread;
+} EvTagWatchdog;
 
-static int
-checksum_tree_callback (const char *root,
-                        const git_tree_entry *entry,
-                        void *data)
+static gpointer
+watchdog_thread (gpointer data)
 {
-  int iter_r = 1;
-  int tmp_r;
-  struct TreeWalkData *twdata = data;
-  git_otype otype = git_tree_entry_type (entry);
-
-  if (twdata->caught_error)
-    return -1;
+  EvTagWatchdog *watchdog = data;
 
-  switch (otype)
+  g_mutex_lock (&watchdog->lock);
+  while (!watchdog->done)
     {
-    case GIT_OBJ_TREE:
-    case GIT_OBJ_BLOB:
-      if (!checksum_object_id (twdata, git_tree_entry_id (entry),
-                               twdata->error))
+      if (!g_cond_wait_until (&watchdog->cond, &watchdog->lock, watchdog->deadline))
         {
-          twdata->caught_error = TRUE;
-          return -1;
+          watchdog->expired = TRUE;
+          g_cancellable_cancel (watchdog->cancellable);
+          break;
         }
-      break;
-    case GIT_OBJ_COMMIT:
-      {
-        git_submodule *submod = NULL;
-        char *submodule_path = g_build_filename (root, git_tree_entry_name (entry), NULL);
-        tmp_r = git_submodule_lookup (&submod, twdata->repo, submodule_path);
-        g_free (submodule_path);
+    }
+  g_mutex_unlock (&watchdog->lock);
+  return NULL;
+}
 
-        if (!handle_libgit_ret (tmp_r, twdata->error))
-          goto out;
+static EvTagWatchdog *
+watchdog_start (GCancellable *cancellable,
+                int           seconds)
+{
+  EvTagWatchdog *watchdog = g_new0 (EvTagWatchdog, 1);
+
+  g_mutex_init (&watchdog->lock);
+  g_cond_init (&watchdog->cond);
+  watchdog->deadline = g_get_monotonic_time () + (gint64)seconds * G_USEC_PER_SEC;
+  watchdog->cancellable = cancellable;
+  watchdog->thread = g_thread_new ("evtag-watchdog", watchdog_thread, watchdog);
+  return watchdog;
+}
 
-        tmp_r = checksum_submodule (twdata, submod);
-        if (tmp_r != 0)
-          goto out;
+/* Frees @watchdog, returning whether the deadline had passed */
+static gboolean
+watchdog_stop (EvTagWatchdog *watchdog)
+{
+  gboolean expired;
+
+  g_mutex_lock (&watchdog->lock);
+  watchdog->done = TRUE;
+  g_cond_signal (&watchdog->cond);
+  g_mutex_unlock (&watchdog->lock);
+  g_thread_join (watchdog->thread);
+
+  expired = watchdog->expired;
+  g_mutex_clear (&watchdog->lock);
+  g_cond_clear (&watchdog->cond);
+  g_free (watchdog);
+  return expired;
+}
 
-        git_submodule_free (submod);
-      }
-      break;
-    default:
-      g_assert_not_reached ();
+/* While there is a temporary repository to remove, SIGINT, SIGTERM
+ * and SIGHUP cancel the command like --timeout does, so that it is
+ * removed on the way out.  The handler only writes to a pipe, which a
+ * thread waits on; a second signal is fatal as usual.
+ */
+static int interrupt_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t interrupted;
+static const int interrupt_signals[] = { SIGINT, SIGTERM, SIGHUP };
+
+static void
+interrupt_handler (int sig)
+{
+  int errsv = errno;
+  char c = 0;
+
+  if (interrupted)
+    {
+      (void) signal (sig, SIG_DFL);
+      (void) raise (sig);
     }
+  interrupted = 1;
+  (void) write (interrupt_pipe[1], &c, 1);
+  errno = errsv;
+}
 
-  iter_r = 0;
- out:
-  if (iter_r != 0)
-    twdata->caught_error = TRUE;
-  return iter_r;
+static gpointer
+interrupt_thread (gpointer data)
+{
+  GCancellable *cancellable = data;
+  char c;
+
+  while (read (interrupt_pipe[0], &c, 1) < 0 && errno == EINTR)
+    ;
+  g_cancellable_cancel (cancellable);
+  g_object_unref (cancellable);
+  return NULL;
 }
 
 static gboolean
-checksum_commit_contents (struct TreeWalkData *twdata,
-                          const git_oid *commit_oid,
-                          GCancellable *cancellable, GError **error)
+cancel_on_interrupt (GCancellable  *cancellable,
+                     GError       **error)
 {
-  gboolean ret = FALSE;
-  int r;
-  git_commit *commit = NULL;
-  git_tree *tree = NULL;
-
-  r = git_commit_lookup (&commit, twdata->repo, commit_oid);
-  if (!handle_libgit_ret (r, error))
-    goto out;
+  struct sigaction action;
+  guint i;
+
+  if (!g_unix_open_pipe (interrupt_pipe, FD_CLOEXEC, error))
+    return FALSE;
+  g_thread_unref (g_thread_new ("evtag-interrupt", interrupt_thread,
+                                g_object_ref (cancellable)));
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = interrupt_handler;
+  sigemptyset (&action.sa_mask);
+  for (i = 0; i < G_N_ELEMENTS (interrupt_signals); i++)
+    (void) sigaction (interrupt_signals[i], &action, NULL);
+  return TRUE;
+}
 
-  if (!checksum_object_id (twdata, commit_oid, error))
-    goto out;
+struct EvTagPipeline;
+typedef struct EvTagArchive EvTagArchive;
+typedef struct EvTagObjectCache EvTagObjectCache;
+typedef struct EvTagReadahead EvTagReadahead;
+typedef struct EvTagCheckpoint EvTagCheckpoint;
 
-  r = git_commit_tree (&tree, commit);
-  if (!handle_libgit_ret (r, error))
-    goto out;
+struct EvTag {
+  git_repository *top_repo;
 
-  if (!checksum_object_id (twdata, git_object_id((git_object*)tree), error))
-    goto out;
+  struct EvTagPipeline *pipeline;
+  /* Read-ahead threads; 0 to use --jobs */
+  guint n_jobs;
+  /* The most threads actually used, for --stats-json */
+  guint n_jobs_used;
+  GBytes *cache_key;
+  GHashTable *submodules;
+  /* See evtag_share_submodule_repo() */
+  GHashTable *shared_repos;
+  GHashTable *shared_odbs;
+
+  EvTagPhaseStats phases[EVTAG_N_PHASES];
+  EvTagLargeObject largest[EVTAG_N_LARGEST];
+  guint n_largest;
+
+  EvTagWatchdog *watchdog;
+  /* For --with-legacy-archive-tag */
+  EvTagArchive *archive;
+  EvTagObjectCache *object_cache;
+  /* For --readahead */
+  EvTagReadahead *readahead;
+  /* Git-EVTag-v1 digests by object id; see checksum_commit_v1() */
+  GHashTable *v1_digests;
+  /* For --bundle; see open_bundle_repository() */
+  char *bundle_dir;
+  /* For --checkpoint, during checksum_commit_recurse() */
+  EvTagCheckpoint *checkpoint;
+
+  /* Progress display; see evtag_progress_update() */
+  gboolean progress;
+  gboolean progress_tty;
+  gint64 progress_start;
+  gint64 progress_last;
+  guint64 progress_next_objects;
+  guint64 progress_next_bytes;
+  guint expected_blobs;
+
+  EvTagChecksum checksum;
+  guint n_submodules;
+  guint cache_hits;
+  guint cache_misses;
+  guint cache_bypassed;
+  guint cache_evictions;
+  guint64 readahead_requests;
+  guint64 readahead_bytes;
+  guint n_repos_opened;
+  guint n_repos_reused;
+};
 
-  r = git_tree_walk (tree, GIT_TREEWALK_PRE, checksum_tree_callback, twdata);
-  if (twdata->caught_error)
-    goto out;
-  if (!handle_libgit_ret (r, error))
-    goto out;
+static void
+evtag_phase_add (struct EvTag *self,
+                 EvTagPhase    phase,
+                 guint64       wall_usec,
+                 guint64       cpu_usec)
+{
+  self->phases[phase].wall_usec += wall_usec;
+  self->phases[phase].cpu_usec += cpu_usec;
+  self->phases[phase].count++;
+}
 
-  ret = TRUE;
- out:
-  if (commit)
-    git_commit_free (commit);
-  if (tree)
-    git_tree_free (tree);
-  return ret;
+/* Does nothing if @timer isn't running, so that a timer can also be
+ * stopped at the out: label, for the error paths.
+ */
+static void
+evtag_timer_stop (struct EvTag *self,
+                  EvTagTimer   *timer)
+{
+  guint64 wall;
+  guint64 cpu;
+
+  if (!timer->running)
+    return;
+  evtag_timer_elapsed (timer, &wall, &cpu);
+  timer->running = FALSE;
+  evtag_phase_add (self, timer->phase, wall, cpu);
 }
 
-static int
-checksum_submodule (struct TreeWalkData *parent_twdata, git_submodule *sub)
+static void
+record_large_object (struct EvTag  *self,
+                     const git_oid *oid,
+                     git_otype      otype,
+                     guint64        size)
 {
-  int r = 1;
-  const git_oid *sub_head;
-  struct TreeWalkData child_twdata = { FALSE, parent_twdata->evtag, NULL, NULL,
-                                       parent_twdata->cancellable,
-                                       parent_twdata->error };
+  guint i;
 
-  parent_twdata->evtag->n_submodules++;
-  
-  r = git_submodule_open (&child_twdata.repo, sub);
-  if (!handle_libgit_ret (r, child_twdata.error))
+  if (self->n_largest == EVTAG_N_LARGEST &&
+      size <= self->largest[EVTAG_N_LARGEST-1].size)
+    return;
+
+  /* Insertion into the list, which is sorted by decreasing size */
+  i = MIN (self->n_largest, EVTAG_N_LARGEST - 1);
+  if (self->n_largest < EVTAG_N_LARGEST)
+    self->n_largest++;
+  while (i > 0 && self->largest[i-1].size < size)
     {
-      g_prefix_error (child_twdata.error, "Missing `git submodule update --init`? ");
-      goto out;
+      self->largest[i] = self->largest[i-1];
+      i--;
     }
+  git_oid_cpy (&self->largest[i].oid, oid);
+  self->largest[i].otype = otype;
+  self->largest[i].size = size;
+}
 
-  r = git_repository_odb (&child_twdata.odb, child_twdata.repo);
-  if (!handle_libgit_ret (r, child_twdata.error))
-    goto out;
+/* The legacy ExtendedVerify-SHA256-archive-tar checksum is over the
+ * output of `git archive --format=tar`.  Rather than running it after
+ * the checksum, which reads and inflates every object a second time,
+ * the same tar stream is serialized from the top-level objects as
+ * they are checksummed, following archive.c and archive-tar.c in git.
+ * Attributes, core.autocrlf and tar.umask=user can change what git
+ * archive writes, so if any are in effect it is still run instead.
+ */
+#define EVTAG_TAR_BLOCK 512
+#define EVTAG_TAR_RECORD (20 * EVTAG_TAR_BLOCK)
+#define EVTAG_USTAR_MAX_SIZE G_GUINT64_CONSTANT (077777777777)
+#define EVTAG_USTAR_MAX_MTIME G_GUINT64_CONSTANT (077777777777)
 
-  sub_head = git_submodule_wd_id (sub);
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag[1];
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+} EvTagUstarHeader;
 
-  if (!checksum_commit_contents (&child_twdata, sub_head,
-                                 child_twdata.cancellable, child_twdata.error))
-    goto out;
+typedef struct {
+  /* Without a trailing slash */
+  char *path;
+  git_oid oid;
+  guint32 mode;
+} EvTagArchiveEntry;
+
+struct EvTagArchive {
+  /* Only objects read from here are in the archive */
+  git_odb *odb;
+  /* Set when the archive must come from git archive */
+  gboolean unsupported;
+  GChecksum *sha256;
+  guint64 offset;
+  guint64 mtime;
+  guint umask;
+  /* Tree entries in walk order, waiting for their objects */
+  GQueue pending;
+  /* Directories that are only written when a file in them is */
+  GPtrArray *dirs;
+  EvTagArchiveEntry *current;
+  /* The target of the symbolic link being read */
+  GByteArray *link;
+};
 
-  r = 0;
- out:
-  if (r < 0)
-    parent_twdata->caught_error = TRUE;
-  if (child_twdata.repo)
-    git_repository_free (child_twdata.repo);
-  if (child_twdata.odb)
-    git_odb_free (child_twdata.odb);
-  return r;
+static void
+archive_entry_free (gpointer data)
+{
+  EvTagArchiveEntry *entry = data;
+  g_free (entry->path);
+  g_free (entry);
 }
 
-static gboolean
-verify_line (const char *expected_checksum,
-             const char *line,
-             const char *rev,
-             GError    **error)
+static EvTagArchive *
+archive_new (void)
 {
-  gboolean ret = FALSE;
-  const char *provided_checksum;
+  EvTagArchive *archive = g_new0 (EvTagArchive, 1);
 
-  g_assert (g_str_has_prefix (line, EVTAG_SHA512));
+  archive->sha256 = g_checksum_new (G_CHECKSUM_SHA256);
+  archive->umask = 002;
+  g_queue_init (&archive->pending);
+  archive->dirs = g_ptr_array_new_with_free_func (archive_entry_free);
+  return archive;
+}
 
-  provided_checksum = line + strlen (EVTAG_SHA512);
-  provided_checksum += strspn (provided_checksum, " \t");
-  if (strcmp (provided_checksum, expected_checksum) != 0)
+static void
+archive_free (EvTagArchive *archive)
+{
+  EvTagArchiveEntry *entry;
+
+  g_checksum_free (archive->sha256);
+  while ((entry = g_queue_pop_head (&archive->pending)) != NULL)
+    archive_entry_free (entry);
+  g_ptr_array_unref (archive->dirs);
+  if (archive->current)
+    archive_entry_free (archive->current);
+  if (archive->link)
+    g_byte_array_unref (archive->link);
+  g_free (archive);
+}
+
+static void
+archive_write (EvTagArchive *archive,
+               const void   *data,
+               gsize         len)
+{
+  g_checksum_update (archive->sha256, data, len);
+  archive->offset += len;
+}
+
+static void
+archive_pad (EvTagArchive *archive,
+             guint         blocksize)
+{
+  static const guint8 zeroes[EVTAG_TAR_BLOCK];
+  guint64 tail = archive->offset % blocksize;
+
+  if (tail == 0)
+    return;
+  for (tail = blocksize - tail; tail > 0; tail -= MIN (tail, sizeof (zeroes)))
+    archive_write (archive, zeroes, MIN (tail, sizeof (zeroes)));
+}
+
+static void
+archive_write_blocked (EvTagArchive *archive,
+                       const void   *data,
+                       gsize         len)
+{
+  archive_write (archive, data, len);
+  archive_pad (archive, EVTAG_TAR_BLOCK);
+}
+
+/* A pax record, "%u %s=%s\n" where the length includes itself */
+static void
+archive_append_ext_header (GString    *buf,
+                           const char *keyword,
+                           const char *value,
+                           gsize       valuelen)
+{
+  gsize len = 1 + 1 + strlen (keyword) + 1 + valuelen + 1;
+  gsize tmp;
+
+  for (tmp = 1; len / 10 >= tmp; tmp *= 10)
+    len++;
+  g_string_append_printf (buf, "%" G_GSIZE_FORMAT " %s=", len, keyword);
+  g_string_append_len (buf, value, valuelen);
+  g_string_append_c (buf, '\n');
+}
+
+static void
+archive_append_ext_header_uint (GString    *buf,
+                                const char *keyword,
+                                guint64     value)
+{
+  char *str = g_strdup_printf ("%" G_GUINT64_FORMAT, value);
+  archive_append_ext_header (buf, keyword, str, strlen (str));
+  g_free (str);
+}
+
+static void
+archive_prepare_header (EvTagArchive     *archive,
+                        EvTagUstarHeader *header,
+                        guint32           mode,
+                        guint64           size)
+{
+  const guint8 *p = (const guint8*)header;
+  guint chksum = 0;
+  gsize i;
+
+  g_snprintf (header->mode, sizeof (header->mode), "%07o", mode & 07777);
+  g_snprintf (header->size, sizeof (header->size), "%011" G_GINT64_MODIFIER "o",
+              S_ISREG (mode) ? size : 0);
+  g_snprintf (header->mtime, sizeof (header->mtime), "%011" G_GINT64_MODIFIER "o",
+              archive->mtime);
+  g_snprintf (header->uid, sizeof (header->uid), "%07o", 0);
+  g_snprintf (header->gid, sizeof (header->gid), "%07o", 0);
+  g_strlcpy (header->uname, "root", sizeof (header->uname));
+  g_strlcpy (header->gname, "root", sizeof (header->gname));
+  g_snprintf (header->devmajor, sizeof (header->devmajor), "%07o", 0);
+  g_snprintf (header->devminor, sizeof (header->devminor), "%07o", 0);
+  memcpy (header->magic, "ustar", 6);
+  memcpy (header->version, "00", 2);
+
+  /* The checksum field counts as spaces */
+  for (i = 0; i < sizeof (*header); i++)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Invalid %s, actual checksum of %s is %s",
-                   line, rev, expected_checksum);
-      goto out;
+      if (i >= G_STRUCT_OFFSET (EvTagUstarHeader, chksum) &&
+          i < G_STRUCT_OFFSET (EvTagUstarHeader, typeflag))
+        chksum += ' ';
+      else
+        chksum += p[i];
     }
-  
-  ret = TRUE;
- out:
-  return ret;
+  g_snprintf (header->chksum, sizeof (header->chksum), "%07o", chksum);
 }
 
-static char *
-get_stats (struct EvTag *self)
+static void
+archive_write_ext_header (EvTagArchive  *archive,
+                          const git_oid *oid,
+                          GString       *ext_header)
 {
-  return g_strdup_printf ("# git-evtag comment: submodules=%u "
-                          "commits=%u (%" G_GUINT64_FORMAT ") "
-                          "trees=%u (%" G_GUINT64_FORMAT ") "
-                          "blobs=%u (%" G_GUINT64_FORMAT ")",
-                          self->n_submodules,
-                          self->n_commits,
-                          self->commit_bytes,
-                          self->n_trees,
-                          self->tree_bytes,
-                          self->n_blobs,
-                          self->blob_bytes);
+  EvTagUstarHeader header;
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+
+  memset (&header, 0, sizeof (header));
+  header.typeflag[0] = 'x';
+  g_snprintf (header.name, sizeof (header.name), "%s.paxheader",
+              git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), oid));
+  archive_prepare_header (archive, &header, 0100666, ext_header->len);
+  archive_write_blocked (archive, &header, sizeof (header));
+  archive_write_blocked (archive, ext_header->str, ext_header->len);
 }
 
-static gboolean
-check_file_has_evtag (const char *path,
-                      gboolean   *out_have_evtag,
-                      GError    **error)
+/* Where to split a long path between the name and prefix fields */
+static gsize
+archive_path_prefix_len (const char *path,
+                         gsize       pathlen,
+                         gsize       maxlen)
 {
-  gboolean ret = FALSE;
-  char *message = NULL;
-  const char *p;
-  const char *nl;
-  gboolean found = FALSE;
+  gsize i = pathlen;
+
+  if (i > 1 && path[i - 1] == '/')
+    i--;
+  if (i > maxlen)
+    i = maxlen;
+  do
+    i--;
+  while (i > 0 && path[i] != '/');
+  return i;
+}
 
-  if (!g_file_get_contents (path, &message, NULL, error))
-    goto out;
+/* Writes the header for @entry; the data of regular files follows */
+static void
+archive_write_header (EvTagArchive      *archive,
+                      EvTagArchiveEntry *entry,
+                      const guint8      *link_target,
+                      guint64            size)
+{
+  EvTagUstarHeader header;
+  GString *ext_header = g_string_new ("");
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+  guint32 mode = entry->mode;
+  char *path;
+  gsize pathlen;
+
+  memset (&header, 0, sizeof (header));
+  if (S_ISDIR (mode) || mode == GIT_FILEMODE_COMMIT)
+    {
+      path = g_strconcat (entry->path, "/", NULL);
+      header.typeflag[0] = '5';
+      mode = (mode | 0777) & ~archive->umask;
+    }
+  else if (S_ISLNK (mode))
+    {
+      path = g_strdup (entry->path);
+      header.typeflag[0] = '2';
+      mode |= 0777;
+    }
+  else
+    {
+      path = g_strdup (entry->path);
+      header.typeflag[0] = '0';
+      mode = (mode | ((mode & 0100) ? 0777 : 0666)) & ~archive->umask;
+    }
+  pathlen = strlen (path);
+  git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), &entry->oid);
 
-  p = message;
-  while (TRUE)
+  if (pathlen > sizeof (header.name))
     {
-      nl = strchr (p, '\n');
+      gsize plen = archive_path_prefix_len (path, pathlen, sizeof (header.prefix));
+      gsize rest = pathlen - plen - 1;
 
-      if (g_str_has_prefix (p, EVTAG_SHA512))
+      if (plen > 0 && rest <= sizeof (header.name))
         {
-          found = TRUE;
-          break;
+          memcpy (header.prefix, path, plen);
+          memcpy (header.name, path + plen + 1, rest);
+        }
+      else
+        {
+          g_snprintf (header.name, sizeof (header.name), "%s.data", oid_hexstr);
+          archive_append_ext_header (ext_header, "path", path, pathlen);
         }
+    }
+  else
+    memcpy (header.name, path, pathlen);
 
-      if (!nl)
-        break;
-      p = nl + 1;
+  if (S_ISLNK (mode))
+    {
+      if (size > sizeof (header.linkname))
+        {
+          g_snprintf (header.linkname, sizeof (header.linkname), "see %s.paxheader", oid_hexstr);
+          archive_append_ext_header (ext_header, "linkpath", (const char*)link_target, size);
+        }
+      else
+        memcpy (header.linkname, link_target, size);
     }
 
-  ret = TRUE;
-  *out_have_evtag = found;
- out:
-  g_free (message);
-  return ret;
+  if (S_ISREG (mode) && size > EVTAG_USTAR_MAX_SIZE)
+    {
+      archive_append_ext_header_uint (ext_header, "size", size);
+      size = 0;
+    }
+
+  archive_prepare_header (archive, &header, mode, size);
+  if (ext_header->len > 0)
+    archive_write_ext_header (archive, &entry->oid, ext_header);
+  archive_write_blocked (archive, &header, sizeof (header));
+
+  g_string_free (ext_header, TRUE);
+  g_free (path);
 }
 
-static int
-status_cb (const char *path, unsigned int status_flags, void *payload)
+/* Like git archive, writes the directories leading to @entry first,
+ * and drops any that didn't contain anything.
+ */
+static void
+archive_write_dirs (EvTagArchive      *archive,
+                    EvTagArchiveEntry *entry)
 {
-  int r = 1;
-  struct TreeWalkData *twdata = payload;
+  guint i;
 
-  if (status_flags != 0)
+  while (archive->dirs->len > 0)
     {
-      g_assert (!twdata->caught_error);
+      EvTagArchiveEntry *dir = archive->dirs->pdata[archive->dirs->len - 1];
+      gsize len = strlen (dir->path);
+
+      if (strncmp (entry->path, dir->path, len) == 0 && entry->path[len] == '/')
+        break;
+      g_ptr_array_remove_index (archive->dirs, archive->dirs->len - 1);
+    }
+
+  for (i = 0; i < archive->dirs->len; i++)
+    archive_write_header (archive, archive->dirs->pdata[i], NULL, 0);
+  g_ptr_array_set_size (archive->dirs, 0);
+}
+
+/* Submodules have no object of their own in the archive */
+static void
+archive_write_leading_gitlinks (EvTagArchive *archive)
+{
+  EvTagArchiveEntry *entry;
+
+  while ((entry = g_queue_peek_head (&archive->pending)) != NULL &&
+         entry->mode == GIT_FILEMODE_COMMIT)
+    {
+      g_queue_pop_head (&archive->pending);
+      archive_write_dirs (archive, entry);
+      archive_write_header (archive, entry, NULL, 0);
+      archive_entry_free (entry);
+    }
+}
+
+static gboolean
+archive_start (EvTagArchive   *archive,
+               git_repository *repo,
+               git_odb        *odb,
+               const git_oid  *commit_oid,
+               GError        **error)
+{
+  gboolean ret = FALSE;
+  git_config *config = NULL;
+  git_commit *commit = NULL;
+  const char *value;
+  char *path = NULL;
+  GString *ext_header = g_string_new ("");
+  EvTagUstarHeader header;
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+  int r;
+
+  archive->odb = odb;
+
+  r = git_repository_config_snapshot (&config, repo);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  if (git_config_get_string (&value, config, "core.autocrlf") == 0 &&
+      !(g_ascii_strcasecmp (value, "false") == 0 ||
+        g_ascii_strcasecmp (value, "input") == 0 ||
+        g_ascii_strcasecmp (value, "no") == 0 ||
+        g_ascii_strcasecmp (value, "off") == 0 ||
+        g_str_equal (value, "0")))
+    archive->unsupported = TRUE;
+  if (git_config_get_string (&value, config, "core.attributesFile") == 0)
+    archive->unsupported = TRUE;
+  if (git_config_get_string (&value, config, "tar.umask") == 0)
+    {
+      char *end;
+      guint64 umask_value = g_ascii_strtoull (value, &end, 0);
+
+      if (*value == '\0' || *end != '\0' || umask_value > 0777)
+        archive->unsupported = TRUE;
+      else
+        archive->umask = umask_value;
+    }
+
+  path = g_build_filename (git_repository_path (repo), "info", "attributes", NULL);
+  if (g_file_test (path, G_FILE_TEST_EXISTS))
+    archive->unsupported = TRUE;
+  g_free (path);
+  path = g_build_filename (g_get_user_config_dir (), "git", "attributes", NULL);
+  if (g_file_test (path, G_FILE_TEST_EXISTS) ||
+      g_file_test ("/etc/gitattributes", G_FILE_TEST_EXISTS))
+    archive->unsupported = TRUE;
+
+  if (archive->unsupported)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  r = git_commit_lookup (&commit, repo, commit_oid);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  archive->mtime = git_commit_time (commit);
+
+  archive_append_ext_header (ext_header, "comment",
+                             git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), commit_oid),
+                             GIT_OID_HEXSZ);
+  if (archive->mtime > EVTAG_USTAR_MAX_MTIME)
+    {
+      archive_append_ext_header_uint (ext_header, "mtime", archive->mtime);
+      archive->mtime = EVTAG_USTAR_MAX_MTIME;
+    }
+
+  memset (&header, 0, sizeof (header));
+  header.typeflag[0] = 'g';
+  g_strlcpy (header.name, "pax_global_header", sizeof (header.name));
+  archive_prepare_header (archive, &header, 0100666, ext_header->len);
+  archive_write_blocked (archive, &header, sizeof (header));
+  archive_write_blocked (archive, ext_header->str, ext_header->len);
+
+  ret = TRUE;
+ out:
+  g_string_free (ext_header, TRUE);
+  g_free (path);
+  if (commit)
+    git_commit_free (commit);
+  if (config)
+    git_config_free (config);
+  return ret;
+}
+
+/* Called for each entry of the top-level tree walk */
+static void
+archive_queue_entry (EvTagArchive  *archive,
+                     const char    *root,
+                     const char    *name,
+                     const git_oid *oid,
+                     guint32        mode)
+{
+  EvTagArchiveEntry *entry;
+
+  if (archive->unsupported)
+    return;
+
+  if (g_str_equal (name, ".gitattributes"))
+    {
+      archive->unsupported = TRUE;
+      return;
+    }
+
+  entry = g_new0 (EvTagArchiveEntry, 1);
+  entry->path = g_strconcat (root, name, NULL);
+  git_oid_cpy (&entry->oid, oid);
+  entry->mode = mode;
+  g_queue_push_tail (&archive->pending, entry);
+}
+
+/* Returns %TRUE if the data of the object is part of the archive, and
+ * should be passed to archive_object_data().
+ */
+static gboolean
+archive_object_begin (EvTagArchive  *archive,
+                      git_odb       *odb,
+                      const git_oid *oid,
+                      git_otype      otype,
+                      guint64        size)
+{
+  EvTagArchiveEntry *entry;
+
+  if (!archive || archive->unsupported || odb != archive->odb)
+    return FALSE;
+
+  archive_write_leading_gitlinks (archive);
+
+  /* The commit and its tree aren't entries */
+  entry = g_queue_peek_head (&archive->pending);
+  if (!entry || otype == GIT_OBJ_COMMIT || !git_oid_equal (&entry->oid, oid))
+    return FALSE;
+  g_queue_pop_head (&archive->pending);
+
+  if (otype == GIT_OBJ_TREE)
+    {
+      g_ptr_array_add (archive->dirs, entry);
+      return FALSE;
+    }
+
+  archive_write_dirs (archive, entry);
+  archive->current = entry;
+  if (S_ISLNK (entry->mode))
+    archive->link = g_byte_array_new ();
+  else
+    archive_write_header (archive, entry, NULL, size);
+  return TRUE;
+}
+
+static void
+archive_object_data (EvTagArchive *archive,
+                     const void   *data,
+                     gsize         len)
+{
+  if (archive->link)
+    g_byte_array_append (archive->link, data, len);
+  else
+    archive_write (archive, data, len);
+}
+
+static void
+archive_object_end (EvTagArchive *archive)
+{
+  if (archive->link)
+    {
+      archive_write_header (archive, archive->current, archive->link->data, archive->link->len);
+      g_byte_array_unref (archive->link);
+      archive->link = NULL;
+    }
+  else
+    archive_pad (archive, EVTAG_TAR_BLOCK);
+
+  archive_entry_free (archive->current);
+  archive->current = NULL;
+}
+
+/* Returns the checksum of the archive, or %NULL if git archive has to
+ * be used.
+ */
+static const char *
+archive_finish (EvTagArchive *archive)
+{
+  static const guint8 zeroes[EVTAG_TAR_BLOCK];
+  guint64 tail;
+
+  if (archive->unsupported)
+    return NULL;
+
+  archive_write_leading_gitlinks (archive);
+  if (!g_queue_is_empty (&archive->pending))
+    return NULL;
+
+  /* Like git archive, end with a full record, and at least two
+   * zero blocks.
+   */
+  tail = EVTAG_TAR_RECORD - archive->offset % EVTAG_TAR_RECORD;
+  archive_pad (archive, EVTAG_TAR_RECORD);
+  if (tail == EVTAG_TAR_RECORD)
+    tail = 0;
+  if (tail < 2 * EVTAG_TAR_BLOCK)
+    {
+      guint i;
+      for (i = 0; i < EVTAG_TAR_RECORD / EVTAG_TAR_BLOCK; i++)
+        archive_write (archive, zeroes, sizeof (zeroes));
+    }
+
+  return g_checksum_get_string (archive->sha256);
+}
+
+/* Progress is shown on stderr for the checksum, at most every
+ * EVTAG_PROGRESS_INTERVAL on a terminal (rewriting the line), and
+ * every EVTAG_PROGRESS_LOG_INTERVAL otherwise.  The ETA is only an
+ * estimate from the number of files in the index, so is only shown
+ * when checksumming HEAD, and not past that number.
+ */
+#define EVTAG_PROGRESS_INTERVAL (G_USEC_PER_SEC / 5)
+#define EVTAG_PROGRESS_LOG_INTERVAL (5 * G_USEC_PER_SEC)
+/* This is called for every object, and reading the clock each time
+ * would cost about as much as hashing a small one; it is only read
+ * again after this many objects or bytes.
+ */
+#define EVTAG_PROGRESS_CHECK_OBJECTS 64
+#define EVTAG_PROGRESS_CHECK_BYTES (16 * 1024 * 1024)
+
+static void
+evtag_progress_update (struct EvTag *self,
+                       gboolean      done)
+{
+  gint64 now;
+  guint64 n_objects = (guint64)self->checksum.n_commits + self->checksum.n_trees + self->checksum.n_blobs;
+  guint64 n_bytes = self->checksum.commit_bytes + self->checksum.tree_bytes + self->checksum.blob_bytes;
+  double elapsed;
+  char *size_str;
+  char *rate_str;
+  GString *buf;
+
+  if (!done &&
+      n_objects < self->progress_next_objects &&
+      n_bytes < self->progress_next_bytes)
+    return;
+  self->progress_next_objects = n_objects + EVTAG_PROGRESS_CHECK_OBJECTS;
+  self->progress_next_bytes = n_bytes + EVTAG_PROGRESS_CHECK_BYTES;
+
+  now = g_get_monotonic_time ();
+  if (!done && now - self->progress_last < (self->progress_tty ? EVTAG_PROGRESS_INTERVAL : EVTAG_PROGRESS_LOG_INTERVAL))
+    return;
+  self->progress_last = now;
+
+  elapsed = (double)(now - self->progress_start) / (double) G_USEC_PER_SEC;
+  size_str = g_format_size (n_bytes);
+  rate_str = g_format_size (elapsed > 0 ? (guint64)(n_bytes / elapsed) : 0);
+  buf = g_string_new ("");
+  g_string_append_printf (buf, "Checksummed %" G_GUINT64_FORMAT " objects, %s (%s/s)",
+                          n_objects, size_str, rate_str);
+  if (done)
+    g_string_append_printf (buf, " in %0.1fs", elapsed);
+  else if (self->checksum.n_blobs > 0 && self->checksum.n_blobs < self->expected_blobs)
+    {
+      guint remaining = (guint)(elapsed * (self->expected_blobs - self->checksum.n_blobs) / self->checksum.n_blobs);
+      g_string_append_printf (buf, ", ETA %u:%02u", remaining / 60, remaining % 60);
+    }
+
+  if (self->progress_tty)
+    g_printerr ("\r%s\x1b[K%s", buf->str, done ? "\n" : "");
+  else
+    g_printerr ("%s\n", buf->str);
+
+  g_string_free (buf, TRUE);
+  g_free (rate_str);
+  g_free (size_str);
+}
+
+/* Expects the files in the index of @self if @commit is HEAD */
+static void
+evtag_progress_start (struct EvTag  *self,
+                      const git_oid *commit)
+{
+  git_oid head;
+  git_index *index = NULL;
+  size_t i;
+
+  self->progress_start = self->progress_last = g_get_monotonic_time ();
+  self->progress_next_objects = self->progress_next_bytes = 0;
+  self->expected_blobs = 0;
+
+  if (git_repository_is_bare (self->top_repo) ||
+      git_reference_name_to_id (&head, self->top_repo, "HEAD") != 0 ||
+      !git_oid_equal (&head, commit) ||
+      git_repository_index (&index, self->top_repo) != 0)
+    return;
+
+  for (i = 0; i < git_index_entrycount (index); i++)
+    {
+      if (git_index_get_byindex (index, i)->mode != GIT_FILEMODE_COMMIT)
+        self->expected_blobs++;
+    }
+  git_index_free (index);
+}
+
+/* Callers time the hash of the header together with the data */
+static void
+checksum_object_header (struct EvTag  *self,
+                        const git_oid *oid,
+                        git_otype      otype,
+                        size_t         size)
+{
+  evtag_checksum_object_header (&self->checksum, otype, size);
+  record_large_object (self, oid, otype, size);
+}
+
+/* The hash phase is timed once per object, and only with --stats-json */
+static void
+checksum_object_data (struct EvTag  *self,
+                      const git_oid *oid,
+                      git_otype      otype,
+                      const guint8  *data,
+                      size_t         size)
+{
+  EvTagTimer timer;
+
+  evtag_timer_start (&timer, EVTAG_PHASE_HASH);
+  evtag_checksum_object (&self->checksum, otype, data, size);
+  record_large_object (self, oid, otype, size);
+  evtag_timer_stop (self, &timer);
+
+  if (self->progress)
+    evtag_progress_update (self, FALSE);
+}
+
+static void
+checksum_odb_object (struct EvTag   *self,
+                     git_odb        *odb,
+                     git_odb_object *object)
+{
+  size_t size = git_odb_object_size (object);
+  EvTagTimer timer;
+
+  evtag_timer_start (&timer, EVTAG_PHASE_HASH);
+  evtag_checksum_odb_object (&self->checksum, object);
+  record_large_object (self, git_odb_object_id (object), git_odb_object_type (object), size);
+  evtag_timer_stop (self, &timer);
+
+  if (self->progress)
+    evtag_progress_update (self, FALSE);
+
+  if (self->archive)
+    {
+      evtag_timer_start (&timer, EVTAG_PHASE_LEGACY_ARCHIVE);
+      if (archive_object_begin (self->archive, odb, git_odb_object_id (object),
+                                git_odb_object_type (object), size))
+        {
+          archive_object_data (self->archive, git_odb_object_data (object), size);
+          archive_object_end (self->archive);
+        }
+      evtag_timer_stop (self, &timer);
+    }
+}
+
+/* Most objects are read exactly once, but duplicate blobs, and trees
+ * shared between submodules or between tags verified together, come
+ * up repeatedly.  Those are kept in a segmented LRU: objects start on
+ * probation, and only move to the protected segment when they are
+ * used again, so a run of objects read once can't evict the ones that
+ * repeat.  Objects too large for the budget, and streamed blobs,
+ * bypass it.  Objects are shared by id, so across submodules too.
+ *
+ * Objects are admitted once read, which for blobs read ahead is only
+ * when they are hashed; a blob that repeats before then is instead
+ * taken from the read already queued (see EvTagPipeline.in_flight).
+ * libgit2's own cache is left to its defaults, which don't keep blobs.
+ */
+#define EVTAG_OBJECT_CACHE_PROTECTED_PERCENT 80
+
+typedef struct {
+  git_oid oid;
+  git_odb_object *object;
+  gsize size;
+  gboolean protected;
+  GList link;
+} EvTagCacheEntry;
+
+struct EvTagObjectCache {
+  GHashTable *entries;
+  GQueue probation;
+  GQueue protected;
+  gsize budget;
+  gsize max_object;
+  gsize used;
+  gsize protected_used;
+};
+
+static guint
+oid_hash (gconstpointer key)
+{
+  guint hash;
+
+  /* Object ids are already uniformly distributed */
+  memcpy (&hash, ((const git_oid*)key)->id, sizeof (hash));
+  return hash;
+}
+
+static gboolean
+oid_equal (gconstpointer a,
+           gconstpointer b)
+{
+  return git_oid_equal (a, b);
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  EvTagCacheEntry *entry = data;
+  git_odb_object_free (entry->object);
+  g_free (entry);
+}
+
+static EvTagObjectCache *
+object_cache_new (gsize budget)
+{
+  EvTagObjectCache *cache = g_new0 (EvTagObjectCache, 1);
+
+  cache->entries = g_hash_table_new_full (oid_hash, oid_equal, NULL, cache_entry_free);
+  g_queue_init (&cache->probation);
+  g_queue_init (&cache->protected);
+  cache->budget = budget;
+  cache->max_object = budget / 16;
+  return cache;
+}
+
+static void
+object_cache_free (EvTagObjectCache *cache)
+{
+  g_hash_table_unref (cache->entries);
+  g_free (cache);
+}
+
+static void
+object_cache_evict (struct EvTag *self)
+{
+  EvTagObjectCache *cache = self->object_cache;
+
+  while (cache->used > cache->budget)
+    {
+      GQueue *queue = g_queue_is_empty (&cache->probation) ? &cache->protected : &cache->probation;
+      EvTagCacheEntry *entry = g_queue_peek_tail (queue);
+
+      g_queue_unlink (queue, &entry->link);
+      cache->used -= entry->size;
+      if (entry->protected)
+        cache->protected_used -= entry->size;
+      g_hash_table_remove (cache->entries, &entry->oid);
+      self->cache_evictions++;
+    }
+}
+
+/* Returns a new reference to the object if it is cached */
+static git_odb_object *
+evtag_cache_lookup (struct EvTag  *self,
+                    const git_oid *oid)
+{
+  EvTagObjectCache *cache = self->object_cache;
+  EvTagCacheEntry *entry;
+  git_odb_object *object = NULL;
+
+  if (!cache)
+    return NULL;
+
+  entry = g_hash_table_lookup (cache->entries, oid);
+  if (!entry || git_odb_object_dup (&object, entry->object) != 0)
+    {
+      self->cache_misses++;
+      return NULL;
+    }
+  self->cache_hits++;
+
+  if (entry->protected)
+    g_queue_unlink (&cache->protected, &entry->link);
+  else
+    {
+      g_queue_unlink (&cache->probation, &entry->link);
+      entry->protected = TRUE;
+      cache->protected_used += entry->size;
+    }
+  g_queue_push_head_link (&cache->protected, &entry->link);
+
+  /* Demote the least recently used protected objects */
+  while (cache->protected_used > cache->budget / 100 * EVTAG_OBJECT_CACHE_PROTECTED_PERCENT)
+    {
+      EvTagCacheEntry *demoted = g_queue_peek_tail (&cache->protected);
+
+      g_queue_unlink (&cache->protected, &demoted->link);
+      demoted->protected = FALSE;
+      cache->protected_used -= demoted->size;
+      g_queue_push_head_link (&cache->probation, &demoted->link);
+    }
+
+  return object;
+}
+
+/* Called with each object that was read */
+static void
+evtag_cache_admit (struct EvTag   *self,
+                   git_odb_object *object)
+{
+  EvTagObjectCache *cache = self->object_cache;
+  EvTagCacheEntry *entry;
+  gsize size;
+
+  if (!cache)
+    return;
+
+  size = git_odb_object_size (object);
+  if (size > cache->max_object)
+    {
+      self->cache_bypassed++;
+      return;
+    }
+
+  /* Read twice before it was first admitted */
+  if (g_hash_table_contains (cache->entries, git_odb_object_id (object)))
+    return;
+
+  entry = g_new0 (EvTagCacheEntry, 1);
+  git_oid_cpy (&entry->oid, git_odb_object_id (object));
+  if (git_odb_object_dup (&entry->object, object) != 0)
+    {
+      g_free (entry);
+      return;
+    }
+  entry->size = size;
+  entry->link.data = entry;
+  g_hash_table_insert (cache->entries, &entry->oid, entry);
+  g_queue_push_head_link (&cache->probation, &entry->link);
+  cache->used += size;
+
+  object_cache_evict (self);
+}
+
+/* On a cold page cache, the tree order of the walk turns into random
+ * reads all over the packfiles.  With --readahead=N, as the walk
+ * enters a directory (or replays a manifest), the next N objects are
+ * looked up in the pack indexes and the kernel is asked to read their
+ * byte ranges ahead, sorted by offset and merged when close, so the
+ * reads done in strict hashing order find warm pages.  Only version 2
+ * pack indexes are understood; loose objects are left alone.
+ */
+#define EVTAG_READAHEAD_GAP (64 * 1024)
+#define EVTAG_PACK_IDX_HEADER (8 + 256 * 4)
+
+typedef struct {
+  GMappedFile *idx;
+  const guint8 *oids;
+  const guint8 *offsets;
+  const guint8 *large_offsets;
+  guint32 n_objects;
+  guint32 n_large_offsets;
+  /* Sorted offsets, to find where each object ends */
+  guint64 *sorted_offsets;
+  int pack_fd;
+  guint64 pack_size;
+} EvTagPackIndex;
+
+typedef struct {
+  EvTagPackIndex *pack;
+  guint64 offset;
+} EvTagReadaheadRange;
+
+struct EvTagReadahead {
+  /* Objects directory => GPtrArray of EvTagPackIndex */
+  GHashTable *packs;
+};
+
+static void
+pack_index_free (gpointer data)
+{
+  EvTagPackIndex *pack = data;
+
+  if (pack->idx)
+    g_mapped_file_unref (pack->idx);
+  if (pack->pack_fd >= 0)
+    (void) close (pack->pack_fd);
+  g_free (pack->sorted_offsets);
+  g_free (pack);
+}
+
+static EvTagPackIndex *
+pack_index_open (const char *idx_path)
+{
+  EvTagPackIndex *pack = g_new0 (EvTagPackIndex, 1);
+  char *pack_path = NULL;
+  const guint8 *data;
+  gsize len;
+  guint32 fanout_last;
+  gsize min_len;
+  struct stat stbuf;
+
+  pack->pack_fd = -1;
+  pack->idx = g_mapped_file_new (idx_path, FALSE, NULL);
+  if (!pack->idx)
+    goto fail;
+  data = (const guint8*)g_mapped_file_get_contents (pack->idx);
+  len = g_mapped_file_get_length (pack->idx);
+
+  if (len < EVTAG_PACK_IDX_HEADER ||
+      memcmp (data, "\377tOc\0\0\0\2", 8) != 0)
+    goto fail;
+  memcpy (&fanout_last, data + EVTAG_PACK_IDX_HEADER - 4, 4);
+  pack->n_objects = GUINT32_FROM_BE (fanout_last);
+
+  /* Object ids, CRCs and offsets, then the two trailing checksums */
+  min_len = EVTAG_PACK_IDX_HEADER + (gsize)pack->n_objects * (GIT_OID_RAWSZ + 4 + 4) + 2 * GIT_OID_RAWSZ;
+  if (len < min_len)
+    goto fail;
+  pack->oids = data + EVTAG_PACK_IDX_HEADER;
+  pack->offsets = pack->oids + (gsize)pack->n_objects * (GIT_OID_RAWSZ + 4);
+  pack->large_offsets = pack->offsets + (gsize)pack->n_objects * 4;
+  pack->n_large_offsets = (len - min_len) / 8;
+
+  g_assert (g_str_has_suffix (idx_path, ".idx"));
+  pack_path = g_strdup_printf ("%.*s.pack", (int)(strlen (idx_path) - strlen (".idx")), idx_path);
+  pack->pack_fd = open (pack_path, O_RDONLY | O_CLOEXEC);
+  if (pack->pack_fd < 0 || fstat (pack->pack_fd, &stbuf) < 0)
+    goto fail;
+  pack->pack_size = stbuf.st_size;
+
+  g_free (pack_path);
+  return pack;
+
+ fail:
+  g_free (pack_path);
+  pack_index_free (pack);
+  return NULL;
+}
+
+static guint64
+pack_index_offset_at (EvTagPackIndex *pack,
+                      guint32         i)
+{
+  guint32 offset;
+  guint64 large;
+
+  memcpy (&offset, pack->offsets + (gsize)i * 4, 4);
+  offset = GUINT32_FROM_BE (offset);
+  if (!(offset & 0x80000000))
+    return offset;
+
+  offset &= 0x7fffffff;
+  if (offset >= pack->n_large_offsets)
+    return 0;
+  memcpy (&large, pack->large_offsets + (gsize)offset * 8, 8);
+  return GUINT64_FROM_BE (large);
+}
+
+/* Returns 0 if @oid isn't in @pack; no object is at offset 0 */
+static guint64
+pack_index_find (EvTagPackIndex *pack,
+                 const git_oid  *oid)
+{
+  const guint8 *data = (const guint8*)g_mapped_file_get_contents (pack->idx);
+  guint32 lo = 0;
+  guint32 hi;
+
+  if (oid->id[0] > 0)
+    {
+      memcpy (&lo, data + 8 + (oid->id[0] - 1) * 4, 4);
+      lo = GUINT32_FROM_BE (lo);
+    }
+  memcpy (&hi, data + 8 + oid->id[0] * 4, 4);
+  hi = MIN (GUINT32_FROM_BE (hi), pack->n_objects);
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      int cmp = memcmp (oid->id, pack->oids + (gsize)mid * GIT_OID_RAWSZ, GIT_OID_RAWSZ);
+
+      if (cmp == 0)
+        return pack_index_offset_at (pack, mid);
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+  return 0;
+}
+
+static int
+compare_guint64 (gconstpointer a,
+                 gconstpointer b)
+{
+  guint64 x = *(const guint64*)a;
+  guint64 y = *(const guint64*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Where the object at @offset ends, which is where the next starts */
+static guint64
+pack_index_object_end (EvTagPackIndex *pack,
+                       guint64         offset)
+{
+  guint32 lo = 0;
+  guint32 hi = pack->n_objects;
+
+  if (!pack->sorted_offsets)
+    {
+      guint32 i;
+
+      pack->sorted_offsets = g_new (guint64, pack->n_objects);
+      for (i = 0; i < pack->n_objects; i++)
+        pack->sorted_offsets[i] = pack_index_offset_at (pack, i);
+      qsort (pack->sorted_offsets, pack->n_objects, sizeof (guint64), compare_guint64);
+    }
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+
+      if (pack->sorted_offsets[mid] <= offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  /* The last object is followed by the pack checksum */
+  return lo < pack->n_objects ? pack->sorted_offsets[lo] : pack->pack_size - GIT_OID_RAWSZ;
+}
+
+static void
+add_pack_indexes (GPtrArray  *packs,
+                  const char *objects_dir)
+{
+  char *pack_dir = g_build_filename (objects_dir, "pack", NULL);
+  GDir *dir = g_dir_open (pack_dir, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir)) != NULL)
+    {
+      char *path;
+      EvTagPackIndex *pack;
+
+      if (!g_str_has_suffix (name, ".idx"))
+        continue;
+      path = g_build_filename (pack_dir, name, NULL);
+      pack = pack_index_open (path);
+      if (pack)
+        g_ptr_array_add (packs, pack);
+      g_free (path);
+    }
+
+  if (dir)
+    g_dir_close (dir);
+  g_free (pack_dir);
+}
+
+/* The packs of @repo, including those of its alternates */
+static GPtrArray *
+readahead_get_packs (EvTagReadahead *readahead,
+                     git_repository *repo)
+{
+  char *objects_dir = g_build_filename (git_repository_path (repo), "objects", NULL);
+  GPtrArray *packs = g_hash_table_lookup (readahead->packs, objects_dir);
+  char *alternates_path = NULL;
+  char *alternates = NULL;
+
+  if (packs)
+    {
+      g_free (objects_dir);
+      return packs;
+    }
+
+  packs = g_ptr_array_new_with_free_func (pack_index_free);
+  add_pack_indexes (packs, objects_dir);
+
+  alternates_path = g_build_filename (objects_dir, "info", "alternates", NULL);
+  if (g_file_get_contents (alternates_path, &alternates, NULL, NULL))
+    {
+      char **lines = g_strsplit (alternates, "\n", -1);
+      char **iter;
+
+      for (iter = lines; *iter; iter++)
+        {
+          char *alternate;
+
+          if (**iter == '\0' || **iter == '#')
+            continue;
+          if (g_path_is_absolute (*iter))
+            alternate = g_strdup (*iter);
+          else
+            alternate = g_build_filename (objects_dir, *iter, NULL);
+          add_pack_indexes (packs, alternate);
+          g_free (alternate);
+        }
+      g_strfreev (lines);
+    }
+
+  g_hash_table_insert (readahead->packs, objects_dir, packs);
+  g_free (alternates_path);
+  g_free (alternates);
+  return packs;
+}
+
+static int
+compare_readahead_ranges (gconstpointer a,
+                          gconstpointer b)
+{
+  const EvTagReadaheadRange *x = a;
+  const EvTagReadaheadRange *y = b;
+
+  if (x->pack != y->pack)
+    return x->pack < y->pack ? -1 : 1;
+  return compare_guint64 (&x->offset, &y->offset);
+}
+
+static void
+readahead_advise (struct EvTag   *self,
+                  EvTagPackIndex *pack,
+                  guint64         start,
+                  guint64         end)
+{
+  (void) posix_fadvise (pack->pack_fd, start, end - start, POSIX_FADV_WILLNEED);
+  self->readahead_requests++;
+  self->readahead_bytes += end - start;
+}
+
+/* Asks for the packed objects among @oids to be read ahead */
+static void
+readahead_objects (struct EvTag   *self,
+                   git_repository *repo,
+                   const git_oid  *oids,
+                   guint           n_oids)
+{
+  GPtrArray *packs = readahead_get_packs (self->readahead, repo);
+  GArray *ranges = g_array_sized_new (FALSE, FALSE, sizeof (EvTagReadaheadRange), n_oids);
+  EvTagPackIndex *pack = NULL;
+  guint64 start = 0;
+  guint64 end = 0;
+  guint i, j;
+
+  for (i = 0; i < n_oids; i++)
+    {
+      for (j = 0; j < packs->len; j++)
+        {
+          EvTagReadaheadRange range;
+
+          range.pack = packs->pdata[j];
+          range.offset = pack_index_find (range.pack, &oids[i]);
+          if (range.offset > 0)
+            {
+              g_array_append_val (ranges, range);
+              break;
+            }
+        }
+    }
+
+  g_array_sort (ranges, compare_readahead_ranges);
+  for (i = 0; i < ranges->len; i++)
+    {
+      EvTagReadaheadRange *range = &g_array_index (ranges, EvTagReadaheadRange, i);
+      guint64 range_end = pack_index_object_end (range->pack, range->offset);
+
+      if (range->pack == pack && range->offset <= end + EVTAG_READAHEAD_GAP)
+        {
+          end = MAX (end, range_end);
+          continue;
+        }
+      if (pack)
+        readahead_advise (self, pack, start, end);
+      pack = range->pack;
+      start = range->offset;
+      end = range_end;
+    }
+  if (pack)
+    readahead_advise (self, pack, start, end);
+
+  g_array_unref (ranges);
+}
+
+static EvTagReadahead *
+readahead_new (void)
+{
+  EvTagReadahead *readahead = g_new0 (EvTagReadahead, 1);
+
+  readahead->packs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_ptr_array_unref);
+  return readahead;
+}
+
+static void
+readahead_free (EvTagReadahead *readahead)
+{
+  g_hash_table_unref (readahead->packs);
+  g_free (readahead);
+}
+
+/* Cached data is kept under $GIT_DIR/evtag, and authenticated with
+ * an HMAC using a random key private to this repository, so that it
+ * can't be forged without read access to the key.
+ */
+#define EVTAG_CACHE_KEY_LEN 32
+
+static char *
+evtag_state_dir (struct EvTag *self)
+{
+  return g_build_filename (git_repository_path (self->top_repo), "evtag", NULL);
+}
+
+static gboolean
+read_random_bytes (guint8  *buf,
+                   gsize    len,
+                   GError **error)
+{
+  gboolean ret = FALSE;
+  int fd;
+  gsize n_read = 0;
+
+  fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Opening /dev/urandom: %s", g_strerror (errsv));
+      goto out;
+    }
+
+  while (n_read < len)
+    {
+      ssize_t r = read (fd, buf + n_read, len - n_read);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        {
+          int errsv = r < 0 ? errno : EIO;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Reading /dev/urandom: %s", g_strerror (errsv));
+          goto out;
+        }
+      n_read += r;
+    }
+
+  ret = TRUE;
+ out:
+  if (fd >= 0)
+    (void) close (fd);
+  return ret;
+}
+
+static gboolean
+ensure_state_subdir (const char  *dir,
+                     GError     **error)
+{
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Creating %s: %s", dir, g_strerror (errsv));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Returns the key, creating it on first use */
+static GBytes *
+evtag_get_cache_key (struct EvTag  *self,
+                     GError       **error)
+{
+  char *dir = NULL;
+  char *keypath = NULL;
+  char *tmppath = NULL;
+  char *contents = NULL;
+  gsize len;
+  int fd = -1;
+
+  if (self->cache_key)
+    return self->cache_key;
+
+  dir = evtag_state_dir (self);
+  keypath = g_build_filename (dir, "cache-key", NULL);
+
+  if (!g_file_test (keypath, G_FILE_TEST_EXISTS))
+    {
+      guint8 key[EVTAG_CACHE_KEY_LEN];
+
+      if (!ensure_state_subdir (dir, error))
+        goto out;
+
+      if (!read_random_bytes (key, sizeof (key), error))
+        goto out;
+
+      /* g_mkstemp() creates the file with mode 0600 */
+      tmppath = g_strconcat (keypath, ".XXXXXX", NULL);
+      fd = g_mkstemp (tmppath);
+      if (fd < 0 || write (fd, key, sizeof (key)) != sizeof (key))
+        {
+          int errsv = errno;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Writing %s: %s", tmppath, g_strerror (errsv));
+          goto out;
+        }
+
+      /* If we raced with another process, the first key wins */
+      if (link (tmppath, keypath) < 0 && errno != EEXIST)
+        {
+          int errsv = errno;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Creating %s: %s", keypath, g_strerror (errsv));
+          goto out;
+        }
+    }
+
+  if (!g_file_get_contents (keypath, &contents, &len, error))
+    goto out;
+  if (len != EVTAG_CACHE_KEY_LEN)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid cache key in %s", keypath);
+      goto out;
+    }
+
+  self->cache_key = g_bytes_new_take (contents, len);
+  contents = NULL;
+
+ out:
+  if (fd >= 0)
+    (void) close (fd);
+  if (tmppath)
+    (void) unlink (tmppath);
+  g_free (tmppath);
+  g_free (contents);
+  g_free (keypath);
+  g_free (dir);
+  return self->cache_key;
+}
+
+static char *
+evtag_cache_hmac (GBytes       *key,
+                  const guint8 *data,
+                  gsize         len)
+{
+  gsize keylen;
+  const guint8 *keydata = g_bytes_get_data (key, &keylen);
+
+  return g_compute_hmac_for_data (G_CHECKSUM_SHA256, keydata, keylen, data, len);
+}
+
+static gboolean
+str_equal_constant_time (const char *a,
+                         const char *b)
+{
+  gsize len = strlen (a);
+  guint8 diff = 0;
+  gsize i;
+
+  if (len != strlen (b))
+    return FALSE;
+  for (i = 0; i < len; i++)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+struct TreeWalkData {
+  gboolean caught_error;
+  struct EvTag *evtag;
+  git_repository *repo;
+  git_odb *odb;
+  GCancellable *cancellable;
+  GError **error;
+  GArray *manifest;
+  git_oid root_tree;
+  GHashTable *submodule_names;
+  const char *prefix;
+};
+
+/* A manifest records the sequence of objects hashed for a tree, so
+ * that later runs for the same tree (including when it is the tree of
+ * a submodule commit shared between tags) can skip parsing trees and
+ * simply stream the objects.  It only depends on the tree id, and is
+ * stored in a compact binary format authenticated like the other
+ * cached data: a magic string, then for each entry a kind byte and
+ * raw object id, followed either by the little-endian 64 bit object
+ * size or, for submodules, a 16 bit length and the path.  The HMAC
+ * of all that is appended in hex.
+ */
+#define EVTAG_MANIFEST_MAGIC "EVTAGMF1"
+#define EVTAG_MANIFEST_HMAC_LEN 64
+
+typedef enum {
+  EVTAG_MANIFEST_BLOB = 'b',
+  EVTAG_MANIFEST_TREE = 't',
+  EVTAG_MANIFEST_SUBMODULE = 's'
+} EvTagManifestKind;
+
+typedef struct {
+  guint8 kind;
+  git_oid oid;
+  guint64 size;
+  char *path;
+} EvTagManifestEntry;
+
+static void
+manifest_entry_clear (gpointer data)
+{
+  EvTagManifestEntry *entry = data;
+  g_free (entry->path);
+}
+
+static GArray *
+manifest_new (void)
+{
+  GArray *manifest = g_array_new (FALSE, TRUE, sizeof (EvTagManifestEntry));
+  g_array_set_clear_func (manifest, manifest_entry_clear);
+  return manifest;
+}
+
+static void
+manifest_add_object (GArray        *manifest,
+                     git_otype      otype,
+                     const git_oid *oid,
+                     guint64        size)
+{
+  EvTagManifestEntry entry = { 0, };
+
+  entry.kind = otype == GIT_OBJ_TREE ? EVTAG_MANIFEST_TREE : EVTAG_MANIFEST_BLOB;
+  git_oid_cpy (&entry.oid, oid);
+  entry.size = size;
+  g_array_append_val (manifest, entry);
+}
+
+static void
+manifest_add_submodule (GArray        *manifest,
+                        const char    *path,
+                        const git_oid *commit)
+{
+  EvTagManifestEntry entry = { 0, };
+
+  entry.kind = EVTAG_MANIFEST_SUBMODULE;
+  git_oid_cpy (&entry.oid, commit);
+  entry.path = g_strdup (path);
+  g_array_append_val (manifest, entry);
+}
+
+static char *
+manifest_path (struct EvTag  *self,
+               const git_oid *tree_oid)
+{
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+  char *dir = evtag_state_dir (self);
+  char *path = g_build_filename (dir, "manifests",
+                                 git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), tree_oid),
+                                 NULL);
+  g_free (dir);
+  return path;
+}
+
+static gboolean
+manifest_save (struct EvTag   *self,
+               const git_oid  *tree_oid,
+               GArray         *manifest,
+               GError        **error)
+{
+  gboolean ret = FALSE;
+  GBytes *key;
+  GByteArray *buf = g_byte_array_new ();
+  char *path = NULL;
+  char *dir = NULL;
+  char *hmac = NULL;
+  guint i;
+
+  key = evtag_get_cache_key (self, error);
+  if (!key)
+    goto out;
+
+  g_byte_array_append (buf, (guint8*)EVTAG_MANIFEST_MAGIC, strlen (EVTAG_MANIFEST_MAGIC));
+  for (i = 0; i < manifest->len; i++)
+    {
+      EvTagManifestEntry *entry = &g_array_index (manifest, EvTagManifestEntry, i);
+
+      g_byte_array_append (buf, &entry->kind, 1);
+      g_byte_array_append (buf, entry->oid.id, GIT_OID_RAWSZ);
+      if (entry->kind == EVTAG_MANIFEST_SUBMODULE)
+        {
+          gsize pathlen = strlen (entry->path);
+          guint16 len_le;
+
+          if (pathlen > G_MAXUINT16)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Submodule path too long: %s", entry->path);
+              goto out;
+            }
+          len_le = GUINT16_TO_LE (pathlen);
+          g_byte_array_append (buf, (guint8*)&len_le, sizeof (len_le));
+          g_byte_array_append (buf, (guint8*)entry->path, pathlen);
+        }
+      else
+        {
+          guint64 size_le = GUINT64_TO_LE (entry->size);
+          g_byte_array_append (buf, (guint8*)&size_le, sizeof (size_le));
+        }
+    }
+
+  hmac = evtag_cache_hmac (key, buf->data, buf->len);
+  g_byte_array_append (buf, (guint8*)hmac, EVTAG_MANIFEST_HMAC_LEN);
+
+  path = manifest_path (self, tree_oid);
+  dir = g_path_get_dirname (path);
+  if (!ensure_state_subdir (dir, error))
+    goto out;
+
+  if (!g_file_set_contents (path, (char*)buf->data, buf->len, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  g_free (hmac);
+  g_free (dir);
+  g_free (path);
+  g_byte_array_free (buf, TRUE);
+  return ret;
+}
+
+/* Sets @out_manifest to %NULL if there is no valid manifest for @tree_oid */
+static gboolean
+manifest_load (struct EvTag   *self,
+               const git_oid  *tree_oid,
+               GArray        **out_manifest,
+               GError        **error)
+{
+  gboolean ret = FALSE;
+  GBytes *key;
+  char *path = NULL;
+  char *contents = NULL;
+  gsize len;
+  gsize magiclen = strlen (EVTAG_MANIFEST_MAGIC);
+  char *hmac = NULL;
+  char trailer[EVTAG_MANIFEST_HMAC_LEN+1];
+  GArray *manifest = NULL;
+  const guint8 *p;
+  const guint8 *end;
+  GError *local_error = NULL;
+
+  *out_manifest = NULL;
+
+  key = evtag_get_cache_key (self, error);
+  if (!key)
+    goto out;
+
+  path = manifest_path (self, tree_oid);
+  if (!g_file_get_contents (path, &contents, &len, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&local_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, local_error);
+      goto out;
+    }
+
+  if (len < magiclen + EVTAG_MANIFEST_HMAC_LEN ||
+      memcmp (contents, EVTAG_MANIFEST_MAGIC, magiclen) != 0)
+    goto invalid;
+
+  hmac = evtag_cache_hmac (key, (guint8*)contents, len - EVTAG_MANIFEST_HMAC_LEN);
+  memcpy (trailer, contents + len - EVTAG_MANIFEST_HMAC_LEN, EVTAG_MANIFEST_HMAC_LEN);
+  trailer[EVTAG_MANIFEST_HMAC_LEN] = '\0';
+  if (!str_equal_constant_time (hmac, trailer))
+    goto invalid;
+
+  manifest = manifest_new ();
+  p = (guint8*)contents + magiclen;
+  end = (guint8*)contents + len - EVTAG_MANIFEST_HMAC_LEN;
+  while (p < end)
+    {
+      guint8 kind = *p;
+      git_oid oid;
+
+      if (end - p < 1 + GIT_OID_RAWSZ)
+        goto invalid;
+      git_oid_fromraw (&oid, p + 1);
+      p += 1 + GIT_OID_RAWSZ;
+
+      if (kind == EVTAG_MANIFEST_SUBMODULE)
+        {
+          guint16 pathlen;
+          char *subpath;
+
+          if (end - p < (gssize)sizeof (pathlen))
+            goto invalid;
+          memcpy (&pathlen, p, sizeof (pathlen));
+          pathlen = GUINT16_FROM_LE (pathlen);
+          p += sizeof (pathlen);
+          if (pathlen == 0 || end - p < pathlen)
+            goto invalid;
+          subpath = g_strndup ((char*)p, pathlen);
+          manifest_add_submodule (manifest, subpath, &oid);
+          g_free (subpath);
+          p += pathlen;
+        }
+      else if (kind == EVTAG_MANIFEST_BLOB || kind == EVTAG_MANIFEST_TREE)
+        {
+          guint64 size;
+
+          if (end - p < (gssize)sizeof (size))
+            goto invalid;
+          memcpy (&size, p, sizeof (size));
+          manifest_add_object (manifest,
+                               kind == EVTAG_MANIFEST_TREE ? GIT_OBJ_TREE : GIT_OBJ_BLOB,
+                               &oid, GUINT64_FROM_LE (size));
+          p += sizeof (size);
+        }
+      else
+        goto invalid;
+    }
+
+  *out_manifest = manifest;
+  manifest = NULL;
+  ret = TRUE;
+  goto out;
+
+ invalid:
+  g_printerr ("warning: Ignoring invalid manifest %s\n", path);
+  ret = TRUE;
+ out:
+  if (manifest)
+    g_array_unref (manifest);
+  g_free (hmac);
+  g_free (contents);
+  g_free (path);
+  return ret;
+}
+
+/* Opens a stream for a blob larger than EVTAG_STREAM_THRESHOLD, and
+ * otherwise reads the object whole.  Only loose objects can be
+ * streamed, so the stream is opened first, rather than looking up the
+ * header of every blob to find its size: for a packed one that fails
+ * without reading anything.  Large packed blobs are read whole too.
+ * Either way this runs where the read is done, which with --jobs is a
+ * pool thread.  @known_size is -1 unless a manifest recorded it.
+ */
+static int
+read_object_or_stream (git_odb         *odb,
+                       const git_oid   *oid,
+                       git_otype        otype,
+                       gint64           known_size,
+                       git_odb_object **out_object,
+                       git_odb_stream **out_stream,
+                       size_t          *out_stream_size,
+                       git_otype       *out_stream_type)
+{
+  if (otype == GIT_OBJ_BLOB &&
+      (known_size < 0 || known_size > EVTAG_STREAM_THRESHOLD))
+    {
+      if (git_odb_open_rstream (out_stream, out_stream_size, out_stream_type, odb, oid) == 0)
+        {
+          if (*out_stream_size > EVTAG_STREAM_THRESHOLD)
+            return 0;
+          /* A small loose blob is read whole, for the object cache */
+          git_odb_stream_free (*out_stream);
+          *out_stream = NULL;
+        }
+      giterr_clear ();
+    }
+
+  return git_odb_read (out_object, odb, oid);
+}
+
+/* Hashes the object behind @stream, which read_object_or_stream()
+ * opened, in chunks.  A single object can take long enough to hash
+ * that --timeout checks @cancellable between the chunks.
+ */
+static gboolean
+checksum_object_stream (struct EvTag   *self,
+                        git_odb        *odb,
+                        const git_oid  *oid,
+                        git_odb_stream *stream,
+                        size_t          size,
+                        git_otype       otype,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  char *buf = NULL;
+  EvTagTimer timer;
+  EvTagTimer hash_timer;
+  guint64 hash_wall = 0;
+  guint64 hash_cpu = 0;
+  guint64 wall;
+  guint64 cpu;
+  gboolean archived = FALSE;
+
+  /* Counted as one object in the hash phase, like the others */
+  evtag_timer_start (&hash_timer, EVTAG_PHASE_HASH);
+  checksum_object_header (self, oid, otype, size);
+  evtag_timer_elapsed (&hash_timer, &hash_wall, &hash_cpu);
+  if (self->progress)
+    evtag_progress_update (self, FALSE);
+  if (self->archive)
+    archived = archive_object_begin (self->archive, odb, oid, otype, size);
+
+  buf = g_malloc (EVTAG_STREAM_CHUNK_SIZE);
+  while (size > 0)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+      evtag_timer_start (&timer, EVTAG_PHASE_ODB_READ);
+      r = git_odb_stream_read (stream, buf, MIN (size, EVTAG_STREAM_CHUNK_SIZE));
+      evtag_timer_stop (self, &timer);
+      if (!handle_libgit_ret (r < 0 ? r : 0, error))
+        goto out;
+      if (r == 0)
+        {
+          char oid_hexstr[GIT_OID_HEXSZ+1];
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Unexpected end of stream reading object %s",
+                       git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), oid));
+          goto out;
+        }
+      evtag_timer_start (&hash_timer, EVTAG_PHASE_HASH);
+      evtag_hash_update (self->checksum.hash, (guint8*)buf, r);
+      evtag_timer_elapsed (&hash_timer, &wall, &cpu);
+      hash_wall += wall;
+      hash_cpu += cpu;
+      if (archived)
+        {
+          evtag_timer_start (&timer, EVTAG_PHASE_LEGACY_ARCHIVE);
+          archive_object_data (self->archive, buf, r);
+          evtag_timer_stop (self, &timer);
+        }
+      size -= r;
+    }
+  if (archived)
+    archive_object_end (self->archive);
+
+  ret = TRUE;
+ out:
+  evtag_phase_add (self, EVTAG_PHASE_HASH, hash_wall, hash_cpu);
+  g_free (buf);
+  return ret;
+}
+
+/* Reading an object means inflating it and possibly resolving a
+ * long delta chain, which costs far more than hashing it.  When
+ * running with multiple jobs, the traversal only queues up object
+ * ids; a pool of threads reads them ahead of time, and the queue is
+ * consumed strictly in order so that the checksum stays the same.
+ */
+typedef struct {
+  git_odb *odb;
+  git_oid oid;
+  git_otype otype;
+  gint64 known_size;
+  GArray *manifest;
+  git_odb_object *object;
+  /* Instead of @object, for a large loose blob */
+  git_odb_stream *stream;
+  size_t stream_size;
+  git_otype stream_type;
+  char *errmsg;
+  guint64 read_wall_usec;
+  guint64 read_cpu_usec;
+  /* What it adds to the pipeline's pending_bytes */
+  guint64 pending_size;
+  /* Already in the object cache, or not to be admitted to it */
+  gboolean cached;
+  gboolean done;
+  /* Later jobs for the same object, which get it from this one when
+   * it is hashed instead of reading it again
+   */
+  GSList *followers;
+  /* Set on those; a follower of a streamed object still reads it */
+  gboolean follower;
+} EvTagReadJob;
+
+struct EvTagPipeline {
+  GThreadPool *pool;
+  GMutex lock;
+  GCond cond;
+  GQueue pending;
+  guint max_pending;
+  /* Size of the objects in @pending that have been read */
+  guint64 pending_bytes;
+  /* For streamed objects; see checksum_object_stream() */
+  GCancellable *cancellable;
+  /* Jobs being read, by object id, when the object cache is enabled.
+   * Only the traversal thread, which also consumes the queue, uses it.
+   */
+  GHashTable *in_flight;
+};
+
+static void
+read_job_free (EvTagReadJob *job)
+{
+  if (job->object)
+    git_odb_object_free (job->object);
+  if (job->stream)
+    git_odb_stream_free (job->stream);
+  g_slist_free (job->followers);
+  g_free (job->errmsg);
+  g_free (job);
+}
+
+static void
+read_job_thread (gpointer data,
+                 gpointer user_data)
+{
+  EvTagReadJob *job = data;
+  struct EvTagPipeline *pipeline = user_data;
+  git_odb_object *object = NULL;
+  git_odb_stream *stream = NULL;
+  size_t stream_size = 0;
+  git_otype stream_type = GIT_OBJ_BAD;
+  char *errmsg = NULL;
+  EvTagTimer timer;
+  guint64 wall;
+  guint64 cpu;
+  int r;
+
+  evtag_timer_start (&timer, EVTAG_PHASE_ODB_READ);
+  /* Large loose blobs are left open for the consumer to stream */
+  r = read_object_or_stream (job->odb, &job->oid, job->otype, job->known_size,
+                             &object, &stream, &stream_size, &stream_type);
+  evtag_timer_elapsed (&timer, &wall, &cpu);
+  if (r != 0)
+    {
+      /* The libgit2 error is thread-local, so copy it out for the consumer */
+      const git_error *giterror = giterr_last ();
+      errmsg = g_strdup (giterror && giterror->message ? giterror->message : "???");
+    }
+
+  g_mutex_lock (&pipeline->lock);
+  job->object = object;
+  job->stream = stream;
+  job->stream_size = stream_size;
+  job->stream_type = stream_type;
+  job->errmsg = errmsg;
+  job->read_wall_usec = wall;
+  job->read_cpu_usec = cpu;
+  job->done = TRUE;
+  if (object)
+    job->pending_size = git_odb_object_size (object);
+  pipeline->pending_bytes += job->pending_size;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->lock);
+}
+
+/* @cancellable must outlive the pipeline */
+static struct EvTagPipeline *
+evtag_pipeline_new (guint          n_jobs,
+                    gboolean       share_reads,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  struct EvTagPipeline *pipeline = g_new0 (struct EvTagPipeline, 1);
+
+  pipeline->cancellable = cancellable;
+  if (share_reads)
+    pipeline->in_flight = g_hash_table_new (oid_hash, oid_equal);
+  g_mutex_init (&pipeline->lock);
+  g_cond_init (&pipeline->cond);
+  g_queue_init (&pipeline->pending);
+  /* Enough to keep every thread busy while the consumer is hashing
+   * a large object, without holding too many inflated objects at once;
+   * EVTAG_PIPELINE_MAX_BYTES bounds them by size too.
+   */
+  pipeline->max_pending = n_jobs * 4;
+
+  pipeline->pool = g_thread_pool_new (read_job_thread, pipeline, n_jobs, TRUE, error);
+  if (!pipeline->pool)
+    {
+      if (pipeline->in_flight)
+        g_hash_table_unref (pipeline->in_flight);
+      g_mutex_clear (&pipeline->lock);
+      g_cond_clear (&pipeline->cond);
+      g_free (pipeline);
+      return NULL;
+    }
+
+  return pipeline;
+}
+
+static guint64
+evtag_pipeline_pending_bytes (struct EvTagPipeline *pipeline)
+{
+  guint64 bytes;
+
+  g_mutex_lock (&pipeline->lock);
+  bytes = pipeline->pending_bytes;
+  g_mutex_unlock (&pipeline->lock);
+
+  return bytes;
+}
+
+static EvTagReadJob *
+evtag_pipeline_wait_head (struct EvTagPipeline *pipeline)
+{
+  EvTagReadJob *job;
+
+  g_mutex_lock (&pipeline->lock);
+  job = g_queue_pop_head (&pipeline->pending);
+  while (job && !job->done)
+    g_cond_wait (&pipeline->cond, &pipeline->lock);
+  if (job)
+    pipeline->pending_bytes -= job->pending_size;
+  g_mutex_unlock (&pipeline->lock);
+
+  return job;
+}
+
+/* Hash the oldest queued object, waiting for it to be read if necessary */
+static gboolean
+evtag_pipeline_consume_one (struct EvTag  *self,
+                            GError       **error)
+{
+  gboolean ret = FALSE;
+  struct EvTagPipeline *pipeline = self->pipeline;
+  EvTagReadJob *job = evtag_pipeline_wait_head (pipeline);
+  guint64 size;
+  GSList *l;
+
+  g_assert (job != NULL);
+
+  if (pipeline->in_flight &&
+      g_hash_table_lookup (pipeline->in_flight, &job->oid) == job)
+    g_hash_table_remove (pipeline->in_flight, &job->oid);
+
+  evtag_phase_add (self, EVTAG_PHASE_ODB_READ, job->read_wall_usec, job->read_cpu_usec);
+
+  if (job->errmsg)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, job->errmsg);
+      goto out;
+    }
+
+  /* What it followed was streamed, so there was nothing to share */
+  if (job->follower && !job->object)
+    {
+      EvTagTimer timer;
+      int r;
+
+      evtag_timer_start (&timer, EVTAG_PHASE_ODB_READ);
+      r = read_object_or_stream (job->odb, &job->oid, job->otype, job->known_size,
+                                 &job->object, &job->stream, &job->stream_size,
+                                 &job->stream_type);
+      evtag_timer_stop (self, &timer);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+    }
+
+  if (job->stream)
+    {
+      if (!checksum_object_stream (self, job->odb, &job->oid, job->stream,
+                                   job->stream_size, job->stream_type,
+                                   self->pipeline->cancellable, error))
+        goto out;
+      size = job->stream_size;
+    }
+  else
+    {
+      checksum_odb_object (self, job->odb, job->object);
+      size = git_odb_object_size (job->object);
+      if (!job->cached)
+        evtag_cache_admit (self, job->object);
+
+      for (l = job->followers; l; l = l->next)
+        {
+          EvTagReadJob *follower = l->data;
+
+          if (git_odb_object_dup (&follower->object, job->object) == 0)
+            self->cache_hits++;
+        }
+    }
+
+  if (job->manifest)
+    manifest_add_object (job->manifest, job->otype, &job->oid, size);
+
+  ret = TRUE;
+ out:
+  read_job_free (job);
+  return ret;
+}
+
+/* Hash everything queued so far */
+static gboolean
+evtag_pipeline_flush (struct EvTag  *self,
+                      GError       **error)
+{
+  if (!self->pipeline)
+    return TRUE;
+
+  while (!g_queue_is_empty (&self->pipeline->pending))
+    {
+      if (!evtag_pipeline_consume_one (self, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* Wait for outstanding reads and drop them; used on error paths
+ * before the object databases they reference are freed.
+ */
+static void
+evtag_pipeline_discard (struct EvTagPipeline *pipeline)
+{
+  EvTagReadJob *job;
+
+  if (!pipeline)
+    return;
+
+  if (pipeline->in_flight)
+    g_hash_table_remove_all (pipeline->in_flight);
+  while ((job = evtag_pipeline_wait_head (pipeline)) != NULL)
+    read_job_free (job);
+}
+
+static void
+evtag_pipeline_free (struct EvTagPipeline *pipeline)
+{
+  evtag_pipeline_discard (pipeline);
+  g_thread_pool_free (pipeline->pool, FALSE, TRUE);
+  if (pipeline->in_flight)
+    g_hash_table_unref (pipeline->in_flight);
+  g_mutex_clear (&pipeline->lock);
+  g_cond_clear (&pipeline->cond);
+  g_free (pipeline);
+}
+
+static gboolean
+checksum_object_id (struct TreeWalkData  *twdata,
+                    const git_oid *oid,
+                    git_otype      otype,
+                    gint64         known_size,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  guint64 size;
+  git_odb_object *odbobj = NULL;
+  git_odb_stream *stream = NULL;
+  size_t stream_size;
+  git_otype stream_type;
+  git_odb_object *cached;
+  struct EvTagPipeline *pipeline = twdata->evtag->pipeline;
+  EvTagTimer timer;
+
+  if (g_cancellable_set_error_if_cancelled (twdata->cancellable, error))
+    goto out;
+
+  if (pipeline)
+    {
+      EvTagReadJob *job = g_new0 (EvTagReadJob, 1);
+      EvTagReadJob *owner = NULL;
+
+      job->odb = twdata->odb;
+      git_oid_cpy (&job->oid, oid);
+      job->otype = otype;
+      job->known_size = known_size;
+      job->manifest = twdata->manifest;
+
+      if (pipeline->in_flight)
+        owner = g_hash_table_lookup (pipeline->in_flight, oid);
+      cached = owner ? NULL : evtag_cache_lookup (twdata->evtag, oid);
+      /* Still goes through the queue, to be hashed in order; a
+       * follower gets its object when @owner is hashed, before it.
+       */
+      if (owner)
+        {
+          owner->followers = g_slist_prepend (owner->followers, job);
+          job->follower = TRUE;
+          job->cached = TRUE;
+          job->done = TRUE;
+        }
+      else if (cached)
+        {
+          job->object = cached;
+          job->cached = TRUE;
+          job->done = TRUE;
+        }
+      /* Only queued once a thread will complete it, or flushing
+       * would wait for it forever.
+       */
+      else if (!g_thread_pool_push (pipeline->pool, job, error))
+        {
+          read_job_free (job);
+          goto out;
+        }
+      else if (pipeline->in_flight)
+        g_hash_table_insert (pipeline->in_flight, &job->oid, job);
+
+      g_mutex_lock (&pipeline->lock);
+      g_queue_push_tail (&pipeline->pending, job);
+      g_mutex_unlock (&pipeline->lock);
+
+      /* Only the traversal thread adds to the queue, so its length is safe unlocked */
+      while (!g_queue_is_empty (&pipeline->pending) &&
+             (g_queue_get_length (&pipeline->pending) >= pipeline->max_pending ||
+              evtag_pipeline_pending_bytes (pipeline) >= EVTAG_PIPELINE_MAX_BYTES))
+        {
+          if (!evtag_pipeline_consume_one (twdata->evtag, error))
+            goto out;
+        }
+
+      ret = TRUE;
+      goto out;
+    }
+
+  cached = evtag_cache_lookup (twdata->evtag, oid);
+  if (cached)
+    {
+      checksum_odb_object (twdata->evtag, twdata->odb, cached);
+      size = git_odb_object_size (cached);
+      git_odb_object_free (cached);
+      goto done;
+    }
+
+  evtag_timer_start (&timer, EVTAG_PHASE_ODB_READ);
+  r = read_object_or_stream (twdata->odb, oid, otype, known_size,
+                             &odbobj, &stream, &stream_size, &stream_type);
+  evtag_timer_stop (twdata->evtag, &timer);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  if (stream)
+    {
+      if (!checksum_object_stream (twdata->evtag, twdata->odb, oid, stream,
+                                   stream_size, stream_type, twdata->cancellable, error))
+        goto out;
+      size = stream_size;
+    }
+  else
+    {
+      checksum_odb_object (twdata->evtag, twdata->odb, odbobj);
+      size = git_odb_object_size (odbobj);
+      evtag_cache_admit (twdata->evtag, odbobj);
+    }
+
+ done:
+  if (twdata->manifest)
+    manifest_add_object (twdata->manifest, otype, oid, size);
+  
+  ret = TRUE;
+ out:
+  if (odbobj)
+    git_odb_object_free (odbobj);
+  if (stream)
+    git_odb_stream_free (stream);
+  return ret;
+}
+
+static int
+checksum_submodule (struct TreeWalkData *twdata, const char *path,
+                    const git_oid *commit_oid);
+
+static int
+submodule_name_cb (const git_config_entry *entry,
+                   void                   *payload)
+{
+  GHashTable *names = payload;
+  const char *name = entry->name + strlen ("submodule.");
+  const char *suffix = strrchr (name, '.');
+
+  g_hash_table_replace (names, g_strdup (entry->value),
+                        g_strndup (name, suffix - name));
+  return 0;
+}
+
+/* Submodule names are read from the .gitmodules of the commit being
+ * checksummed rather than from the working directory, so that they
+ * are right for any commit, and in bare repositories.
+ */
+static gboolean
+load_submodule_names (struct TreeWalkData *twdata,
+                      GError             **error)
+{
+  gboolean ret = FALSE;
+  git_tree *tree = NULL;
+  git_tree_entry *entry = NULL;
+  git_blob *blob = NULL;
+  git_config *config = NULL;
+  char *tmppath = NULL;
+  int fd;
+  int r;
+
+  twdata->submodule_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  r = git_tree_lookup (&tree, twdata->repo, &twdata->root_tree);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_tree_entry_bypath (&entry, tree, ".gitmodules");
+  if (r == GIT_ENOTFOUND)
+    {
+      ret = TRUE;
+      goto out;
+    }
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  r = git_blob_lookup (&blob, twdata->repo, git_tree_entry_id (entry));
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  /* Let libgit2 parse the config syntax */
+  fd = g_file_open_tmp ("git-evtag-gitmodules-XXXXXX", &tmppath, error);
+  if (fd < 0)
+    goto out;
+  (void) close (fd);
+  if (!g_file_set_contents (tmppath, (const char*)git_blob_rawcontent (blob),
+                            (gssize)git_blob_rawsize (blob), error))
+    goto out;
+
+  r = git_config_open_ondisk (&config, tmppath);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_config_foreach_match (config, "^submodule\\..*\\.path$",
+                                submodule_name_cb, twdata->submodule_names);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (tmppath)
+    (void) unlink (tmppath);
+  g_free (tmppath);
+  if (config)
+    git_config_free (config);
+  if (blob)
+    git_blob_free (blob);
+  if (entry)
+    git_tree_entry_free (entry);
+  if (tree)
+    git_tree_free (tree);
+  return ret;
+}
+
+/* Whether the submodule name @name stays below the directory it is
+ * looked up in; "a..b" is a fine name, "a/../b" isn't.
+ */
+static gboolean
+submodule_name_is_safe (const char *name)
+{
+  gboolean ret = TRUE;
+  char **components;
+  char **iter;
+
+  if (g_path_is_absolute (name))
+    return FALSE;
+
+  components = g_strsplit (name, "/", -1);
+  for (iter = components; *iter; iter++)
+    {
+      if (strcmp (*iter, "..") == 0)
+        {
+          ret = FALSE;
+          break;
+        }
+    }
+  g_strfreev (components);
+  return ret;
+}
+
+/* The threads to read objects with: --jobs, unless overridden for a
+ * batch, and only one if libgit2 was built without thread support.
+ */
+static guint
+evtag_get_n_jobs (struct EvTag *self)
+{
+  guint n_jobs;
+
+  if (self->n_jobs > 0)
+    n_jobs = self->n_jobs;
+  else
+    n_jobs = opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ();
+  if (!(git_libgit2_features () & GIT_FEATURE_THREADS))
+    n_jobs = 1;
+  self->n_jobs_used = MAX (self->n_jobs_used, n_jobs);
+  return n_jobs;
+}
+
+/* Finds the repository for the submodule at @path, trying in order
+ * DIR/NAME[.git] for --submodule-store=DIR, $GIT_DIR/modules/NAME
+ * where `git submodule update` keeps it, and finally the checked out
+ * submodule.  The first two don't need a working directory, and are
+ * opened as bare repositories.  With --bundle, every submodule is in
+ * the repository the bundles were indexed into.
+ */
+static char *
+submodule_repo_location (struct TreeWalkData *twdata,
+                         const char          *path,
+                         gboolean            *out_bare,
+                         GError             **error)
+{
+  char *location = NULL;
+  char *dotgit = NULL;
+  const char *name;
+  GPtrArray *candidates = g_ptr_array_new_with_free_func (g_free);
+  guint i;
+
+  /* Objects from --submodule-bundle are in the same repository */
+  if (opt_bundle)
+    {
+      location = g_strdup (git_repository_path (twdata->repo));
+      *out_bare = TRUE;
+      goto out;
+    }
+
+  if (!twdata->submodule_names &&
+      !load_submodule_names (twdata, error))
+    goto out;
+
+  name = g_hash_table_lookup (twdata->submodule_names, path);
+  if (!name)
+    name = path;
+
+  /* Don't let .gitmodules point outside of the stores */
+  if (submodule_name_is_safe (name))
+    {
+      if (opt_submodule_store)
+        {
+          g_ptr_array_add (candidates, g_build_filename (opt_submodule_store, name, NULL));
+          g_ptr_array_add (candidates, g_strconcat (candidates->pdata[0], ".git", NULL));
+        }
+      g_ptr_array_add (candidates, g_build_filename (git_repository_path (twdata->repo),
+                                                     "modules", name, NULL));
+    }
+
+  /* A directory that isn't a repository, like a stale or unrelated
+   * one in the store, doesn't hide the candidates after it
+   */
+  for (i = 0; i < candidates->len; i++)
+    {
+      if (g_file_test (candidates->pdata[i], G_FILE_TEST_IS_DIR) &&
+          git_repository_open_ext (NULL, candidates->pdata[i],
+                                   GIT_REPOSITORY_OPEN_NO_SEARCH | GIT_REPOSITORY_OPEN_BARE,
+                                   NULL) == 0)
+        {
+          location = g_strdup (candidates->pdata[i]);
+          *out_bare = TRUE;
+          goto out;
+        }
+    }
+
+  if (git_repository_is_bare (twdata->repo))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No repository found for submodule %s; use --submodule-store", path);
+      goto out;
+    }
+
+  /* A checked out submodule has a .git directory or file */
+  location = g_build_filename (git_repository_workdir (twdata->repo), path, NULL);
+  dotgit = g_build_filename (location, ".git", NULL);
+  if (!g_file_test (dotgit, G_FILE_TEST_EXISTS))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Missing `git submodule update --init`? No repository found for submodule %s",
+                   path);
+      g_free (location);
+      location = NULL;
+      goto out;
+    }
+  *out_bare = FALSE;
+
+ out:
+  g_free (dotgit);
+  g_ptr_array_unref (candidates);
+  return location;
+}
+
+static gboolean
+open_submodule_location (const char      *location,
+                         gboolean         bare,
+                         git_repository **out_repo,
+                         GError         **error)
+{
+  int r;
+
+  if (bare)
+    r = git_repository_open_bare (out_repo, location);
+  else
+    r = git_repository_open_ext (out_repo, location, GIT_REPOSITORY_OPEN_NO_SEARCH, NULL);
+  return handle_libgit_ret (r, error);
+}
+
+static gboolean
+open_submodule_repo (struct TreeWalkData *twdata,
+                     const char          *path,
+                     git_repository     **out_repo,
+                     GError             **error)
+{
+  gboolean ret;
+  gboolean bare;
+  char *location = submodule_repo_location (twdata, path, &bare, error);
+
+  if (!location)
+    return FALSE;
+  ret = open_submodule_location (location, bare, out_repo, error);
+  g_free (location);
+  return ret;
+}
+
+/* Submodule repositories are kept for the whole run, by resolved git
+ * directory, so that a repository used at several paths is opened once.
+ * Repositories whose object directories resolve to the same one also
+ * read through the same odb, so its pack indexes are loaded and
+ * objects cached once; each distinct object store gets its own odb,
+ * so that a lookup doesn't fail through every other submodule first.
+ * Submodules cloned with --reference to the same mirror still share
+ * its packs, which libgit2 keeps open once per process by path.
+ *
+ * On success, *@repo is replaced by the shared repository, which is
+ * owned by @self, and *@out_odb is set to its odb, which is too; on
+ * failure *@repo is freed and set to %NULL.
+ */
+typedef struct {
+  git_repository *repo;
+  git_odb *odb;
+} EvTagSharedRepo;
+
+static void
+shared_repo_free (gpointer data)
+{
+  EvTagSharedRepo *shared = data;
+
+  git_repository_free (shared->repo);
+  g_free (shared);
+}
+
+static gboolean
+evtag_share_submodule_repo (struct EvTag    *self,
+                            git_repository **repo,
+                            git_odb        **out_odb,
+                            GError         **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  char *resolved = realpath (git_repository_path (*repo), NULL);
+  char *key = g_strdup (resolved ? resolved : git_repository_path (*repo));
+  char *objects_dir = NULL;
+  EvTagSharedRepo *shared;
+  git_odb *odb;
+
+  free (resolved);
+
+  if (!self->shared_repos)
+    self->shared_repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                shared_repo_free);
+  if (!self->shared_odbs)
+    self->shared_odbs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)git_odb_free);
+
+  shared = g_hash_table_lookup (self->shared_repos, key);
+  if (shared)
+    {
+      git_repository_free (*repo);
+      *repo = shared->repo;
+      *out_odb = shared->odb;
+      self->n_repos_reused++;
+      ret = TRUE;
+      goto out;
+    }
+
+  objects_dir = g_build_filename (key, "objects", NULL);
+  resolved = realpath (objects_dir, NULL);
+  if (resolved)
+    {
+      g_free (objects_dir);
+      objects_dir = g_strdup (resolved);
+      free (resolved);
+    }
+
+  odb = g_hash_table_lookup (self->shared_odbs, objects_dir);
+  if (!odb)
+    {
+      /* Also loads its alternates */
+      r = git_odb_open (&odb, objects_dir);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+      g_hash_table_insert (self->shared_odbs, objects_dir, odb);
+      objects_dir = NULL;
+    }
+  git_repository_set_odb (*repo, odb);
+
+  shared = g_new0 (EvTagSharedRepo, 1);
+  shared->repo = *repo;
+  shared->odb = odb;
+  g_hash_table_insert (self->shared_repos, key, shared);
+  key = NULL;
+  *out_odb = odb;
+  self->n_repos_opened++;
+  ret = TRUE;
+ out:
+  if (!ret)
+    {
+      git_repository_free (*repo);
+      *repo = NULL;
+    }
+  g_free (objects_dir);
+  g_free (key);
+  return ret;
+}
+
+/* --checkpoint saves the state of the walk every --checkpoint-interval
+ * tree entries, so that a run that is interrupted or times out on a
+ * very large tree can pick up where it stopped instead of starting
+ * over.  A checkpoint is taken between two entries of a tree, once
+ * everything before the entry is hashed, and has the state of the
+ * SHA-512, the counters, and the position of the entry as its index in
+ * each tree on the way there, through submodules.  To resume, the walk
+ * goes back down to that entry, reading the trees and commits on the
+ * way without hashing them.
+ *
+ * The file is a key file authenticated with the cache key, like the
+ * other state, since a forged hash state could make any tree verify;
+ * it is rewritten whole for each checkpoint, so it only holds the
+ * latest one.  FILE.history gets a line for every checkpoint written,
+ * with the path and a fingerprint of the hash state at that point, so
+ * that comparing the logs of two runs which disagree (for example with
+ * --checkpoint-interval=1) finds the first path where they diverge.
+ * It is only appended to, and not synced, since nothing is resumed
+ * from it.
+ */
+#define EVTAG_CHECKPOINT_GROUP "Checkpoint"
+#define EVTAG_CHECKPOINT_VERSION 2
+#define EVTAG_CHECKPOINT_DEFAULT_INTERVAL 100000
+
+struct EvTagCheckpoint {
+  char *path;
+  char commit[GIT_OID_HEXSZ+1];
+  /* Index of the current entry in each tree of the walk */
+  GArray *position;
+  /* The position loaded from the file; the walk is going back there
+   * while @resuming is set.
+   */
+  GArray *resume;
+  gboolean resuming;
+  /* Loaded from a walk that finished */
+  gboolean complete;
+  guint64 n_entries;
+  guint64 next_save;
+  char *history_path;
+  /* Opened on the first save; appended to when resuming, otherwise
+   * started over
+   */
+  FILE *history;
+};
+
+/* What the HMAC covers, in order */
+static const char *const checkpoint_keys[] = {
+  "Version", "Commit", "Complete", "Entries", "Position", "Path", "State",
+  "Submodules", "Commits", "CommitBytes", "Trees", "TreeBytes", "Blobs", "BlobBytes",
+  NULL
+};
+
+/* Trees and commits are read once, on the traversal thread since it
+ * needs their contents to go on, then queued to be hashed in order
+ * like any other object; the caller gets a reference to parse.
+ */
+static gboolean
+checksum_object_read (struct TreeWalkData  *twdata,
+                      const git_oid        *oid,
+                      git_otype             otype,
+                      git_odb_object      **out_object,
+                      GError              **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  git_odb_object *object;
+  gboolean cached;
+  struct EvTagPipeline *pipeline = twdata->evtag->pipeline;
+  EvTagTimer timer;
+
+  if (g_cancellable_set_error_if_cancelled (twdata->cancellable, error))
+    return FALSE;
+
+  object = evtag_cache_lookup (twdata->evtag, oid);
+  cached = object != NULL;
+  if (!object)
+    {
+      evtag_timer_start (&timer, EVTAG_PHASE_ODB_READ);
+      r = git_odb_read (&object, twdata->odb, oid);
+      evtag_timer_stop (twdata->evtag, &timer);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+    }
+
+  if (git_odb_object_type (object) != otype)
+    {
+      char oid_hexstr[GIT_OID_HEXSZ+1];
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Object %s is a %s, expected a %s",
+                   git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), oid),
+                   git_object_type2string (git_odb_object_type (object)),
+                   git_object_type2string (otype));
+      goto out;
+    }
+  /* Admitted now rather than when hashed, so a repeat queued before
+   * then finds it
+   */
+  if (!cached)
+    evtag_cache_admit (twdata->evtag, object);
+
+  /* Hashed before the checkpoint being resumed */
+  if (twdata->evtag->checkpoint && twdata->evtag->checkpoint->resuming)
+    ;
+  else if (pipeline)
+    {
+      EvTagReadJob *job = g_new0 (EvTagReadJob, 1);
+
+      job->odb = twdata->odb;
+      git_oid_cpy (&job->oid, oid);
+      job->otype = otype;
+      job->known_size = -1;
+      job->manifest = twdata->manifest;
+      job->cached = TRUE;
+      job->done = TRUE;
+      r = git_odb_object_dup (&job->object, object);
+      g_assert (r == 0);
+
+      g_mutex_lock (&pipeline->lock);
+      g_queue_push_tail (&pipeline->pending, job);
+      g_mutex_unlock (&pipeline->lock);
+
+      if (g_queue_get_length (&pipeline->pending) >= pipeline->max_pending)
+        {
+          if (!evtag_pipeline_consume_one (twdata->evtag, error))
+            goto out;
+        }
+    }
+  else
+    {
+      checksum_odb_object (twdata->evtag, twdata->odb, object);
+      if (twdata->manifest)
+        manifest_add_object (twdata->manifest, otype, oid, git_odb_object_size (object));
+    }
+
+  *out_object = object;
+  object = NULL;
+  ret = TRUE;
+ out:
+  if (object)
+    git_odb_object_free (object);
+  return ret;
+}
+
+static gboolean
+parse_tree (git_odb_object  *tree,
+            GArray          *entries,
+            GError         **error)
+{
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+
+  if (evtag_parse_tree_data (git_odb_object_data (tree), git_odb_object_size (tree), entries))
+    return TRUE;
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Corrupt tree object %s",
+               git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), git_odb_object_id (tree)));
+  return FALSE;
+}
+
+/* A commit always starts with its tree */
+static gboolean
+parse_commit_tree_data (const char     *data,
+                        gsize           len,
+                        const git_oid  *commit_oid,
+                        git_oid        *out_tree,
+                        GError        **error)
+{
+  if (len < strlen ("tree \n") + GIT_OID_HEXSZ ||
+      !g_str_has_prefix (data, "tree ") ||
+      data[strlen ("tree ") + GIT_OID_HEXSZ] != '\n' ||
+      git_oid_fromstrn (out_tree, data + strlen ("tree "), GIT_OID_HEXSZ) != 0)
+    {
+      char oid_hexstr[GIT_OID_HEXSZ+1];
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Corrupt commit object %s",
+                   git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), commit_oid));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+parse_commit_tree (git_odb_object  *commit,
+                   git_oid         *out_tree,
+                   GError         **error)
+{
+  return parse_commit_tree_data (git_odb_object_data (commit), git_odb_object_size (commit),
+                                 git_odb_object_id (commit), out_tree, error);
+}
+
+static guint64
+checkpoint_interval (void)
+{
+  return opt_checkpoint_interval > 0 ? (guint64)opt_checkpoint_interval : EVTAG_CHECKPOINT_DEFAULT_INTERVAL;
+}
+
+static gboolean
+validate_checkpoint_options (GError **error)
+{
+  if (!opt_checkpoint)
+    return TRUE;
+  if (opt_checkpoint_interval < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --checkpoint-interval %d", opt_checkpoint_interval);
+      return FALSE;
+    }
+  /* Neither can be resumed part way */
+  if (opt_manifest_cache || opt_with_legacy_archive_tag)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "--checkpoint can't be used with %s",
+                   opt_manifest_cache ? "--manifest-cache" : "--with-legacy-archive-tag");
+      return FALSE;
+    }
+  /* Its key would be in the temporary repository */
+  if (opt_bundle)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           "--checkpoint can't be used with --bundle");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+evtag_checkpoint_free (EvTagCheckpoint *cp)
+{
+  g_free (cp->path);
+  g_array_unref (cp->position);
+  if (cp->resume)
+    g_array_unref (cp->resume);
+  if (cp->history)
+    fclose (cp->history);
+  g_free (cp->history_path);
+  g_free (cp);
+}
+
+static char *
+checkpoint_hmac (GBytes   *key,
+                 GKeyFile *keyfile)
+{
+  GString *buf = g_string_new ("");
+  const char *const *iter;
+  char *hmac;
+
+  for (iter = checkpoint_keys; *iter; iter++)
+    {
+      char *value = g_key_file_get_value (keyfile, EVTAG_CHECKPOINT_GROUP, *iter, NULL);
+
+      g_string_append_printf (buf, "%s=%s\n", *iter, value ? value : "");
+      g_free (value);
+    }
+
+  hmac = evtag_cache_hmac (key, (guint8*)buf->str, buf->len);
+  g_string_free (buf, TRUE);
+  return hmac;
+}
+
+static char *
+bytes_to_hex (GBytes *bytes)
+{
+  static const char hexchars[] = "0123456789abcdef";
+  gsize len;
+  const guint8 *data = g_bytes_get_data (bytes, &len);
+  char *hex = g_malloc (len * 2 + 1);
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      hex[i*2] = hexchars[data[i] >> 4];
+      hex[i*2+1] = hexchars[data[i] & 0xf];
+    }
+  hex[len * 2] = '\0';
+  return hex;
+}
+
+/* Returns %NULL if @hex isn't valid */
+static GBytes *
+hex_to_bytes (const char *hex)
+{
+  gsize len = strlen (hex);
+  guint8 *data;
+  gsize i;
+
+  if (len % 2 != 0)
+    return NULL;
+  data = g_malloc (len / 2);
+  for (i = 0; i < len / 2; i++)
+    {
+      int hi = g_ascii_xdigit_value (hex[i*2]);
+      int lo = g_ascii_xdigit_value (hex[i*2+1]);
+
+      if (hi < 0 || lo < 0)
+        {
+          g_free (data);
+          return NULL;
+        }
+      data[i] = (hi << 4) | lo;
+    }
+  return g_bytes_new_take (data, len / 2);
+}
+
+/* Records that everything before @entry_path is hashed, or with %NULL
+ * that the walk is complete.
+ */
+static gboolean
+evtag_checkpoint_save (struct EvTag  *self,
+                       const char    *entry_path,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  EvTagCheckpoint *cp = self->checkpoint;
+  GKeyFile *keyfile = g_key_file_new ();
+  GBytes *key;
+  GBytes *state = NULL;
+  char *state_hex = NULL;
+  char *fingerprint = NULL;
+  char *hmac = NULL;
+  char *contents = NULL;
+  gsize len;
+
+  key = evtag_get_cache_key (self, error);
+  if (!key)
+    goto out;
+
+  if (!evtag_pipeline_flush (self, error))
+    goto out;
+
+  state = self->checksum.hash->backend->save (self->checksum.hash->ctx);
+  state_hex = bytes_to_hex (state);
+
+  g_key_file_set_integer (keyfile, EVTAG_CHECKPOINT_GROUP, "Version", EVTAG_CHECKPOINT_VERSION);
+  g_key_file_set_string (keyfile, EVTAG_CHECKPOINT_GROUP, "Commit", cp->commit);
+  g_key_file_set_boolean (keyfile, EVTAG_CHECKPOINT_GROUP, "Complete", entry_path == NULL);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Entries", cp->n_entries);
+  if (entry_path)
+    {
+      g_key_file_set_integer_list (keyfile, EVTAG_CHECKPOINT_GROUP, "Position",
+                                   (gint*)cp->position->data, cp->position->len);
+      g_key_file_set_string (keyfile, EVTAG_CHECKPOINT_GROUP, "Path", entry_path);
+    }
+  g_key_file_set_string (keyfile, EVTAG_CHECKPOINT_GROUP, "State", state_hex);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Submodules", self->n_submodules);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Commits", self->checksum.n_commits);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "CommitBytes", self->checksum.commit_bytes);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Trees", self->checksum.n_trees);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "TreeBytes", self->checksum.tree_bytes);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Blobs", self->checksum.n_blobs);
+  g_key_file_set_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "BlobBytes", self->checksum.blob_bytes);
+
+  hmac = checkpoint_hmac (key, keyfile);
+  g_key_file_set_string (keyfile, EVTAG_CHECKPOINT_GROUP, "HMAC", hmac);
+
+  contents = g_key_file_to_data (keyfile, &len, NULL);
+  if (!g_file_set_contents (cp->path, contents, len, error))
+    goto out;
+
+  /* After the checkpoint, so that the log only has saved ones */
+  if (!cp->history)
+    {
+      cp->history = fopen (cp->history_path, cp->resume ? "ae" : "we");
+      if (!cp->history)
+        goto history_error;
+    }
+  fingerprint = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, state);
+  if (fprintf (cp->history, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %.16s %s\n",
+               cp->n_entries, self->checksum.commit_bytes + self->checksum.tree_bytes + self->checksum.blob_bytes,
+               fingerprint, entry_path ? entry_path : "(end)") < 0 ||
+      fflush (cp->history) != 0)
+    goto history_error;
+
+  cp->next_save = cp->n_entries + checkpoint_interval ();
+  ret = TRUE;
+  goto out;
+
+ history_error:
+  {
+    int errsv = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Writing %s: %s", cp->history_path, g_strerror (errsv));
+  }
+ out:
+  g_free (contents);
+  g_free (hmac);
+  g_free (fingerprint);
+  g_free (state_hex);
+  if (state)
+    g_bytes_unref (state);
+  g_key_file_free (keyfile);
+  return ret;
+}
+
+/* Restores the state saved in the checkpoint file, if there is a valid
+ * one for the commit being hashed.
+ */
+static gboolean
+evtag_checkpoint_load (struct EvTag  *self,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  EvTagCheckpoint *cp = self->checkpoint;
+  GKeyFile *keyfile = g_key_file_new ();
+  GBytes *key;
+  char *hmac = NULL;
+  char *expected_hmac = NULL;
+  char *commit = NULL;
+  char *state_hex = NULL;
+  GBytes *state = NULL;
+  char *entry_path = NULL;
+  gint *position = NULL;
+  gsize n_position = 0;
+  gboolean complete;
+  GError *local_error = NULL;
+  gsize i;
+
+  key = evtag_get_cache_key (self, error);
+  if (!key)
+    goto out;
+
+  if (!g_key_file_load_from_file (keyfile, cp->path, G_KEY_FILE_NONE, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&local_error);
+          ret = TRUE;
+        }
+      else if (local_error->domain == G_KEY_FILE_ERROR)
+        {
+          g_clear_error (&local_error);
+          goto invalid;
+        }
+      else
+        g_propagate_error (error, local_error);
+      goto out;
+    }
+
+  hmac = g_key_file_get_string (keyfile, EVTAG_CHECKPOINT_GROUP, "HMAC", NULL);
+  expected_hmac = checkpoint_hmac (key, keyfile);
+  if (!hmac || !str_equal_constant_time (expected_hmac, hmac))
+    goto invalid;
+  if (g_key_file_get_integer (keyfile, EVTAG_CHECKPOINT_GROUP, "Version", NULL) != EVTAG_CHECKPOINT_VERSION)
+    goto invalid;
+
+  commit = g_key_file_get_string (keyfile, EVTAG_CHECKPOINT_GROUP, "Commit", NULL);
+  if (!commit)
+    goto invalid;
+  if (strcmp (commit, cp->commit) != 0)
+    {
+      g_printerr ("warning: Ignoring checkpoint %s for another commit %s\n", cp->path, commit);
+      ret = TRUE;
+      goto out;
+    }
+
+  complete = g_key_file_get_boolean (keyfile, EVTAG_CHECKPOINT_GROUP, "Complete", NULL);
+  if (!complete)
+    {
+      position = g_key_file_get_integer_list (keyfile, EVTAG_CHECKPOINT_GROUP, "Position",
+                                              &n_position, NULL);
+      entry_path = g_key_file_get_string (keyfile, EVTAG_CHECKPOINT_GROUP, "Path", NULL);
+      if (!position || n_position == 0 || !entry_path)
+        goto invalid;
+      for (i = 0; i < n_position; i++)
+        {
+          if (position[i] < 0)
+            goto invalid;
+        }
+    }
+  /* Last, since it changes the hash */
+  state_hex = g_key_file_get_string (keyfile, EVTAG_CHECKPOINT_GROUP, "State", NULL);
+  if (state_hex)
+    state = hex_to_bytes (state_hex);
+  if (!state || !self->checksum.hash->backend->restore (self->checksum.hash->ctx, state))
+    goto invalid;
+
+  cp->n_entries = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Entries", NULL);
+  cp->next_save = cp->n_entries + checkpoint_interval ();
+  cp->complete = complete;
+  self->n_submodules = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Submodules", NULL);
+  self->checksum.n_commits = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Commits", NULL);
+  self->checksum.commit_bytes = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "CommitBytes", NULL);
+  self->checksum.n_trees = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Trees", NULL);
+  self->checksum.tree_bytes = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "TreeBytes", NULL);
+  self->checksum.n_blobs = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "Blobs", NULL);
+  self->checksum.blob_bytes = g_key_file_get_uint64 (keyfile, EVTAG_CHECKPOINT_GROUP, "BlobBytes", NULL);
+  if (complete)
+    g_printerr ("Using completed checkpoint %s\n", cp->path);
+  else
+    {
+      cp->resume = g_array_new (FALSE, FALSE, sizeof (gint));
+      g_array_append_vals (cp->resume, position, n_position);
+      cp->resuming = TRUE;
+      g_printerr ("Resuming from checkpoint at %s\n", entry_path);
+    }
+
+  ret = TRUE;
+  goto out;
+
+ invalid:
+  g_printerr ("warning: Ignoring invalid checkpoint %s\n", cp->path);
+  ret = TRUE;
+ out:
+  g_free (position);
+  g_free (entry_path);
+  if (state)
+    g_bytes_unref (state);
+  g_free (state_hex);
+  g_free (commit);
+  g_free (expected_hmac);
+  g_free (hmac);
+  g_key_file_free (keyfile);
+  return ret;
+}
+
+static gboolean
+evtag_checkpoint_start (struct EvTag  *self,
+                        const git_oid *commit_oid,
+                        GError       **error)
+{
+  EvTagCheckpoint *cp = g_new0 (EvTagCheckpoint, 1);
+
+  /* Nothing is hashed yet */
+  if (!self->checksum.hash->backend->save)
+    {
+      evtag_hash_free (self->checksum.hash);
+      self->checksum.hash = evtag_hash_new_with_backend (evtag_hash_backend_with_save ());
+    }
+
+  cp->path = g_strdup (opt_checkpoint);
+  git_oid_tostr (cp->commit, sizeof (cp->commit), commit_oid);
+  cp->position = g_array_new (FALSE, FALSE, sizeof (gint));
+  cp->history_path = g_strconcat (opt_checkpoint, ".history", NULL);
+  cp->next_save = checkpoint_interval ();
+  self->checkpoint = cp;
+
+  return evtag_checkpoint_load (self, error);
+}
+
+/* Called when checksum_tree() enters a tree; while resuming, sets
+ * @out_start to the entry to go back to.
+ */
+static gboolean
+checkpoint_enter_tree (EvTagCheckpoint *cp,
+                       const git_oid   *tree_oid,
+                       GArray          *entries,
+                       guint           *out_start,
+                       GError         **error)
+{
+  guint depth = cp->position->len;
+  gint start = 0;
+
+  g_array_append_val (cp->position, start);
+  *out_start = 0;
+  if (!cp->resuming)
+    return TRUE;
+
+  g_assert (depth < cp->resume->len);
+  start = g_array_index (cp->resume, gint, depth);
+  if ((guint)start >= entries->len)
+    goto invalid;
+  /* Above the entry, the walk goes down into a tree or submodule */
+  if (depth + 1 == cp->resume->len)
+    cp->resuming = FALSE;
+  else if (evtag_tree_entry_type (&g_array_index (entries, EvTagTreeEntry, start)) == GIT_OBJ_BLOB)
+    goto invalid;
+
+  *out_start = start;
+  return TRUE;
+
+ invalid:
+  {
+    char oid_hexstr[GIT_OID_HEXSZ+1];
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Invalid checkpoint %s: no entry %d to resume at in tree %s",
+                 cp->path, start, git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), tree_oid));
+  }
+  return FALSE;
+}
+
+/* Called before each entry of a tree is hashed */
+static gboolean
+checkpoint_entry (struct TreeWalkData *twdata,
+                  GString             *path,
+                  const char          *name,
+                  GError             **error)
+{
+  EvTagCheckpoint *cp = twdata->evtag->checkpoint;
+
+  if (cp->n_entries >= cp->next_save)
+    {
+      gboolean saved;
+      char *entry_path;
+
+      if (twdata->prefix)
+        entry_path = g_strconcat (twdata->prefix, "/", path->str, name, NULL);
+      else
+        entry_path = g_strconcat (path->str, name, NULL);
+      saved = evtag_checkpoint_save (twdata->evtag, entry_path, error);
+      g_free (entry_path);
+      if (!saved)
+        return FALSE;
+    }
+  cp->n_entries++;
+  return TRUE;
+}
+
+/* Reads ahead the entries of a tree, as the walk is about to enter it */
+static void
+readahead_tree (struct EvTag   *self,
+                git_repository *repo,
+                GArray         *entries)
+{
+  GArray *oids = g_array_new (FALSE, FALSE, sizeof (git_oid));
+  guint i;
+
+  for (i = 0; i < entries->len; i++)
+    {
+      EvTagTreeEntry *entry = &g_array_index (entries, EvTagTreeEntry, i);
+
+      /* Submodule commits are in another repository */
+      if (evtag_tree_entry_type (entry) == GIT_OBJ_COMMIT)
+        continue;
+      g_array_append_vals (oids, entry->oid, 1);
+      if (oids->len == (guint)opt_readahead)
+        {
+          readahead_objects (self, repo, (git_oid*)oids->data, oids->len);
+          g_array_set_size (oids, 0);
+        }
+    }
+  if (oids->len > 0)
+    readahead_objects (self, repo, (git_oid*)oids->data, oids->len);
+
+  g_array_unref (oids);
+}
+
+/* Hashes the tree @tree_oid and everything under it in pre-order.
+ * @path is the directory of the tree, empty or with a trailing
+ * slash; it is extended in place for subdirectories.
+ */
+static gboolean
+checksum_tree (struct TreeWalkData *twdata,
+               const git_oid       *tree_oid,
+               GString             *path,
+               GError             **error)
+{
+  gboolean ret = FALSE;
+  git_odb_object *tree = NULL;
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (EvTagTreeEntry));
+  gsize pathlen = path->len;
+  EvTagCheckpoint *checkpoint = twdata->evtag->checkpoint;
+  guint depth = 0;
+  guint start = 0;
+  guint i;
+
+  if (!checksum_object_read (twdata, tree_oid, GIT_OBJ_TREE, &tree, error))
+    goto out;
+  if (!parse_tree (tree, entries, error))
+    goto out;
+
+  if (checkpoint)
+    {
+      depth = checkpoint->position->len;
+      if (!checkpoint_enter_tree (checkpoint, tree_oid, entries, &start, error))
+        goto out;
+    }
+
+  if (twdata->evtag->readahead)
+    readahead_tree (twdata->evtag, twdata->repo, entries);
+
+  for (i = start; i < entries->len; i++)
+    {
+      EvTagTreeEntry *entry = &g_array_index (entries, EvTagTreeEntry, i);
+
+      if (checkpoint)
+        {
+          g_array_index (checkpoint->position, gint, depth) = i;
+          if (!checkpoint->resuming && !checkpoint_entry (twdata, path, entry->name, error))
+            goto out;
+        }
+
+      if (twdata->evtag->archive && twdata->odb == twdata->evtag->archive->odb)
+        archive_queue_entry (twdata->evtag->archive, path->str, entry->name,
+                             entry->oid, entry->mode);
+
+      switch (evtag_tree_entry_type (entry))
+        {
+        case GIT_OBJ_TREE:
+          g_string_append (path, entry->name);
+          g_string_append_c (path, '/');
+          if (!checksum_tree (twdata, entry->oid, path, error))
+            goto out;
+          g_string_truncate (path, pathlen);
+          break;
+        case GIT_OBJ_BLOB:
+          if (!checksum_object_id (twdata, entry->oid, GIT_OBJ_BLOB, -1, error))
+            goto out;
+          break;
+        case GIT_OBJ_COMMIT:
+          g_string_append (path, entry->name);
+          if (twdata->manifest)
+            {
+              /* Everything before the submodule must be recorded first */
+              if (!evtag_pipeline_flush (twdata->evtag, error))
+                goto out;
+              manifest_add_submodule (twdata->manifest, path->str, entry->oid);
+            }
+
+          if (checksum_submodule (twdata, path->str, entry->oid) != 0)
+            goto out;
+          g_string_truncate (path, pathlen);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (checkpoint && checkpoint->position->len > depth)
+    g_array_set_size (checkpoint->position, depth);
+  g_string_truncate (path, pathlen);
+  g_array_unref (entries);
+  if (tree)
+    git_odb_object_free (tree);
+  return ret;
+}
+
+static void
+readahead_manifest (struct TreeWalkData *twdata,
+                    GArray              *manifest,
+                    guint                start)
+{
+  guint end = start + (start == 0 ? 2 : 1) * (guint)opt_readahead;
+  GArray *oids = g_array_new (FALSE, FALSE, sizeof (git_oid));
+  guint i;
+
+  for (i = start; i < MIN (end, manifest->len); i++)
+    {
+      EvTagManifestEntry *entry = &g_array_index (manifest, EvTagManifestEntry, i);
+
+      if (entry->kind != EVTAG_MANIFEST_SUBMODULE)
+        g_array_append_vals (oids, &entry->oid, 1);
+    }
+  if (oids->len > 0)
+    readahead_objects (twdata->evtag, twdata->repo, (git_oid*)oids->data, oids->len);
+  g_array_unref (oids);
+}
+
+/* Replay a manifest loaded from the cache */
+static gboolean
+checksum_manifest (struct TreeWalkData *twdata,
+                   GArray              *manifest,
+                   GError             **error)
+{
+  guint i;
+  int r;
+
+  for (i = 0; i < manifest->len; i++)
+    {
+      EvTagManifestEntry *entry = &g_array_index (manifest, EvTagManifestEntry, i);
+
+      /* Stay one window of --readahead objects ahead */
+      if (twdata->evtag->readahead && i % opt_readahead == 0)
+        readahead_manifest (twdata, manifest, i == 0 ? 0 : i + opt_readahead);
+
+      switch (entry->kind)
+        {
+        case EVTAG_MANIFEST_BLOB:
+        case EVTAG_MANIFEST_TREE:
+          if (!checksum_object_id (twdata, &entry->oid,
+                                   entry->kind == EVTAG_MANIFEST_TREE ? GIT_OBJ_TREE : GIT_OBJ_BLOB,
+                                   entry->size, error))
+            return FALSE;
+          break;
+        case EVTAG_MANIFEST_SUBMODULE:
+          r = checksum_submodule (twdata, entry->path, &entry->oid);
+          if (r != 0)
+            return FALSE;
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+checksum_commit_contents (struct TreeWalkData *twdata,
+                          const git_oid *commit_oid,
+                          GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  git_odb_object *commit = NULL;
+  const git_oid *tree_oid = &twdata->root_tree;
+  GArray *cached_manifest = NULL;
+  GString *path = NULL;
+
+  if (!checksum_object_read (twdata, commit_oid, GIT_OBJ_COMMIT, &commit, error))
+    goto out;
+  if (!parse_commit_tree (commit, &twdata->root_tree, error))
+    goto out;
+
+  /* Manifests don't have the paths needed for the archive */
+  if (opt_manifest_cache &&
+      !(twdata->evtag->archive && twdata->odb == twdata->evtag->archive->odb))
+    {
+      GError *local_error = NULL;
+
+      if (!manifest_load (twdata->evtag, tree_oid, &cached_manifest, &local_error))
+        {
+          g_printerr ("warning: Not using manifest cache: %s\n", local_error->message);
+          g_clear_error (&local_error);
+        }
+      else if (cached_manifest)
+        {
+          if (!checksum_manifest (twdata, cached_manifest, error))
+            goto out;
+          ret = TRUE;
+          goto out;
+        }
+      else
+        twdata->manifest = manifest_new ();
+    }
+
+  path = g_string_new ("");
+  if (!checksum_tree (twdata, tree_oid, path, error))
+    goto out;
+
+  if (twdata->manifest)
+    {
+      GError *local_error = NULL;
+
+      if (!evtag_pipeline_flush (twdata->evtag, error))
+        goto out;
+
+      if (!manifest_save (twdata->evtag, tree_oid, twdata->manifest, &local_error))
+        {
+          g_printerr ("warning: Failed to save manifest: %s\n", local_error->message);
+          g_clear_error (&local_error);
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (path)
+    g_string_free (path, TRUE);
+  if (twdata->submodule_names)
+    {
+      g_hash_table_unref (twdata->submodule_names);
+      twdata->submodule_names = NULL;
+    }
+  if (twdata->manifest)
+    {
+      g_array_unref (twdata->manifest);
+      twdata->manifest = NULL;
+    }
+  if (cached_manifest)
+    g_array_unref (cached_manifest);
+  if (commit)
+    git_odb_object_free (commit);
+  return ret;
+}
+
+/* Opening a submodule means parsing its config and loading its pack
+ * indexes, which would otherwise stall the ordered walk once per
+ * submodule.  So before the walk, submodules are discovered from the
+ * .gitmodules of each commit, one level of nesting at a time, opened
+ * from --jobs threads, shared by evtag_share_submodule_repo(), and
+ * then warmed up from --jobs threads again.  checksum_submodule() then
+ * picks them up by path, and opens anything that wasn't found here
+ * itself, which is also where any error gets reported.
+ */
+typedef struct {
+  char *path;
+  char *location;
+  gboolean bare;
+  git_oid commit;
+  git_repository *repo;
+  /* @repo and @odb are owned by evtag_share_submodule_repo() */
+  gboolean shared;
+  git_odb *odb;
+  GError *error;
+} EvTagSubmoduleRepo;
+
+static void
+submodule_repo_free (gpointer data)
+{
+  EvTagSubmoduleRepo *sub = data;
+
+  g_free (sub->path);
+  g_free (sub->location);
+  if (sub->repo && !sub->shared)
+    git_repository_free (sub->repo);
+  g_clear_error (&sub->error);
+  g_free (sub);
+}
+
+static void
+open_submodule_thread (gpointer data,
+                       gpointer user_data)
+{
+  EvTagSubmoduleRepo *sub = data;
+
+  (void) open_submodule_location (sub->location, sub->bare, &sub->repo, &sub->error);
+}
+
+static void
+warm_submodule_thread (gpointer data,
+                       gpointer user_data)
+{
+  EvTagSubmoduleRepo *sub = data;
+
+  /* Looking up the commit loads the pack indexes */
+  (void) git_odb_exists (sub->odb, &sub->commit);
+}
+
+static gboolean
+run_submodule_pool (GFunc       func,
+                    gpointer    user_data,
+                    GPtrArray  *subs,
+                    guint       n_jobs,
+                    GError    **error)
+{
+  GThreadPool *pool;
+  guint i;
+
+  pool = g_thread_pool_new (func, user_data, n_jobs, FALSE, error);
+  if (!pool)
+    return FALSE;
+  for (i = 0; i < subs->len; i++)
+    {
+      if (!g_thread_pool_push (pool, subs->pdata[i], error))
+        {
+          g_thread_pool_free (pool, FALSE, TRUE);
+          return FALSE;
+        }
+    }
+  g_thread_pool_free (pool, FALSE, TRUE);
+  return TRUE;
+}
+
+static gboolean
+discover_submodules (git_repository *repo,
+                     const char     *prefix,
+                     const git_oid  *commit_oid,
+                     GPtrArray      *found,
+                     GError        **error)
+{
+  gboolean ret = FALSE;
+  struct TreeWalkData twdata = { FALSE, NULL, repo, NULL, NULL, error };
+  git_commit *commit = NULL;
+  git_tree *tree = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  int r;
+
+  r = git_commit_lookup (&commit, repo, commit_oid);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_commit_tree (&tree, commit);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  git_oid_cpy (&twdata.root_tree, git_tree_id (tree));
+  if (!load_submodule_names (&twdata, error))
+    goto out;
+
+  g_hash_table_iter_init (&iter, twdata.submodule_names);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *path = key;
+      git_tree_entry *entry = NULL;
+      EvTagSubmoduleRepo *sub;
+      char *location;
+      gboolean bare;
+      GError *local_error = NULL;
+
+      if (git_tree_entry_bypath (&entry, tree, path) != 0)
+        continue;
+      if (git_tree_entry_type (entry) != GIT_OBJ_COMMIT)
+        {
+          git_tree_entry_free (entry);
+          continue;
+        }
+
+      location = submodule_repo_location (&twdata, path, &bare, &local_error);
+      if (!location)
+        {
+          g_clear_error (&local_error);
+          git_tree_entry_free (entry);
+          continue;
+        }
+
+      sub = g_new0 (EvTagSubmoduleRepo, 1);
+      sub->path = prefix ? g_build_filename (prefix, path, NULL) : g_strdup (path);
+      sub->location = location;
+      sub->bare = bare;
+      git_oid_cpy (&sub->commit, git_tree_entry_id (entry));
+      g_ptr_array_add (found, sub);
+      git_tree_entry_free (entry);
+    }
+
+  ret = TRUE;
+ out:
+  if (twdata.submodule_names)
+    g_hash_table_unref (twdata.submodule_names);
+  if (tree)
+    git_tree_free (tree);
+  if (commit)
+    git_commit_free (commit);
+  return ret;
+}
+
+static gboolean
+evtag_open_submodules (struct EvTag   *self,
+                       const git_oid  *commit_oid,
+                       guint           n_jobs,
+                       GError        **error)
+{
+  gboolean ret = FALSE;
+  EvTagSubmoduleRepo top = { NULL, };
+  GPtrArray *level = g_ptr_array_new ();
+  GPtrArray *found = NULL;
+  guint i;
+
+  self->submodules = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, submodule_repo_free);
+
+  top.repo = self->top_repo;
+  git_oid_cpy (&top.commit, commit_oid);
+  g_ptr_array_add (level, &top);
+
+  while (level->len > 0)
+    {
+      GPtrArray *next = g_ptr_array_new ();
+
+      found = g_ptr_array_new ();
+      for (i = 0; i < level->len; i++)
+        {
+          EvTagSubmoduleRepo *parent = level->pdata[i];
+          GError *local_error = NULL;
+
+          if (!discover_submodules (parent->repo, parent->path, &parent->commit,
+                                    found, &local_error))
+            g_clear_error (&local_error);
+        }
+
+      g_ptr_array_unref (level);
+      level = next;
+
+      if (found->len == 0)
+        break;
+
+      if (!run_submodule_pool (open_submodule_thread, NULL, found, n_jobs, error))
+        goto out;
+
+      for (i = 0; i < found->len; i++)
+        {
+          EvTagSubmoduleRepo *sub = found->pdata[i];
+          GError *local_error = NULL;
+
+          if (sub->error || g_hash_table_contains (self->submodules, sub->path))
+            submodule_repo_free (sub);
+          else if (!evtag_share_submodule_repo (self, &sub->repo, &sub->odb, &local_error))
+            {
+              g_clear_error (&local_error);
+              submodule_repo_free (sub);
+            }
+          else
+            {
+              sub->shared = TRUE;
+              g_hash_table_insert (self->submodules, sub->path, sub);
+              g_ptr_array_add (next, sub);
+            }
+        }
+      g_ptr_array_unref (found);
+      found = NULL;
+
+      if (next->len > 0 &&
+          !run_submodule_pool (warm_submodule_thread, NULL, next, n_jobs, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (found)
+    {
+      g_ptr_array_set_free_func (found, submodule_repo_free);
+      g_ptr_array_unref (found);
+    }
+  g_ptr_array_unref (level);
+  return ret;
+}
+
+/* The submodule commit is taken from the gitlink in the parent tree,
+ * rather than the checked out HEAD, so that tags other than HEAD can be
+ * verified; for a clean checkout of HEAD they are the same.
+ */
+/* Opens the repository of the submodule at @path for @child_twdata,
+ * taking it from evtag_open_submodules() if it was opened ahead.  The
+ * repository and odb are shared, see evtag_share_submodule_repo(); the
+ * caller frees the prefix of @child_twdata.
+ */
+static gboolean
+open_submodule_twdata (struct TreeWalkData *parent_twdata,
+                       const char          *path,
+                       const git_oid       *commit_oid,
+                       struct TreeWalkData *child_twdata)
+{
+  gboolean ret = FALSE;
+  struct EvTag *self = parent_twdata->evtag;
+  EvTagSubmoduleRepo *opened = NULL;
+  char *full_path;
+  EvTagTimer timer;
+
+  memset (child_twdata, 0, sizeof (*child_twdata));
+  child_twdata->evtag = self;
+  child_twdata->cancellable = parent_twdata->cancellable;
+  child_twdata->error = parent_twdata->error;
+
+  if (parent_twdata->prefix)
+    full_path = g_build_filename (parent_twdata->prefix, path, NULL);
+  else
+    full_path = g_strdup (path);
+  child_twdata->prefix = full_path;
+
+  if (self->submodules)
+    opened = g_hash_table_lookup (self->submodules, full_path);
+  if (opened && opened->repo && git_oid_equal (&opened->commit, commit_oid))
+    {
+      child_twdata->repo = opened->repo;
+      child_twdata->odb = opened->odb;
+      return TRUE;
+    }
+
+  evtag_timer_start (&timer, EVTAG_PHASE_SUBMODULE_OPEN);
+  if (open_submodule_repo (parent_twdata, path, &child_twdata->repo, child_twdata->error) &&
+      evtag_share_submodule_repo (self, &child_twdata->repo, &child_twdata->odb,
+                                  child_twdata->error))
+    ret = TRUE;
+  evtag_timer_stop (self, &timer);
+  return ret;
+}
+
+static void
+close_submodule_twdata (struct TreeWalkData *child_twdata)
+{
+  g_free ((char*)child_twdata->prefix);
+}
+
+static int
+checksum_submodule (struct TreeWalkData *parent_twdata, const char *path,
+                    const git_oid *commit_oid)
+{
+  int r = -1;
+  struct EvTag *self = parent_twdata->evtag;
+  struct TreeWalkData child_twdata;
+
+  /* Otherwise counted in the checkpoint being resumed */
+  if (!(self->checkpoint && self->checkpoint->resuming))
+    self->n_submodules++;
+
+  if (!open_submodule_twdata (parent_twdata, path, commit_oid, &child_twdata))
+    goto out;
+
+  /* The shared odbs outlive the walk, so reads queued for this
+   * submodule can overlap with the rest of the parent.
+   */
+  if (!checksum_commit_contents (&child_twdata, commit_oid,
+                                 child_twdata.cancellable, child_twdata.error))
+    goto out;
+
+  r = 0;
+ out:
+  if (r != 0)
+    {
+      evtag_pipeline_discard (parent_twdata->evtag->pipeline);
+      parent_twdata->caught_error = TRUE;
+    }
+  close_submodule_twdata (&child_twdata);
+  return r;
+}
+
+/* Returns the line of @message starting with @prefix */
+static char *
+find_message_line (const char *message,
+                   const char *prefix)
+{
+  const char *p = message;
+  const char *nl;
+  char *line;
+
+  while (TRUE)
+    {
+      nl = strchr (p, '\n');
+      if (g_str_has_prefix (p, prefix))
+        {
+          line = nl ? g_strndup (p, nl - p) : g_strdup (p);
+          return g_strchomp (line);
+        }
+      if (!nl)
+        return NULL;
+      p = nl + 1;
+    }
+}
+
+static gboolean
+verify_line (const char *prefix,
+             const char *expected_checksum,
+             const char *line,
+             const char *rev,
+             GError    **error)
+{
+  gboolean ret = FALSE;
+  const char *provided_checksum;
+
+  g_assert (g_str_has_prefix (line, prefix));
+
+  provided_checksum = line + strlen (prefix);
+  provided_checksum += strspn (provided_checksum, " \t");
+  if (strcmp (provided_checksum, expected_checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid %s, actual checksum of %s is %s",
+                   line, rev, expected_checksum);
+      goto out;
+    }
+  
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static char *
+get_stats (struct EvTag *self)
+{
+  GString *buf = g_string_new ("");
+
+  g_string_append_printf (buf, "# git-evtag comment: submodules=%u "
+                          "commits=%u (%" G_GUINT64_FORMAT ") "
+                          "trees=%u (%" G_GUINT64_FORMAT ") "
+                          "blobs=%u (%" G_GUINT64_FORMAT ")",
+                          self->n_submodules,
+                          self->checksum.n_commits,
+                          self->checksum.commit_bytes,
+                          self->checksum.n_trees,
+                          self->checksum.tree_bytes,
+                          self->checksum.n_blobs,
+                          self->checksum.blob_bytes);
+  if (opt_verbose)
+    g_string_append_printf (buf, " sha512=%s dirty-check=%0.3fs cache-hits=%u cache-misses=%u",
+                            self->checksum.hash->backend->name,
+                            (double)self->phases[EVTAG_PHASE_DIRTY_CHECK].wall_usec / (double) G_USEC_PER_SEC,
+                            self->cache_hits, self->cache_misses);
+
+  return g_string_free (buf, FALSE);
+}
+
+static void
+json_append_string (GString    *buf,
+                    const char *str)
+{
+  const char *p;
+
+  g_string_append_c (buf, '"');
+  for (p = str; *p; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_printf (buf, "\\%c", *p);
+      else if ((guchar)*p < 0x20)
+        g_string_append_printf (buf, "\\u%04x", (guchar)*p);
+      else
+        g_string_append_c (buf, *p);
+    }
+  g_string_append_c (buf, '"');
+}
+
+static double
+usec_to_seconds (guint64 usec)
+{
+  return (double)usec / (double) G_USEC_PER_SEC;
+}
+
+/* Writes what get_stats() prints, along with the time spent in each
+ * phase and the largest objects, to the --stats-json file.  The
+ * throughput figures are over the wall time of the checksum phase.
+ */
+static gboolean
+write_stats_json (struct EvTag  *self,
+                  const char    *command_name,
+                  const GError  *command_error,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  GString *buf = g_string_new ("{\n");
+  guint64 n_objects = (guint64)self->checksum.n_commits + self->checksum.n_trees + self->checksum.n_blobs;
+  guint64 n_bytes = self->checksum.commit_bytes + self->checksum.tree_bytes + self->checksum.blob_bytes;
+  double checksum_secs = usec_to_seconds (self->phases[EVTAG_PHASE_CHECKSUM].wall_usec);
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+  struct rusage usage;
+  guint i;
+
+  g_string_append (buf, "  \"version\": ");
+  json_append_string (buf, PACKAGE_STRING);
+  g_string_append (buf, ",\n  \"command\": ");
+  json_append_string (buf, command_name);
+  g_string_append_printf (buf, ",\n  \"success\": %s", command_error ? "false" : "true");
+  if (command_error)
+    {
+      g_string_append (buf, ",\n  \"error\": ");
+      json_append_string (buf, command_error->message);
+    }
+  g_string_append (buf, ",\n  \"sha512_backend\": ");
+  /* --checkpoint may have switched to one that can be saved */
+  json_append_string (buf, self->checksum.hash ? self->checksum.hash->backend->name : evtag_hash_backend ()->name);
+  /* What was used rather than asked for; nothing was read for a
+   * cached checksum
+   */
+  g_string_append_printf (buf, ",\n  \"jobs\": %u",
+                          self->n_jobs_used > 0 ? self->n_jobs_used :
+                          opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ());
+
+  g_string_append_printf (buf, ",\n  \"counts\": { \"submodules\": %u, "
+                          "\"commits\": %u, \"trees\": %u, \"blobs\": %u }",
+                          self->n_submodules, self->checksum.n_commits, self->checksum.n_trees, self->checksum.n_blobs);
+  g_string_append_printf (buf, ",\n  \"bytes\": { \"commits\": %" G_GUINT64_FORMAT
+                          ", \"trees\": %" G_GUINT64_FORMAT
+                          ", \"blobs\": %" G_GUINT64_FORMAT " }",
+                          self->checksum.commit_bytes, self->checksum.tree_bytes, self->checksum.blob_bytes);
+  g_string_append_printf (buf, ",\n  \"object_cache\": { \"budget_mib\": %d, \"hits\": %u, "
+                          "\"misses\": %u, \"bypassed\": %u, \"evictions\": %u }",
+                          opt_object_cache_size, self->cache_hits, self->cache_misses,
+                          self->cache_bypassed, self->cache_evictions);
+  g_string_append_printf (buf, ",\n  \"readahead\": { \"batch\": %d, \"requests\": %" G_GUINT64_FORMAT
+                          ", \"bytes\": %" G_GUINT64_FORMAT " }",
+                          opt_readahead, self->readahead_requests, self->readahead_bytes);
+  g_string_append_printf (buf, ",\n  \"submodule_repos\": { \"opened\": %u, \"reused\": %u }",
+                          self->n_repos_opened, self->n_repos_reused);
+  g_string_append_printf (buf, ",\n  \"objects_per_second\": %0.1f",
+                          checksum_secs > 0 ? n_objects / checksum_secs : 0.0);
+  g_string_append_printf (buf, ",\n  \"bytes_per_second\": %0.1f",
+                          checksum_secs > 0 ? n_bytes / checksum_secs : 0.0);
+  /* ru_maxrss is in kilobytes on Linux */
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+    g_string_append_printf (buf, ",\n  \"peak_rss_kib\": %ld", usage.ru_maxrss);
+
+  g_string_append (buf, ",\n  \"phases\": {");
+  for (i = 0; i < EVTAG_N_PHASES; i++)
+    {
+      const EvTagPhaseStats *phase = &self->phases[i];
+
+      g_string_append (buf, i > 0 ? ",\n    " : "\n    ");
+      json_append_string (buf, evtag_phase_info[i].name);
+      g_string_append_printf (buf, ": { \"wall_seconds\": %0.6f, \"cpu_seconds\": %0.6f, "
+                              "\"count\": %" G_GUINT64_FORMAT " }",
+                              usec_to_seconds (phase->wall_usec),
+                              usec_to_seconds (phase->cpu_usec),
+                              phase->count);
+    }
+  g_string_append (buf, "\n  }");
+
+  g_string_append (buf, ",\n  \"largest_objects\": [");
+  for (i = 0; i < self->n_largest; i++)
+    {
+      const EvTagLargeObject *obj = &self->largest[i];
+
+      g_string_append (buf, i > 0 ? ",\n    " : "\n    ");
+      g_string_append_printf (buf, "{ \"oid\": \"%s\", \"type\": \"%s\", "
+                              "\"size\": %" G_GUINT64_FORMAT " }",
+                              git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), &obj->oid),
+                              git_object_type2string (obj->otype),
+                              obj->size);
+    }
+  g_string_append (buf, self->n_largest > 0 ? "\n  ]\n}\n" : "]\n}\n");
+
+  if (!g_file_set_contents (opt_stats_json, buf->str, buf->len, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  g_string_free (buf, TRUE);
+  return ret;
+}
+
+static gboolean
+check_file_has_evtag (const char *path,
+                      gboolean   *out_have_evtag,
+                      GError    **error)
+{
+  gboolean ret = FALSE;
+  char *message = NULL;
+  const char *p;
+  const char *nl;
+  gboolean found = FALSE;
+
+  if (!g_file_get_contents (path, &message, NULL, error))
+    goto out;
+
+  p = message;
+  while (TRUE)
+    {
+      nl = strchr (p, '\n');
+
+      if (g_str_has_prefix (p, EVTAG_SHA512) || g_str_has_prefix (p, EVTAG_V1_SHA512))
+        {
+          found = TRUE;
+          break;
+        }
+
+      if (!nl)
+        break;
+      p = nl + 1;
+    }
+
+  ret = TRUE;
+  *out_have_evtag = found;
+ out:
+  g_free (message);
+  return ret;
+}
+
+static int
+status_cb (const char *path, unsigned int status_flags, void *payload)
+{
+  int r = 1;
+  struct TreeWalkData *twdata = payload;
+
+  if (status_flags != 0)
+    {
+      g_assert (!twdata->caught_error);
       twdata->caught_error = TRUE;
       g_set_error (twdata->error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Attempting to tag or verify dirty tree (%s); use --force-unclean to override",
+                   "Attempting to tag or verify dirty tree (%s); use --dirty-check=none to override",
                    path);
       goto out;
     }
 
-  r = 0;
+  r = 0;
+ out:
+  return r;
+}
+
+/* With --dirty-check=stat, rather than letting libgit2 compare the
+ * whole working tree serially, every index entry is lstat()ed from
+ * --jobs threads and compared with the stat data recorded in the
+ * index.  Only the entries that differ, or that are racily clean,
+ * then go through the full status check, which rereads their content.
+ */
+#define EVTAG_STAT_CHUNK 256
+#define EVTAG_S_IFGITLINK 0160000
+
+typedef struct {
+  const char *workdir;
+  const git_index_entry **entries;
+  guint n_entries;
+  gint32 index_mtime;
+  guint8 *changed;
+  gint next_chunk;
+  GCancellable *cancellable;
+} EvTagStatCheck;
+
+static gboolean
+index_entry_stat_differs (EvTagStatCheck        *check,
+                          const git_index_entry *entry)
+{
+  struct stat stbuf;
+  char *path;
+  int r;
+
+  /* Conflicts, and the checked out commit of submodules, are left to
+   * libgit2.
+   */
+  if (git_index_entry_stage (entry) != 0 ||
+      entry->mode == EVTAG_S_IFGITLINK)
+    return TRUE;
+
+  /* Modified in the same second the index was written */
+  if (entry->mtime.seconds >= check->index_mtime)
+    return TRUE;
+
+  path = g_build_filename (check->workdir, entry->path, NULL);
+  r = lstat (path, &stbuf);
+  g_free (path);
+  if (r < 0)
+    return TRUE;
+
+  if ((guint32)stbuf.st_size != entry->file_size ||
+      (guint32)stbuf.st_ino != entry->ino ||
+      (gint32)stbuf.st_mtime != entry->mtime.seconds ||
+      (gint32)stbuf.st_ctime != entry->ctime.seconds)
+    return TRUE;
+  if (entry->mtime.nanoseconds != 0 &&
+      (guint32)stbuf.st_mtim.tv_nsec != entry->mtime.nanoseconds)
+    return TRUE;
+  if (S_ISLNK (stbuf.st_mode) != S_ISLNK (entry->mode) ||
+      (stbuf.st_mode & S_IXUSR) != (entry->mode & S_IXUSR))
+    return TRUE;
+
+  return FALSE;
+}
+
+static gpointer
+stat_check_thread (gpointer data)
+{
+  EvTagStatCheck *check = data;
+  guint chunk;
+
+  /* Entries are sorted by path, so a chunk is mostly one directory */
+  while ((chunk = (guint) g_atomic_int_add (&check->next_chunk, 1)) * EVTAG_STAT_CHUNK < check->n_entries &&
+         !g_cancellable_is_cancelled (check->cancellable))
+    {
+      guint i;
+      guint end = MIN ((chunk + 1) * EVTAG_STAT_CHUNK, check->n_entries);
+
+      for (i = chunk * EVTAG_STAT_CHUNK; i < end; i++)
+        check->changed[i] = index_entry_stat_differs (check, check->entries[i]);
+    }
+
+  return NULL;
+}
+
+static gboolean
+check_working_tree_stat (struct EvTag        *self,
+                         struct TreeWalkData *twdata,
+                         GError             **error)
+{
+  gboolean ret = FALSE;
+  git_status_options statusopts = GIT_STATUS_OPTIONS_INIT;
+  EvTagStatCheck check = { NULL, };
+  git_index *index = NULL;
+  GPtrArray *threads = g_ptr_array_new ();
+  GPtrArray *changed_paths = g_ptr_array_new ();
+  char *index_path = NULL;
+  struct stat stbuf;
+  guint n_threads;
+  guint n_chunks;
+  guint i;
+  int r;
+
+  /* The index against HEAD doesn't need the working tree */
+  statusopts.show = GIT_STATUS_SHOW_INDEX_ONLY;
+  r = git_status_foreach_ext (self->top_repo, &statusopts, status_cb, twdata);
+  if (twdata->caught_error)
+    goto out;
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  r = git_repository_index (&index, self->top_repo);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  index_path = g_build_filename (git_repository_path (self->top_repo), "index", NULL);
+  if (lstat (index_path, &stbuf) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "lstat(%s): %s", index_path, g_strerror (errsv));
+      goto out;
+    }
+
+  check.workdir = git_repository_workdir (self->top_repo);
+  check.cancellable = twdata->cancellable;
+  check.index_mtime = (gint32)stbuf.st_mtime;
+  check.n_entries = git_index_entrycount (index);
+  check.entries = g_new (const git_index_entry *, check.n_entries);
+  check.changed = g_new0 (guint8, check.n_entries);
+  for (i = 0; i < check.n_entries; i++)
+    check.entries[i] = git_index_get_byindex (index, i);
+
+  n_threads = opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ();
+  n_chunks = (check.n_entries + EVTAG_STAT_CHUNK - 1) / EVTAG_STAT_CHUNK;
+  n_threads = MAX (MIN (n_threads, n_chunks), 1);
+  for (i = 0; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("evtag-stat", stat_check_thread, &check));
+  for (i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  if (g_cancellable_set_error_if_cancelled (twdata->cancellable, error))
+    goto out;
+
+  for (i = 0; i < check.n_entries; i++)
+    {
+      if (check.changed[i])
+        g_ptr_array_add (changed_paths, (char*)check.entries[i]->path);
+    }
+
+  if (changed_paths->len > 0)
+    {
+      statusopts.show = GIT_STATUS_SHOW_WORKDIR_ONLY;
+      statusopts.flags = GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+      statusopts.pathspec.strings = (char**)changed_paths->pdata;
+      statusopts.pathspec.count = changed_paths->len;
+      r = git_status_foreach_ext (self->top_repo, &statusopts, status_cb, twdata);
+      if (twdata->caught_error)
+        goto out;
+      if (!handle_libgit_ret (r, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_ptr_array_unref (changed_paths);
+  g_ptr_array_unref (threads);
+  g_free (check.entries);
+  g_free (check.changed);
+  g_free (index_path);
+  if (index)
+    git_index_free (index);
+  return ret;
+}
+
+/* Refuse to tag or verify a checkout that doesn't match HEAD;
+ * untracked files are allowed.
+ */
+static gboolean
+check_working_tree (struct EvTag  *self,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  git_status_options statusopts = GIT_STATUS_OPTIONS_INIT;
+  struct TreeWalkData twdata = { FALSE, self, self->top_repo, NULL, cancellable, error };
+  EvTagTimer timer;
+  int r;
+
+  evtag_timer_start (&timer, EVTAG_PHASE_DIRTY_CHECK);
+
+  /* A bare repository has no working tree to be dirty */
+  if (git_repository_is_bare (self->top_repo) ||
+      g_strcmp0 (opt_dirty_check, "none") == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (g_strcmp0 (opt_dirty_check, "stat") == 0)
+    {
+      if (!check_working_tree_stat (self, &twdata, error))
+        goto out;
+    }
+  else if (opt_dirty_check == NULL || g_str_equal (opt_dirty_check, "full"))
+    {
+      r = git_status_foreach_ext (self->top_repo, &statusopts, status_cb, &twdata);
+      if (twdata.caught_error)
+        goto out;
+      if (!handle_libgit_ret (r, error))
+        goto out;
+    }
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid --dirty-check mode '%s'; expected full, stat or none",
+                   opt_dirty_check);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  evtag_timer_stop (self, &timer);
+  return ret;
+}
+
+/* Runs `git archive`, for when the archive can't be generated during
+ * the checksum.
+ */
+static gboolean
+git_archive_checksum (const char    *commit,
+                      char         **out_checksum,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  gboolean ret = FALSE;
+  const char *archive_argv[] = {"git", "archive", "--format=tar", commit, NULL};
+  GSubprocess *gitarchive_proc = NULL;
+  GInputStream *gitarchive_output = NULL;
+  GChecksum *legacy_archive_sha256 = g_checksum_new (G_CHECKSUM_SHA256);
+  gssize bytes_read;
+  char *readbuf = g_malloc (EVTAG_STREAM_CHUNK_SIZE);
+
+  gitarchive_proc = g_subprocess_newv (archive_argv, G_SUBPROCESS_FLAGS_STDOUT_PIPE, error);
+
+  if (!gitarchive_proc)
+    goto out;
+          
+  gitarchive_output = g_subprocess_get_stdout_pipe (gitarchive_proc);
+          
+  while ((bytes_read = g_input_stream_read (gitarchive_output, readbuf, EVTAG_STREAM_CHUNK_SIZE,
+                                            cancellable, error)) > 0)
+    g_checksum_update (legacy_archive_sha256, (guint8*)readbuf, bytes_read);
+  if (bytes_read < 0)
+    goto out;
+  if (!g_subprocess_wait_check (gitarchive_proc, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  *out_checksum = g_strdup (g_checksum_get_string (legacy_archive_sha256));
+ out:
+  g_free (readbuf);
+  g_checksum_free (legacy_archive_sha256);
+  if (gitarchive_proc)
+    g_object_unref (gitarchive_proc);
+  return ret;
+}
+
+/* The legacy checksum of @commit, which must just have been
+ * checksummed with self->archive set.  @out_ran_git, if not %NULL, is
+ * set to whether git archive had to be run for it.
+ */
+static gboolean
+legacy_archive_checksum (struct EvTag  *self,
+                         const char    *commit,
+                         char         **out_checksum,
+                         gboolean      *out_ran_git,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  gboolean ret = FALSE;
+  const char *checksum = self->archive ? archive_finish (self->archive) : NULL;
+  EvTagTimer timer;
+
+  if (out_ran_git)
+    *out_ran_git = checksum == NULL;
+  if (checksum)
+    {
+      *out_checksum = g_strdup (checksum);
+      return TRUE;
+    }
+
+  if (opt_verbose)
+    g_printerr ("Using git archive for the legacy checksum due to attributes or configuration\n");
+
+  evtag_timer_start (&timer, EVTAG_PHASE_LEGACY_ARCHIVE);
+  ret = git_archive_checksum (commit, out_checksum, cancellable, error);
+  evtag_timer_stop (self, &timer);
+  return ret;
+}
+
+static gboolean
+compute_and_append_legacy_archive_checksum (struct EvTag *self,
+                                            const char   *commit,
+                                            GString      *buf,
+                                            GCancellable *cancellable,
+                                            GError      **error)
+{
+  gboolean ret = FALSE;
+  char *checksum = NULL;
+  char *gitversion = NULL;
+  gboolean ran_git;
+  int wait_status;
+  char *nl;
+
+  if (!legacy_archive_checksum (self, commit, &checksum, &ran_git, cancellable, error))
+    goto out;
+
+  g_string_append_printf (buf, "# git-evtag comment: Computed legacy checksum in %0.1fs\n",
+                          (double)self->phases[EVTAG_PHASE_LEGACY_ARCHIVE].wall_usec / (double) G_USEC_PER_SEC);
+
+  g_string_append (buf, LEGACY_EVTAG_ARCHIVE_TAR);
+  g_string_append_c (buf, ' ');
+  g_string_append (buf, checksum);
+  g_string_append_c (buf, '\n');
+
+  if (!g_spawn_command_line_sync ("git --version", &gitversion, NULL, &wait_status, error))
+    goto out;
+  if (!g_spawn_check_wait_status (wait_status, error))
+    goto out;
+
+  nl = strchr (gitversion, '\n');
+  if (!nl)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "git --version returned invalid content without a newline");
+      goto out;
+    }
+
+  *nl = '\0';
+  g_strchomp (gitversion);
+
+  g_string_append (buf, LEGACY_EVTAG_ARCHIVE_TAR_GITVERSION);
+  g_string_append_c (buf, ' ');
+  g_string_append (buf, gitversion);
+  g_string_append_c (buf, '\n');
+
+  /* git archive is only run when it has to be; otherwise this program
+   * writes git's format itself (see EvTagArchive)
+   */
+  g_string_append (buf, LEGACY_EVTAG_ARCHIVE_TAR_WRITER);
+  g_string_append_c (buf, ' ');
+  g_string_append (buf, ran_git ? "git archive" : PACKAGE_STRING);
+  g_string_append_c (buf, '\n');
+
+  ret = TRUE;
+ out:
+  g_free (gitversion);
+  g_free (checksum);
+  return ret;
+}
+
+static gboolean
+validate_at_head (struct EvTag  *self,
+                  git_oid       *specified_oid,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  git_oid head_oid;
+  int r;
+
+  r = git_reference_name_to_id (&head_oid, self->top_repo, "HEAD");
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  /* We have this restriction due to submodules; we require them to be
+   * checked out and initialized.
+   */
+  if (git_oid_cmp (&head_oid, specified_oid) != 0)
+    {
+      char head_oid_hexstr[GIT_OID_HEXSZ+1];
+      char specified_oid_hexstr[GIT_OID_HEXSZ+1];
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Target %s is not HEAD (%s); currently git-evtag can only tag or verify HEAD in a pristine checkout",
+                   git_oid_tostr (specified_oid_hexstr, sizeof (specified_oid_hexstr), specified_oid),
+                   git_oid_tostr (head_oid_hexstr, sizeof (head_oid_hexstr), &head_oid));
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+checksum_commit_recurse (struct EvTag      *self,
+                         git_oid           *specified_oid,
+                         guint64           *out_elapsed_time,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  guint64 checksum_start_time;
+  guint64 checksum_end_time;
+  guint n_jobs;
+  EvTagTimer timer;
+  EvTagTimer open_timer = { 0, };
+
+  evtag_timer_start (&timer, EVTAG_PHASE_CHECKSUM);
+  checksum_start_time = g_get_monotonic_time ();
+
+  if (opt_checkpoint)
+    {
+      if (!evtag_checkpoint_start (self, specified_oid, error))
+        goto out;
+      /* Everything is hashed already */
+      if (self->checkpoint->complete)
+        goto walked;
+    }
+
+  /* Kept across commits, for batch verification */
+  if (!self->object_cache && opt_object_cache_size > 0)
+    self->object_cache = object_cache_new ((gsize)opt_object_cache_size * 1024 * 1024);
+  if (!self->readahead && opt_readahead > 0)
+    self->readahead = readahead_new ();
+
+  n_jobs = evtag_get_n_jobs (self);
+  if (n_jobs > 1)
+    {
+      self->pipeline = evtag_pipeline_new (n_jobs, self->object_cache != NULL,
+                                           cancellable, error);
+      if (!self->pipeline)
+        goto out;
+
+      evtag_timer_start (&open_timer, EVTAG_PHASE_SUBMODULE_OPEN);
+      if (!evtag_open_submodules (self, specified_oid, n_jobs, error))
+        goto out;
+      evtag_timer_stop (self, &open_timer);
+    }
+
+  if (self->progress)
+    evtag_progress_start (self, specified_oid);
+
+  {
+    struct TreeWalkData twdata = { FALSE, self, self->top_repo, NULL, cancellable, error };
+    
+    r = git_repository_odb (&twdata.odb, self->top_repo);
+    if (!handle_libgit_ret (r, error))
+      goto out;
+
+    if (self->archive &&
+        !archive_start (self->archive, self->top_repo, twdata.odb, specified_oid, error))
+      goto out;
+    
+    if (!checksum_commit_contents (&twdata, specified_oid, cancellable, error))
+      goto out;
+
+    if (!evtag_pipeline_flush (self, error))
+      goto out;
+  }
+
+  if (self->checkpoint && !evtag_checkpoint_save (self, NULL, error))
+    goto out;
+ walked:
+  checksum_end_time = g_get_monotonic_time ();
+
+  if (self->progress && !(self->checkpoint && self->checkpoint->complete))
+    evtag_progress_update (self, TRUE);
+
+  ret = TRUE;
+  if (out_elapsed_time)
+    *out_elapsed_time = checksum_end_time - checksum_start_time;
+ out:
+  evtag_timer_stop (self, &open_timer);
+  evtag_timer_stop (self, &timer);
+  if (self->pipeline)
+    {
+      evtag_pipeline_free (self->pipeline);
+      self->pipeline = NULL;
+    }
+  if (self->submodules)
+    {
+      g_hash_table_unref (self->submodules);
+      self->submodules = NULL;
+    }
+  if (self->checkpoint)
+    {
+      evtag_checkpoint_free (self->checkpoint);
+      self->checkpoint = NULL;
+    }
+  return ret;
+}
+
+/* Git-EVTag-v1 hashes each object on its own, and each tree and
+ * commit together with the digests of what they point to, so that
+ * blobs can be hashed in parallel and the digest of a tree (or of a
+ * submodule commit) computed once and reused, by object id, for all
+ * later commits verified in the same process.
+ *
+ * The walk first reads every commit and tree not already known,
+ * queuing blobs to a pool of --jobs threads as they are found and
+ * recording commits and trees in post-order.  Once the blobs are
+ * done, the commits and trees are hashed in that order, which puts
+ * every child before its parent.
+ */
+typedef struct {
+  git_odb *odb;
+  git_oid oid;
+} EvTagV1Blob;
+
+typedef struct {
+  struct EvTag *evtag;
+  GThreadPool *pool;
+  /* Protects @evtag->v1_digests and @errmsg while the pool runs */
+  GMutex lock;
+  char *errmsg;
+  /* Queued or walked already in this run */
+  GHashTable *seen;
+  /* git_odb_object of each commit and tree, in post-order */
+  GPtrArray *nodes;
+  /* Submodule TreeWalkData, kept open while their blobs are hashed */
+  GPtrArray *submodules;
+} EvTagV1;
+
+static void
+v1_submodule_free (gpointer data)
+{
+  struct TreeWalkData *twdata = data;
+  close_submodule_twdata (twdata);
+  g_free (twdata);
+}
+
+static void
+v1_add_digest (struct EvTag  *self,
+               const git_oid *oid,
+               EvTagHash     *hash)
+{
+  guint8 *value = g_malloc (GIT_OID_RAWSZ + EVTAG_SHA512_DIGEST_LEN);
+
+  memcpy (value, oid->id, GIT_OID_RAWSZ);
+  evtag_hash_get_digest (hash, value + GIT_OID_RAWSZ);
+  g_hash_table_replace (self->v1_digests, value, value + GIT_OID_RAWSZ);
+}
+
+static const guint8 *
+v1_lookup_digest (struct EvTag  *self,
+                  const git_oid *oid)
+{
+  return g_hash_table_lookup (self->v1_digests, oid);
+}
+
+static EvTagHash *
+v1_hash_header (git_otype otype,
+                gsize     size)
+{
+  EvTagHash *hash = evtag_hash_new ();
+  char header[EVTAG_OBJECT_HEADER_MAX];
+  gsize headerlen;
+
+  headerlen = evtag_object_header (otype, size, header);
+  evtag_hash_update (hash, (guint8*)header, headerlen);
+  return hash;
+}
+
+/* Returns a libgit2 error code; the hash is only set on success */
+static int
+v1_hash_blob (git_odb        *odb,
+              const git_oid  *oid,
+              EvTagHash     **out_hash)
+{
+  int r;
+  git_odb_object *object = NULL;
+  git_odb_stream *rstream = NULL;
+  EvTagHash *hash = NULL;
+  size_t size;
+  git_otype otype;
+  char *buf = NULL;
+
+  /* Only loose objects support streaming; packed ones are read whole */
+  if (git_odb_open_rstream (&rstream, &size, &otype, odb, oid) == 0)
+    {
+      hash = v1_hash_header (otype, size);
+      buf = g_malloc (EVTAG_STREAM_CHUNK_SIZE);
+      while (size > 0)
+        {
+          r = git_odb_stream_read (rstream, buf, MIN (size, EVTAG_STREAM_CHUNK_SIZE));
+          if (r <= 0)
+            {
+              if (r == 0)
+                {
+                  giterr_set_str (GITERR_ODB, "Unexpected end of stream");
+                  r = -1;
+                }
+              goto out;
+            }
+          evtag_hash_update (hash, (guint8*)buf, r);
+          size -= r;
+        }
+    }
+  else
+    {
+      giterr_clear ();
+      r = git_odb_read (&object, odb, oid);
+      if (r != 0)
+        goto out;
+      hash = v1_hash_header (git_odb_object_type (object), git_odb_object_size (object));
+      evtag_hash_update (hash, git_odb_object_data (object), git_odb_object_size (object));
+    }
+
+  r = 0;
+  *out_hash = hash;
+  hash = NULL;
+ out:
+  if (hash)
+    evtag_hash_free (hash);
+  g_free (buf);
+  if (rstream)
+    git_odb_stream_free (rstream);
+  if (object)
+    git_odb_object_free (object);
+  return r;
+}
+
+static void
+v1_blob_thread (gpointer data,
+                gpointer user_data)
+{
+  EvTagV1Blob *blob = data;
+  EvTagV1 *v1 = user_data;
+  EvTagHash *hash = NULL;
+  int r;
+
+  r = v1_hash_blob (blob->odb, &blob->oid, &hash);
+
+  g_mutex_lock (&v1->lock);
+  if (r == 0)
+    {
+      v1_add_digest (v1->evtag, &blob->oid, hash);
+      evtag_hash_free (hash);
+    }
+  else if (!v1->errmsg)
+    {
+      /* The libgit2 error is thread-local, so copy it out */
+      const git_error *giterror = giterr_last ();
+      v1->errmsg = g_strdup (giterror && giterror->message ? giterror->message : "???");
+    }
+  g_mutex_unlock (&v1->lock);
+
+  g_free (blob);
+}
+
+static gboolean
+v1_queue_blob (EvTagV1        *v1,
+               git_odb        *odb,
+               const git_oid  *oid,
+               GError        **error)
+{
+  EvTagV1Blob *blob;
+  EvTagHash *hash = NULL;
+  int r;
+
+  if (!v1->pool)
+    {
+      r = v1_hash_blob (odb, oid, &hash);
+      if (!handle_libgit_ret (r, error))
+        return FALSE;
+      v1_add_digest (v1->evtag, oid, hash);
+      evtag_hash_free (hash);
+      return TRUE;
+    }
+
+  blob = g_new0 (EvTagV1Blob, 1);
+  blob->odb = odb;
+  git_oid_cpy (&blob->oid, oid);
+  return g_thread_pool_push (v1->pool, blob, error);
+}
+
+/* Whether @oid still needs to be walked or queued */
+static gboolean
+v1_needs_object (EvTagV1       *v1,
+                 const git_oid *oid)
+{
+  gboolean known;
+  git_oid *key;
+
+  if (g_hash_table_contains (v1->seen, oid))
+    return FALSE;
+
+  g_mutex_lock (&v1->lock);
+  known = v1_lookup_digest (v1->evtag, oid) != NULL;
+  g_mutex_unlock (&v1->lock);
+  if (known)
+    return FALSE;
+
+  key = g_new (git_oid, 1);
+  git_oid_cpy (key, oid);
+  g_hash_table_add (v1->seen, key);
+  return TRUE;
+}
+
+static gboolean
+v1_walk_commit (EvTagV1             *v1,
+                struct TreeWalkData *twdata,
+                const git_oid       *commit_oid,
+                GError             **error);
+
+static gboolean
+v1_walk_tree (EvTagV1             *v1,
+              struct TreeWalkData *twdata,
+              const git_oid       *tree_oid,
+              GString             *path,
+              GError             **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  git_odb_object *tree = NULL;
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (EvTagTreeEntry));
+  gsize pathlen = path->len;
+  guint i;
+
+  if (g_cancellable_set_error_if_cancelled (twdata->cancellable, error))
+    goto out;
+
+  r = git_odb_read (&tree, twdata->odb, tree_oid);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  if (!parse_tree (tree, entries, error))
+    goto out;
+
+  for (i = 0; i < entries->len; i++)
+    {
+      EvTagTreeEntry *entry = &g_array_index (entries, EvTagTreeEntry, i);
+
+      switch (evtag_tree_entry_type (entry))
+        {
+        case GIT_OBJ_TREE:
+          if (!v1_needs_object (v1, entry->oid))
+            break;
+          g_string_append (path, entry->name);
+          g_string_append_c (path, '/');
+          if (!v1_walk_tree (v1, twdata, entry->oid, path, error))
+            goto out;
+          g_string_truncate (path, pathlen);
+          break;
+        case GIT_OBJ_BLOB:
+          if (v1_needs_object (v1, entry->oid) &&
+              !v1_queue_blob (v1, twdata->odb, entry->oid, error))
+            goto out;
+          break;
+        case GIT_OBJ_COMMIT:
+          {
+            struct TreeWalkData *child_twdata;
+
+            if (!v1_needs_object (v1, entry->oid))
+              break;
+
+            g_string_append (path, entry->name);
+            child_twdata = g_new0 (struct TreeWalkData, 1);
+            g_ptr_array_add (v1->submodules, child_twdata);
+            if (!open_submodule_twdata (twdata, path->str, entry->oid, child_twdata))
+              goto out;
+            g_string_truncate (path, pathlen);
+
+            if (!v1_walk_commit (v1, child_twdata, entry->oid, error))
+              goto out;
+          }
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  g_ptr_array_add (v1->nodes, tree);
+  tree = NULL;
+  ret = TRUE;
+ out:
+  g_string_truncate (path, pathlen);
+  g_array_unref (entries);
+  if (tree)
+    git_odb_object_free (tree);
+  return ret;
+}
+
+static gboolean
+v1_walk_commit (EvTagV1             *v1,
+                struct TreeWalkData *twdata,
+                const git_oid       *commit_oid,
+                GError             **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  git_odb_object *commit = NULL;
+  GString *path = g_string_new ("");
+
+  r = git_odb_read (&commit, twdata->odb, commit_oid);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  if (!parse_commit_tree (commit, &twdata->root_tree, error))
+    goto out;
+
+  if (v1_needs_object (v1, &twdata->root_tree) &&
+      !v1_walk_tree (v1, twdata, &twdata->root_tree, path, error))
+    goto out;
+
+  g_ptr_array_add (v1->nodes, commit);
+  commit = NULL;
+  ret = TRUE;
+ out:
+  if (twdata->submodule_names)
+    {
+      g_hash_table_unref (twdata->submodule_names);
+      twdata->submodule_names = NULL;
+    }
+  g_string_free (path, TRUE);
+  if (commit)
+    git_odb_object_free (commit);
+  return ret;
+}
+
+/* Hashes a commit or tree whose children all have digests */
+static gboolean
+v1_hash_node (EvTagV1         *v1,
+              git_odb_object  *object,
+              GError         **error)
+{
+  gboolean ret = FALSE;
+  git_otype otype = git_odb_object_type (object);
+  EvTagHash *hash = v1_hash_header (otype, git_odb_object_size (object));
+  GArray *entries = NULL;
+  git_oid tree_oid;
+  const guint8 *digest;
+  guint i;
+
+  evtag_hash_update (hash, git_odb_object_data (object), git_odb_object_size (object));
+
+  if (otype == GIT_OBJ_COMMIT)
+    {
+      if (!parse_commit_tree (object, &tree_oid, error))
+        goto out;
+      digest = v1_lookup_digest (v1->evtag, &tree_oid);
+      g_assert (digest);
+      evtag_hash_update (hash, digest, EVTAG_SHA512_DIGEST_LEN);
+    }
+  else
+    {
+      entries = g_array_new (FALSE, FALSE, sizeof (EvTagTreeEntry));
+      if (!parse_tree (object, entries, error))
+        goto out;
+      for (i = 0; i < entries->len; i++)
+        {
+          EvTagTreeEntry *entry = &g_array_index (entries, EvTagTreeEntry, i);
+
+          digest = v1_lookup_digest (v1->evtag, entry->oid);
+          g_assert (digest);
+          evtag_hash_update (hash, digest, EVTAG_SHA512_DIGEST_LEN);
+        }
+    }
+
+  v1_add_digest (v1->evtag, git_odb_object_id (object), hash);
+  ret = TRUE;
+ out:
+  if (entries)
+    g_array_unref (entries);
+  evtag_hash_free (hash);
+  return ret;
+}
+
+/* Computes the Git-EVTag-v1 checksum of @specified_oid, in hex */
+static gboolean
+checksum_commit_v1 (struct EvTag   *self,
+                    const git_oid  *specified_oid,
+                    char          **out_checksum,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  EvTagV1 v1 = { self, };
+  struct TreeWalkData twdata = { FALSE, self, self->top_repo, NULL, cancellable, error };
+  guint n_jobs;
+  guint i;
+  EvTagTimer timer;
+  char hexdigest[EVTAG_SHA512_DIGEST_LEN * 2 + 1];
+
+  evtag_timer_start (&timer, EVTAG_PHASE_V1_CHECKSUM);
+
+  /* Kept across commits, for batch verification */
+  if (!self->v1_digests)
+    self->v1_digests = g_hash_table_new_full (oid_hash, oid_equal, g_free, NULL);
+
+  g_mutex_init (&v1.lock);
+  v1.seen = g_hash_table_new_full (oid_hash, oid_equal, g_free, NULL);
+  v1.nodes = g_ptr_array_new_with_free_func ((GDestroyNotify)git_odb_object_free);
+  v1.submodules = g_ptr_array_new_with_free_func (v1_submodule_free);
+
+  n_jobs = evtag_get_n_jobs (self);
+  if (n_jobs > 1)
+    {
+      v1.pool = g_thread_pool_new (v1_blob_thread, &v1, n_jobs, TRUE, error);
+      if (!v1.pool)
+        goto out;
+    }
+
+  r = git_repository_odb (&twdata.odb, self->top_repo);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  if (v1_needs_object (&v1, specified_oid) &&
+      !v1_walk_commit (&v1, &twdata, specified_oid, error))
+    goto out;
+
+  if (v1.pool)
+    {
+      g_thread_pool_free (v1.pool, FALSE, TRUE);
+      v1.pool = NULL;
+    }
+  if (v1.errmsg)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, v1.errmsg);
+      goto out;
+    }
+
+  for (i = 0; i < v1.nodes->len; i++)
+    {
+      if (!v1_hash_node (&v1, v1.nodes->pdata[i], error))
+        goto out;
+    }
+
+  evtag_digest_to_hex (v1_lookup_digest (self, specified_oid), hexdigest);
+  *out_checksum = g_strdup (hexdigest);
+  ret = TRUE;
+ out:
+  /* Blob jobs reference the odbs */
+  if (v1.pool)
+    g_thread_pool_free (v1.pool, FALSE, TRUE);
+  if (twdata.submodule_names)
+    g_hash_table_unref (twdata.submodule_names);
+  if (twdata.odb)
+    git_odb_free (twdata.odb);
+  g_ptr_array_unref (v1.nodes);
+  g_ptr_array_unref (v1.submodules);
+  g_hash_table_unref (v1.seen);
+  g_free (v1.errmsg);
+  g_mutex_clear (&v1.lock);
+  evtag_timer_stop (self, &timer);
+  return ret;
+}
+
+/* Verifying the same tag repeatedly is common in CI, so the
+ * checksum computed for a commit is cached.  Entries are keyed by the
+ * commit alone: it pins its tree, and through the gitlinks in it the
+ * commit of every submodule, recursively.
+ */
+static char *
+verify_cache_material (const git_oid *commit)
+{
+  char oid_hexstr[GIT_OID_HEXSZ+1];
+
+  return g_strconcat (EVTAG_SHA512, "\n",
+                      git_oid_tostr (oid_hexstr, sizeof (oid_hexstr), commit), "\n",
+                      NULL);
+}
+
+static char *
+verify_cache_entry_path (struct EvTag *self,
+                         const char   *material)
+{
+  char *dir = evtag_state_dir (self);
+  char *name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, material, -1);
+  char *path = g_build_filename (dir, "verify-cache", name, NULL);
+
+  g_free (name);
+  g_free (dir);
+  return path;
+}
+
+/* Sets @out_checksum to %NULL if there is no valid entry */
+static gboolean
+verify_cache_lookup (struct EvTag   *self,
+                     const char     *material,
+                     char          **out_checksum,
+                     GError        **error)
+{
+  gboolean ret = FALSE;
+  GBytes *key;
+  char *path = NULL;
+  char *contents = NULL;
+  char **lines = NULL;
+  char *signed_data = NULL;
+  char *expected_hmac = NULL;
+  GError *local_error = NULL;
+
+  *out_checksum = NULL;
+
+  key = evtag_get_cache_key (self, error);
+  if (!key)
+    goto out;
+
+  path = verify_cache_entry_path (self, material);
+  if (!g_file_get_contents (path, &contents, NULL, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&local_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, local_error);
+      goto out;
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  if (g_strv_length (lines) >= 2)
+    {
+      signed_data = g_strconcat (material, lines[0], NULL);
+      expected_hmac = evtag_cache_hmac (key, (guint8*)signed_data, strlen (signed_data));
+      if (str_equal_constant_time (expected_hmac, lines[1]))
+        *out_checksum = g_strdup (lines[0]);
+    }
+  if (!*out_checksum)
+    g_printerr ("warning: Ignoring invalid cache entry %s\n", path);
+
+  ret = TRUE;
+ out:
+  g_free (expected_hmac);
+  g_free (signed_data);
+  g_strfreev (lines);
+  g_free (contents);
+  g_free (path);
+  return ret;
+}
+
+static gboolean
+verify_cache_store (struct EvTag   *self,
+                    const char     *material,
+                    const char     *checksum,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  GBytes *key;
+  char *path = NULL;
+  char *dir = NULL;
+  char *signed_data = NULL;
+  char *hmac = NULL;
+  char *contents = NULL;
+
+  key = evtag_get_cache_key (self, error);
+  if (!key)
+    goto out;
+
+  path = verify_cache_entry_path (self, material);
+  dir = g_path_get_dirname (path);
+  if (!ensure_state_subdir (dir, error))
+    goto out;
+
+  signed_data = g_strconcat (material, checksum, NULL);
+  hmac = evtag_cache_hmac (key, (guint8*)signed_data, strlen (signed_data));
+  contents = g_strconcat (checksum, "\n", hmac, "\n", NULL);
+  if (!g_file_set_contents (path, contents, -1, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  g_free (contents);
+  g_free (hmac);
+  g_free (signed_data);
+  g_free (dir);
+  g_free (path);
+  return ret;
+}
+
+/* Applies the options shared by the commands, once they are parsed,
+ * and opens the current repository if @open_repo.
+ */
+static gboolean
+evtag_start_command (struct EvTag  *self,
+                     gboolean       open_repo,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  if (opt_timeout < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --timeout %d", opt_timeout);
+      return FALSE;
+    }
+  if (opt_timeout > 0)
+    self->watchdog = watchdog_start (cancellable, opt_timeout);
+  if (opt_object_cache_size < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --object-cache-size %d", opt_object_cache_size);
+      return FALSE;
+    }
+  if (opt_readahead < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --readahead %d", opt_readahead);
+      return FALSE;
+    }
+
+  self->progress_tty = isatty (2);
+  self->progress = opt_progress || self->progress_tty;
+
+  if (open_repo)
+    {
+      int r = git_repository_open_ext (&self->top_repo, ".", 0, NULL);
+      if (!handle_libgit_ret (r, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+git_evtag_builtin_sign (struct EvTag *self, int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  const char *tagname;
+  git_object *obj = NULL;
+  git_oid specified_oid;
+  GOptionContext *optcontext;
+  guint64 elapsed_ns;
+  char commit_oid_hexstr[GIT_OID_HEXSZ+1];
+  char *v1_checksum = NULL;
+  EvTagTimer timer = { 0, };
+
+  optcontext = g_option_context_new ("TAGNAME - Create a new GPG signed tag");
+
+  if (!option_context_parse (optcontext, sign_options, &argc, &argv,
+                             cancellable, error))
+    goto out;
+
+  if (!evtag_start_command (self, TRUE, cancellable, error))
+    goto out;
+
+  if (!validate_checkpoint_options (error))
+    goto out;
+
+  if (argc < 2)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "A TAGNAME argument is required");
+      goto out;
+    }
+  else if (argc > 2)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+      goto out;
+    }
+  tagname = argv[1];
+
+  if (!check_working_tree (self, cancellable, error))
+    goto out;
+
+  r = git_revparse_single (&obj, self->top_repo, "HEAD");
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  specified_oid = *git_object_id (obj);
+  git_oid_fmt (commit_oid_hexstr, &specified_oid);
+  commit_oid_hexstr[sizeof(commit_oid_hexstr)-1] = '\0';
+
+  if (!validate_at_head (self, &specified_oid, error))
+    goto out;
+
+  if (opt_with_legacy_archive_tag && !opt_print_only)
+    self->archive = archive_new ();
+
+  if (!checksum_commit_recurse (self, &specified_oid, &elapsed_ns,
+                                cancellable, error))
+    goto out;
+
+  if (opt_with_v1 &&
+      !checksum_commit_v1 (self, &specified_oid, &v1_checksum, cancellable, error))
+    goto out;
+
+  if (opt_print_only)
+    {
+      char *stats = get_stats (self);
+      g_print ("%s\n", stats);
+      g_free (stats);
+      g_print ("%s %s\n", EVTAG_SHA512, evtag_hash_get_string (self->checksum.hash));
+      if (v1_checksum)
+        g_print ("%s %s\n", EVTAG_V1_SHA512, v1_checksum);
+    }
+  else
+    {
+      const char *editor;
+      int tmpfd;
+      char *temppath;
+      char *editor_child_argv[] = { NULL, NULL, NULL };
+      GPtrArray *gittag_child_argv = g_ptr_array_new ();
+      GString *buf = g_string_new ("\n\n");
+      gboolean have_evtag;
+
+      tmpfd = g_file_open_tmp ("git-evtag-XXXXXX.md", &temppath, error);
+      if (tmpfd < 0)
+        goto out;
+      (void) close (tmpfd);
+
+      g_string_append_printf (buf, "# git-evtag comment: Computed checksum in %0.1fs\n",
+                              (double)(elapsed_ns) / (double) G_USEC_PER_SEC);
+
+      {
+        char *stats = get_stats (self);
+        g_string_append (buf, stats);
+        g_string_append_c (buf, '\n');
+        g_free (stats);
+      }
+      g_string_append (buf, EVTAG_SHA512);
+      g_string_append_c (buf, ' ');
+      g_string_append (buf, evtag_hash_get_string (self->checksum.hash));
+      g_string_append_c (buf, '\n');
+      if (v1_checksum)
+        g_string_append_printf (buf, "%s %s\n", EVTAG_V1_SHA512, v1_checksum);
+
+      if (opt_with_legacy_archive_tag)
+        {
+          if (!compute_and_append_legacy_archive_checksum (self, commit_oid_hexstr, buf,
+                                                           cancellable, error))
+            goto out;
+        }
+      
+      if (!g_file_set_contents (temppath, buf->str, -1, error))
+        goto out;
+      g_string_free (buf, TRUE);
+
+      editor = getenv ("EDITOR");
+      if (!editor)
+        editor = "vi";
+
+      editor_child_argv[0] = (char*)editor;
+      editor_child_argv[1] = (char*)temppath;
+      evtag_timer_start (&timer, EVTAG_PHASE_TAG_SPAWN);
+      if (!spawn_sync_require_success (editor_child_argv, 
+                                       G_SPAWN_SEARCH_PATH | G_SPAWN_CHILD_INHERITS_STDIN,
+                                       error))
+        goto out;
+      evtag_timer_stop (self, &timer);
+
+      if (!check_file_has_evtag (temppath, &have_evtag, error))
+        goto out;
+
+      if (!have_evtag)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Aborting tag due to deleted Git-EVTag line"); 
+          goto out;
+        }
+      
+      g_ptr_array_add (gittag_child_argv, "git");
+      g_ptr_array_add (gittag_child_argv, "tag");
+      if (!opt_no_signature)
+        g_ptr_array_add (gittag_child_argv, "-s");
+      if (opt_keyid)
+        {
+          g_ptr_array_add (gittag_child_argv, "--local-user");
+          g_ptr_array_add (gittag_child_argv, opt_keyid);
+        }
+      g_ptr_array_add (gittag_child_argv, "-F");
+      g_ptr_array_add (gittag_child_argv, temppath);
+      g_ptr_array_add (gittag_child_argv, (char*)tagname);
+      g_ptr_array_add (gittag_child_argv, (char*)commit_oid_hexstr);
+      g_ptr_array_add (gittag_child_argv, NULL);
+      evtag_timer_start (&timer, EVTAG_PHASE_TAG_SPAWN);
+      if (!spawn_sync_require_success ((char**)gittag_child_argv->pdata,
+                                       G_SPAWN_SEARCH_PATH,
+                                       error))
+        {
+          g_printerr ("Saved tag message in: %s\n", temppath);
+          goto out;
+        }
+      evtag_timer_stop (self, &timer);
+      (void) unlink (temppath);
+      g_ptr_array_free (gittag_child_argv, TRUE);
+    }
+
+  ret = TRUE;
+ out:
+  evtag_timer_stop (self, &timer);
+  g_free (v1_checksum);
+  if (self->archive)
+    {
+      archive_free (self->archive);
+      self->archive = NULL;
+    }
+  return ret;
+}
+
+/* The signature of a tag is checked while its checksum is computed.
+ * OpenPGP signatures are verified with gpgme when available, which
+ * saves starting git (gpgme still runs gpg itself); anything else,
+ * or a configuration gpgme wouldn't honor, goes to `git verify-tag`
+ * started in the background.
+ */
+#ifdef HAVE_GPGME
+/* Shared by the check and its thread.  A cancelled check doesn't wait
+ * for gpg, so whichever lets go of it last frees it.
+ */
+typedef struct {
+  gint ref_count;
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+  gboolean cancelled;
+  /* While gpgme_op_verify() runs, for gpgme_cancel_async() */
+  gpgme_ctx_t ctx;
+  GBytes *tag_data;
+  gsize payload_len;
+  char *errmsg;
+  /* A line for each good signature, printed like gpg does */
+  GString *good;
+  guint64 wall_usec;
+  guint64 cpu_usec;
+} EvTagGpgmeVerify;
+#endif
+
+typedef struct {
+  struct EvTag *evtag;
+  /* For `git verify-tag` */
+  GSubprocess *proc;
+  EvTagTimer timer;
+#ifdef HAVE_GPGME
+  EvTagGpgmeVerify *gpgme;
+#endif
+} EvTagSigCheck;
+
+#ifdef HAVE_GPGME
+/* Like git's parse_signed_buffer(), the signature starts at the last
+ * line that looks like the start of one; returns @len if none does.
+ */
+static gsize
+find_tag_signature (const char *data,
+                    gsize       len,
+                    gboolean   *out_openpgp)
+{
+  static const char * const openpgp_markers[] = {
+    "-----BEGIN PGP SIGNATURE-----", "-----BEGIN PGP MESSAGE-----", NULL
+  };
+  static const char * const other_markers[] = {
+    "-----BEGIN SIGNED MESSAGE-----", "-----BEGIN SSH SIGNATURE-----", NULL
+  };
+  gsize match = len;
+  gsize pos = 0;
+  guint i;
+
+  *out_openpgp = FALSE;
+  while (pos < len)
+    {
+      const char *eol = memchr (data + pos, '\n', len - pos);
+
+      for (i = 0; openpgp_markers[i]; i++)
+        {
+          if (len - pos >= strlen (openpgp_markers[i]) &&
+              memcmp (data + pos, openpgp_markers[i], strlen (openpgp_markers[i])) == 0)
+            {
+              match = pos;
+              *out_openpgp = TRUE;
+            }
+        }
+      for (i = 0; other_markers[i]; i++)
+        {
+          if (len - pos >= strlen (other_markers[i]) &&
+              memcmp (data + pos, other_markers[i], strlen (other_markers[i])) == 0)
+            {
+              match = pos;
+              *out_openpgp = FALSE;
+            }
+        }
+
+      pos = eol ? (gsize)(eol - data) + 1 : len;
+    }
+
+  return match;
+}
+
+/* Settings that change what `git verify-tag` accepts or runs */
+static gboolean
+gpg_config_is_default (git_repository *repo)
+{
+  static const char * const keys[] = {
+    "gpg.program", "gpg.openpgp.program", "gpg.minTrustLevel", NULL
+  };
+  git_config *config = NULL;
+  const char *value;
+  gboolean ret = FALSE;
+  guint i;
+
+  if (git_repository_config_snapshot (&config, repo) != 0)
+    goto out;
+  for (i = 0; keys[i]; i++)
+    {
+      if (git_config_get_string (&value, config, keys[i]) == 0)
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (config)
+    git_config_free (config);
+  return ret;
+}
+
+static void
+gpgme_verify_unref (EvTagGpgmeVerify *verify)
+{
+  if (!g_atomic_int_dec_and_test (&verify->ref_count))
+    return;
+  g_mutex_clear (&verify->lock);
+  g_cond_clear (&verify->cond);
+  g_bytes_unref (verify->tag_data);
+  g_free (verify->errmsg);
+  g_string_free (verify->good, TRUE);
+  g_free (verify);
+}
+
+/* The primary user id of the key, as gpg shows it */
+static char *
+gpgme_signer_name (gpgme_ctx_t  ctx,
+                   const char  *fpr)
+{
+  gpgme_key_t key = NULL;
+  char *name = NULL;
+
+  if (fpr && gpgme_get_key (ctx, fpr, &key, 0) == 0 &&
+      key->uids && key->uids->uid)
+    name = g_strdup_printf ("\"%s\" (key %s)", key->uids->uid, fpr);
+  else
+    name = g_strdup_printf ("key %s", fpr ? fpr : "(unknown)");
+  if (key)
+    gpgme_key_unref (key);
+  return name;
+}
+
+static gpointer
+gpgme_verify_thread (gpointer data)
+{
+  EvTagGpgmeVerify *verify = data;
+  gsize len;
+  const char *tag_data = g_bytes_get_data (verify->tag_data, &len);
+  gpgme_ctx_t ctx = NULL;
+  gpgme_data_t signed_text = NULL;
+  gpgme_data_t sig = NULL;
+  gpgme_verify_result_t result;
+  gpgme_signature_t signature;
+  gpgme_error_t err;
+  gboolean cancelled;
+  EvTagTimer timer;
+
+  evtag_timer_start (&timer, EVTAG_PHASE_GPG_VERIFY);
+
+  err = gpgme_new (&ctx);
+  if (!err)
+    err = gpgme_set_protocol (ctx, GPGME_PROTOCOL_OpenPGP);
+  if (!err)
+    err = gpgme_data_new_from_mem (&signed_text, tag_data, verify->payload_len, 0);
+  if (!err)
+    err = gpgme_data_new_from_mem (&sig, tag_data + verify->payload_len,
+                                   len - verify->payload_len, 0);
+  if (err)
+    {
+      verify->errmsg = g_strdup_printf ("Verifying signature: %s", gpgme_strerror (err));
+      goto out;
+    }
+
+  g_mutex_lock (&verify->lock);
+  cancelled = verify->cancelled;
+  if (!cancelled)
+    verify->ctx = ctx;
+  g_mutex_unlock (&verify->lock);
+  if (cancelled)
+    goto out;
+  err = gpgme_op_verify (ctx, sig, signed_text, NULL);
+  g_mutex_lock (&verify->lock);
+  verify->ctx = NULL;
+  g_mutex_unlock (&verify->lock);
+  if (err)
+    {
+      verify->errmsg = g_strdup_printf ("Verifying signature: %s", gpgme_strerror (err));
+      goto out;
+    }
+
+  /* As with git, every signature must be good; trust isn't required */
+  result = gpgme_op_verify_result (ctx);
+  if (!result || !result->signatures)
+    {
+      verify->errmsg = g_strdup ("no signature found");
+      goto out;
+    }
+  for (signature = result->signatures; signature; signature = signature->next)
+    {
+      char *signer = gpgme_signer_name (ctx, signature->fpr);
+
+      /* Worded like gpg, which `git verify-tag` shows */
+      if (gpgme_err_code (signature->status) != GPG_ERR_NO_ERROR)
+        {
+          verify->errmsg = g_strdup_printf ("BAD signature from %s: %s", signer,
+                                            gpgme_strerror (signature->status));
+          g_free (signer);
+          goto out;
+        }
+      g_string_append_printf (verify->good, "Good signature from %s\n", signer);
+      g_free (signer);
+    }
+
+ out:
+  evtag_timer_elapsed (&timer, &verify->wall_usec, &verify->cpu_usec);
+  if (sig)
+    gpgme_data_release (sig);
+  if (signed_text)
+    gpgme_data_release (signed_text);
+  if (ctx)
+    gpgme_release (ctx);
+
+  g_mutex_lock (&verify->lock);
+  verify->done = TRUE;
+  g_cond_broadcast (&verify->cond);
+  g_mutex_unlock (&verify->lock);
+  gpgme_verify_unref (verify);
+  return NULL;
+}
+
+/* Called from the thread that cancelled */
+static void
+gpgme_verify_cancelled (GCancellable *cancellable,
+                        gpointer      data)
+{
+  EvTagGpgmeVerify *verify = data;
+
+  g_mutex_lock (&verify->lock);
+  verify->cancelled = TRUE;
+  if (verify->ctx)
+    (void) gpgme_cancel_async (verify->ctx);
+  g_cond_broadcast (&verify->cond);
+  g_mutex_unlock (&verify->lock);
+}
+#endif
+
+static void
+sig_check_free (EvTagSigCheck *check)
+{
+  g_clear_object (&check->proc);
+#ifdef HAVE_GPGME
+  if (check->gpgme)
+    gpgme_verify_unref (check->gpgme);
+#endif
+  g_free (check);
+}
+
+static EvTagSigCheck *
+sig_check_start (struct EvTag   *self,
+                 const git_oid  *tag_oid,
+                 GError        **error)
+{
+  EvTagSigCheck *check = g_new0 (EvTagSigCheck, 1);
+  char tag_oid_hexstr[GIT_OID_HEXSZ+1];
+  char *git_dir_arg = NULL;
+  const char *argv[] = { "git", "verify-tag", tag_oid_hexstr, NULL, NULL };
+
+  check->evtag = self;
+  git_oid_tostr (tag_oid_hexstr, sizeof (tag_oid_hexstr), tag_oid);
+
+#ifdef HAVE_GPGME
+  if (gpg_config_is_default (self->top_repo))
+    {
+      static gsize initialized = 0;
+      git_odb *odb = NULL;
+      git_odb_object *tag = NULL;
+      gboolean openpgp = FALSE;
+      gsize payload_len = 0;
+      GBytes *tag_data = NULL;
+
+      if (g_once_init_enter (&initialized))
+        {
+          (void) gpgme_check_version (NULL);
+          g_once_init_leave (&initialized, 1);
+        }
+
+      /* The signature covers the raw tag object up to it */
+      if (git_repository_odb (&odb, self->top_repo) == 0 &&
+          git_odb_read (&tag, odb, tag_oid) == 0)
+        {
+          payload_len = find_tag_signature (git_odb_object_data (tag),
+                                            git_odb_object_size (tag), &openpgp);
+          if (openpgp || payload_len == git_odb_object_size (tag))
+            tag_data = g_bytes_new (git_odb_object_data (tag), git_odb_object_size (tag));
+        }
+      if (tag)
+        git_odb_object_free (tag);
+      if (odb)
+        git_odb_free (odb);
+
+      if (tag_data)
+        {
+          EvTagGpgmeVerify *verify;
+
+          if (payload_len == g_bytes_get_size (tag_data))
+            {
+              /* Same message as `git verify-tag` */
+              g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "no signature found");
+              g_bytes_unref (tag_data);
+              sig_check_free (check);
+              return NULL;
+            }
+
+          verify = g_new0 (EvTagGpgmeVerify, 1);
+          /* One for the check, one for the thread */
+          verify->ref_count = 2;
+          g_mutex_init (&verify->lock);
+          g_cond_init (&verify->cond);
+          verify->tag_data = tag_data;
+          verify->payload_len = payload_len;
+          verify->good = g_string_new ("");
+          check->gpgme = verify;
+          g_thread_unref (g_thread_new ("evtag-gpgme", gpgme_verify_thread, verify));
+          return check;
+        }
+    }
+#endif
+
+  /* The repository of --bundle isn't the current directory */
+  if (opt_bundle)
+    {
+      git_dir_arg = g_strconcat ("--git-dir=", git_repository_path (self->top_repo), NULL);
+      argv[1] = git_dir_arg;
+      argv[2] = "verify-tag";
+      argv[3] = tag_oid_hexstr;
+    }
+
+  evtag_timer_start (&check->timer, EVTAG_PHASE_GPG_VERIFY);
+  check->proc = g_subprocess_newv (argv, G_SUBPROCESS_FLAGS_NONE, error);
+  g_free (git_dir_arg);
+  if (!check->proc)
+    {
+      sig_check_free (check);
+      return NULL;
+    }
+  return check;
+}
+
+/* Waits for the result, and frees @check */
+static gboolean
+sig_check_finish (EvTagSigCheck  *check,
+                  GCancellable   *cancellable,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+
+#ifdef HAVE_GPGME
+  if (check->gpgme)
+    {
+      EvTagGpgmeVerify *verify = check->gpgme;
+      gulong handler = 0;
+      gboolean done;
+
+      /* On --timeout or SIGINT, gpg is asked to stop, but not waited
+       * for; the thread frees @verify once it returns.
+       */
+      if (cancellable)
+        handler = g_cancellable_connect (cancellable, G_CALLBACK (gpgme_verify_cancelled),
+                                         verify, NULL);
+      g_mutex_lock (&verify->lock);
+      while (!verify->done && !verify->cancelled)
+        g_cond_wait (&verify->cond, &verify->lock);
+      done = verify->done;
+      g_mutex_unlock (&verify->lock);
+      if (handler)
+        g_cancellable_disconnect (cancellable, handler);
+
+      if (!done)
+        {
+          (void) g_cancellable_set_error_if_cancelled (cancellable, error);
+          goto out;
+        }
+      evtag_phase_add (check->evtag, EVTAG_PHASE_GPG_VERIFY,
+                       verify->wall_usec, verify->cpu_usec);
+      if (verify->errmsg)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, verify->errmsg);
+          goto out;
+        }
+      g_printerr ("%s", verify->good->str);
+      ret = TRUE;
+      goto out;
+    }
+#endif
+
+  if (!g_subprocess_wait_check (check->proc, cancellable, error))
+    {
+      if (g_cancellable_is_cancelled (cancellable))
+        g_subprocess_force_exit (check->proc);
+      goto out;
+    }
+  ret = TRUE;
+ out:
+  evtag_timer_stop (check->evtag, &check->timer);
+  sig_check_free (check);
+  return ret;
+}
+
+/* Checks the signature of @tagname and the Git-EVTag lines in its
+ * message (v0, v1 or both) against the checksums of its target.
+ * Unless @require_head is %FALSE, the target must be HEAD.  On success @out_line is set to the
+ * verified line, the v0 one if there are both.
+ */
+static gboolean
+verify_one_tag (struct EvTag  *self,
+                const char    *tagname,
+                gboolean       require_head,
+                char         **out_line,
+                gboolean      *out_cached,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  gboolean ret = FALSE;
+  int r;
+  char *verified_line = NULL;
+  git_oid tag_oid;
+  git_object *obj = NULL;
+  char *long_tagname = NULL;
+  git_tag *tag = NULL;
+  const char *message;
+  git_oid specified_oid;
+  const char *expected_checksum = NULL;
+  char *v0_line = NULL;
+  char *v1_line = NULL;
+  char *v1_checksum = NULL;
+  char *cache_material = NULL;
+  char *cached_checksum = NULL;
+  char *legacy_line = NULL;
+  char *legacy_checksum = NULL;
+  char commit_oid_hexstr[GIT_OID_HEXSZ+1];
+  EvTagSigCheck *sig_check = NULL;
+
+  long_tagname = g_strconcat ("refs/tags/", tagname, NULL);
+
+  r = git_reference_name_to_id (&tag_oid, self->top_repo, long_tagname);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_tag_lookup (&tag, self->top_repo, &tag_oid);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_tag_target (&obj, tag);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  specified_oid = *git_object_id (obj);
+
+  git_oid_fmt (commit_oid_hexstr, &specified_oid);
+  commit_oid_hexstr[sizeof(commit_oid_hexstr)-1] = '\0';
+
+  if (require_head && !validate_at_head (self, &specified_oid, error))
+    goto out;
+
+  message = git_tag_message (tag);
+
+  /* Runs alongside the checksum; see sig_check_finish() below */
+  if (!opt_no_signature)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+      sig_check = sig_check_start (self, git_tag_id (tag), error);
+      if (!sig_check)
+        goto out;
+    }
+
+  v0_line = find_message_line (message, EVTAG_SHA512);
+  v1_line = find_message_line (message, EVTAG_V1_SHA512);
+  if (!v0_line && !v1_line)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to find %s in tag message",
+                   EVTAG_SHA512);
+      goto out;
+    }
+
+  if (opt_with_legacy_archive_tag)
+    {
+      legacy_line = find_message_line (message, LEGACY_EVTAG_ARCHIVE_TAR);
+      if (!legacy_line)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Failed to find %s in tag message",
+                       LEGACY_EVTAG_ARCHIVE_TAR);
+          goto out;
+        }
+      /* Otherwise it is computed with `git archive` */
+      if (v0_line)
+        self->archive = archive_new ();
+    }
+
+  /* The legacy checksum needs the objects, so can't be cached */
+  if (v0_line && !opt_no_cache && !self->archive)
+    {
+      GError *local_error = NULL;
+
+      /* The cache is only an optimization; never fail because of it */
+      cache_material = verify_cache_material (&specified_oid);
+      if (!verify_cache_lookup (self, cache_material, &cached_checksum, &local_error))
+        {
+          g_free (cache_material);
+          cache_material = NULL;
+        }
+      if (local_error)
+        {
+          g_printerr ("warning: Not using checksum cache: %s\n", local_error->message);
+          g_clear_error (&local_error);
+        }
+    }
+
+  if (cached_checksum)
+    expected_checksum = cached_checksum;
+  else if (v0_line)
+    {
+      if (!checksum_commit_recurse (self, &specified_oid, NULL,
+                                    cancellable, error))
+        goto out;
+
+      expected_checksum = evtag_hash_get_string (self->checksum.hash);
+
+      if (cache_material)
+        {
+          GError *local_error = NULL;
+          if (!verify_cache_store (self, cache_material, expected_checksum, &local_error))
+            {
+              g_printerr ("warning: Failed to update checksum cache: %s\n", local_error->message);
+              g_clear_error (&local_error);
+            }
+        }
+    }
+  if (v0_line &&
+      !verify_line (EVTAG_SHA512, expected_checksum, v0_line, commit_oid_hexstr, error))
+    goto out;
+
+  if (legacy_line)
+    {
+      const char *expected_legacy = legacy_line + strlen (LEGACY_EVTAG_ARCHIVE_TAR);
+
+      if (!legacy_archive_checksum (self, commit_oid_hexstr, &legacy_checksum, NULL,
+                                    cancellable, error))
+        goto out;
+      while (*expected_legacy == ' ')
+        expected_legacy++;
+      if (strcmp (expected_legacy, legacy_checksum) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid %s: computed %s but tag has %s",
+                       LEGACY_EVTAG_ARCHIVE_TAR, legacy_checksum, expected_legacy);
+          goto out;
+        }
+    }
+
+  if (v1_line)
+    {
+      if (!checksum_commit_v1 (self, &specified_oid, &v1_checksum, cancellable, error))
+        goto out;
+      if (!verify_line (EVTAG_V1_SHA512, v1_checksum, v1_line, commit_oid_hexstr, error))
+        goto out;
+    }
+
+  if (sig_check)
+    {
+      EvTagSigCheck *check = sig_check;
+
+      sig_check = NULL;
+      if (!sig_check_finish (check, cancellable, error))
+        goto out;
+    }
+
+  if (v0_line)
+    {
+      verified_line = v0_line;
+      v0_line = NULL;
+    }
+  else
+    {
+      verified_line = v1_line;
+      v1_line = NULL;
+    }
+
+  ret = TRUE;
+  *out_line = verified_line;
+  verified_line = NULL;
+  if (out_cached)
+    *out_cached = cached_checksum != NULL;
+ out:
+  if (sig_check)
+    {
+      GError *sig_error = NULL;
+
+      /* A bad signature is reported first, as when it was checked up front */
+      if (!sig_check_finish (sig_check, cancellable, &sig_error))
+        {
+          g_clear_error (error);
+          g_propagate_error (error, sig_error);
+        }
+    }
+  if (self->archive)
+    {
+      archive_free (self->archive);
+      self->archive = NULL;
+    }
+  g_free (legacy_checksum);
+  g_free (legacy_line);
+  g_free (v1_checksum);
+  g_free (v1_line);
+  g_free (v0_line);
+  g_free (verified_line);
+  g_free (cached_checksum);
+  g_free (cache_material);
+  g_free (long_tagname);
+  if (obj)
+    git_object_free (obj);
+  if (tag)
+    git_tag_free (tag);
+  return ret;
+}
+
+/* Verifying many tags, e.g. every release of a project, is done in a
+ * single process with the tags spread over a few threads.  libgit2
+ * objects can't be shared between threads, so each worker opens the
+ * repository once and keeps it, along with its odb and object caches,
+ * for all of the tags it verifies.
+ */
+typedef struct {
+  char *tagname;
+  char *line;
+  GError *error;
+} EvTagBatchResult;
+
+typedef struct {
+  const char *repo_path;
+  GPtrArray *results;
+  gint next;
+  GCancellable *cancellable;
+  /* Protects the statistics of @evtag */
+  GMutex stats_lock;
+  struct EvTag *evtag;
+} EvTagBatch;
+
+/* Adds the statistics gathered by a worker to those of @self */
+static void
+evtag_merge_stats (struct EvTag *self,
+                   struct EvTag *worker)
+{
+  guint i;
+
+  for (i = 0; i < EVTAG_N_PHASES; i++)
+    {
+      self->phases[i].wall_usec += worker->phases[i].wall_usec;
+      self->phases[i].cpu_usec += worker->phases[i].cpu_usec;
+      self->phases[i].count += worker->phases[i].count;
+    }
+  for (i = 0; i < worker->n_largest; i++)
+    record_large_object (self, &worker->largest[i].oid,
+                         worker->largest[i].otype, worker->largest[i].size);
+
+  self->n_submodules += worker->n_submodules;
+  self->checksum.n_commits += worker->checksum.n_commits;
+  self->checksum.commit_bytes += worker->checksum.commit_bytes;
+  self->checksum.n_trees += worker->checksum.n_trees;
+  self->checksum.tree_bytes += worker->checksum.tree_bytes;
+  self->checksum.n_blobs += worker->checksum.n_blobs;
+  self->checksum.blob_bytes += worker->checksum.blob_bytes;
+  self->cache_hits += worker->cache_hits;
+  self->cache_misses += worker->cache_misses;
+  self->cache_bypassed += worker->cache_bypassed;
+  self->cache_evictions += worker->cache_evictions;
+  self->readahead_requests += worker->readahead_requests;
+  self->readahead_bytes += worker->readahead_bytes;
+  self->n_repos_opened += worker->n_repos_opened;
+  self->n_repos_reused += worker->n_repos_reused;
+}
+
+static void
+batch_result_free (gpointer data)
+{
+  EvTagBatchResult *result = data;
+  g_free (result->tagname);
+  g_free (result->line);
+  g_clear_error (&result->error);
+  g_free (result);
+}
+
+static gpointer
+verify_batch_thread (gpointer data)
+{
+  EvTagBatch *batch = data;
+  struct EvTag worker = { NULL, };
+  GError *open_error = NULL;
+  guint i;
+  int r;
+
+  r = git_repository_open (&worker.top_repo, batch->repo_path);
+  (void) handle_libgit_ret (r, &open_error);
+
+  /* The parallelism is across tags */
+  worker.n_jobs = 1;
+
+  while ((i = (guint) g_atomic_int_add (&batch->next, 1)) < batch->results->len)
+    {
+      EvTagBatchResult *result = batch->results->pdata[i];
+
+      if (open_error)
+        {
+          result->error = g_error_copy (open_error);
+          continue;
+        }
+      if (g_cancellable_set_error_if_cancelled (batch->cancellable, &result->error))
+        continue;
+
+      worker.checksum.hash = evtag_hash_new ();
+      (void) verify_one_tag (&worker, result->tagname, FALSE, &result->line, NULL,
+                             batch->cancellable, &result->error);
+      evtag_hash_free (worker.checksum.hash);
+      worker.checksum.hash = NULL;
+    }
+
+  g_mutex_lock (&batch->stats_lock);
+  evtag_merge_stats (batch->evtag, &worker);
+  g_mutex_unlock (&batch->stats_lock);
+
+  g_clear_error (&open_error);
+  if (worker.object_cache)
+    object_cache_free (worker.object_cache);
+  if (worker.readahead)
+    readahead_free (worker.readahead);
+  if (worker.v1_digests)
+    g_hash_table_unref (worker.v1_digests);
+  if (worker.shared_repos)
+    g_hash_table_unref (worker.shared_repos);
+  if (worker.shared_odbs)
+    g_hash_table_unref (worker.shared_odbs);
+  if (worker.top_repo)
+    git_repository_free (worker.top_repo);
+  if (worker.cache_key)
+    g_bytes_unref (worker.cache_key);
+  return NULL;
+}
+
+static gboolean
+collect_tags (git_repository *repo,
+              const char     *pattern,
+              GPtrArray      *tagnames,
+              GError        **error)
+{
+  git_strarray tags = { NULL, 0 };
+  size_t i;
+  int r;
+
+  r = git_tag_list_match (&tags, pattern, repo);
+  if (!handle_libgit_ret (r, error))
+    return FALSE;
+
+  for (i = 0; i < tags.count; i++)
+    g_ptr_array_add (tagnames, g_strdup (tags.strings[i]));
+
+  git_strarray_free (&tags);
+  return TRUE;
+}
+
+static gboolean
+tagnames_contains (GPtrArray  *tagnames,
+                   const char *name)
+{
+  guint i;
+
+  for (i = 0; i < tagnames->len; i++)
+    {
+      if (strcmp (tagnames->pdata[i], name) == 0)
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static gboolean
+verify_batch (struct EvTag  *self,
+              GPtrArray     *tagnames,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  gboolean ret = FALSE;
+  EvTagBatch batch = { NULL, };
+  GPtrArray *threads = g_ptr_array_new ();
+  guint n_threads;
+  guint n_failed = 0;
+  guint i;
+
+  if (tagnames->len == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "No matching tags");
+      goto out;
+    }
+
+  batch.repo_path = git_repository_workdir (self->top_repo);
+  if (!batch.repo_path)
+    batch.repo_path = git_repository_path (self->top_repo);
+  batch.results = g_ptr_array_new_with_free_func (batch_result_free);
+  batch.cancellable = cancellable;
+  batch.evtag = self;
+  g_mutex_init (&batch.stats_lock);
+  for (i = 0; i < tagnames->len; i++)
+    {
+      EvTagBatchResult *result = g_new0 (EvTagBatchResult, 1);
+      result->tagname = g_strdup (tagnames->pdata[i]);
+      g_ptr_array_add (batch.results, result);
+    }
+
+  n_threads = opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ();
+  if (!(git_libgit2_features () & GIT_FEATURE_THREADS))
+    n_threads = 1;
+  n_threads = MIN (n_threads, tagnames->len);
+  self->n_jobs_used = n_threads;
+
+  for (i = 0; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("evtag-verify", verify_batch_thread, &batch));
+  for (i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  for (i = 0; i < batch.results->len; i++)
+    {
+      EvTagBatchResult *result = batch.results->pdata[i];
+
+      if (result->error)
+        {
+          g_print ("FAILED %s: %s\n", result->tagname, result->error->message);
+          n_failed++;
+        }
+      else
+        g_print ("Successfully verified %s: %s\n", result->tagname, result->line);
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (n_failed > 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to verify %u of %u tags", n_failed, batch.results->len);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_ptr_array_unref (threads);
+  if (batch.results)
+    {
+      g_mutex_clear (&batch.stats_lock);
+      g_ptr_array_unref (batch.results);
+    }
+  return ret;
+}
+
+/* With --bundle, tags are verified straight from a git bundle or a
+ * pack, as received by a release pipeline, without a clone or
+ * checkout.  The pack is streamed through libgit2's indexer into a
+ * temporary bare repository, which then stands in for the current
+ * one; it only ever holds the pack and its index.  The objects of
+ * each --submodule-bundle go into the same repository, which also
+ * serves as the repository of every submodule.  Refs are taken from
+ * the bundle header, or for a bare pack, made up from the names of
+ * the tag objects it contains.
+ */
+#define EVTAG_BUNDLE_V2_SIGNATURE "# v2 git bundle"
+#define EVTAG_BUNDLE_V3_SIGNATURE "# v3 git bundle"
+#define EVTAG_BUNDLE_BUFSIZE (1024 * 1024)
+
+static gboolean
+remove_recursive (const char  *path,
+                  GError     **error)
+{
+  struct stat stbuf;
+
+  if (lstat (path, &stbuf) < 0)
+    {
+      int errsv = errno;
+      if (errsv == ENOENT)
+        return TRUE;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Removing %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  if (S_ISDIR (stbuf.st_mode))
+    {
+      GDir *dir = g_dir_open (path, 0, error);
+      const char *name;
+
+      if (!dir)
+        return FALSE;
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          char *child = g_build_filename (path, name, NULL);
+          gboolean removed = remove_recursive (child, error);
+
+          g_free (child);
+          if (!removed)
+            {
+              g_dir_close (dir);
+              return FALSE;
+            }
+        }
+      g_dir_close (dir);
+    }
+
+  if ((S_ISDIR (stbuf.st_mode) ? rmdir (path) : unlink (path)) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Removing %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Reads the header of the bundle @path up to the pack, adding its refs
+ * to @refs unless that is %NULL.
+ */
+static gboolean
+read_bundle_header (GDataInputStream  *data,
+                    const char        *path,
+                    GHashTable        *refs,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  gboolean ret = FALSE;
+  char *line = NULL;
+  gboolean v3;
+  GError *local_error = NULL;
+
+  line = g_data_input_stream_read_line (data, NULL, cancellable, &local_error);
+  if (local_error)
+    {
+      g_propagate_error (error, local_error);
+      goto out;
+    }
+  if (g_strcmp0 (line, EVTAG_BUNDLE_V2_SIGNATURE) == 0)
+    v3 = FALSE;
+  else if (g_strcmp0 (line, EVTAG_BUNDLE_V3_SIGNATURE) == 0)
+    v3 = TRUE;
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a git bundle or pack", path);
+      goto out;
+    }
+
+  while (TRUE)
+    {
+      git_oid oid;
+      const char *refname;
+
+      g_free (line);
+      line = g_data_input_stream_read_line (data, NULL, cancellable, &local_error);
+      if (local_error)
+        {
+          g_propagate_error (error, local_error);
+          goto out;
+        }
+      if (!line)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Truncated bundle header in %s", path);
+          goto out;
+        }
+      if (*line == '\0')
+        break;
+
+      /* A filtered bundle would lack objects the checksum covers */
+      if (v3 && line[0] == '@')
+        {
+          if (!g_str_equal (line, "@object-format=sha1"))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "Unsupported bundle capability %s in %s", line + 1, path);
+              goto out;
+            }
+          continue;
+        }
+
+      /* The prerequisites of an incremental bundle aren't here */
+      if (line[0] == '-')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "%s requires commits it doesn't contain; a complete bundle is needed",
+                       path);
+          goto out;
+        }
+
+      if (strlen (line) < GIT_OID_HEXSZ + 2 || line[GIT_OID_HEXSZ] != ' ' ||
+          git_oid_fromstrn (&oid, line, GIT_OID_HEXSZ) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Invalid bundle header line in %s: %s", path, line);
+          goto out;
+        }
+      refname = line + GIT_OID_HEXSZ + 1;
+      /* Such as HEAD, which only matters for cloning */
+      if (refs && g_str_has_prefix (refname, "refs/"))
+        {
+          git_oid *target = g_new (git_oid, 1);
+
+          git_oid_cpy (target, &oid);
+          g_hash_table_replace (refs, g_strdup (refname), target);
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_free (line);
+  return ret;
+}
+
+/* Streams the pack of the bundle or pack @path into the object
+ * database of @repo, adding the refs of a bundle to @refs unless that
+ * is %NULL.
+ */
+static gboolean
+index_bundle (git_repository  *repo,
+              const char      *path,
+              GHashTable      *refs,
+              gboolean        *out_is_pack,
+              GCancellable    *cancellable,
+              GError         **error)
+{
+  gboolean ret = FALSE;
+  GFile *file = g_file_new_for_path (path);
+  GFileInputStream *in = NULL;
+  GDataInputStream *data = NULL;
+  git_odb *odb = NULL;
+  git_odb_writepack *writepack = NULL;
+  git_transfer_progress stats = { 0, };
+  const char *peek;
+  gsize avail = 0;
+  gboolean is_pack;
+  guint8 *buf = NULL;
+  int r;
+
+  in = g_file_read (file, cancellable, error);
+  if (!in)
+    goto out;
+  data = g_data_input_stream_new (G_INPUT_STREAM (in));
+
+  if (g_buffered_input_stream_fill (G_BUFFERED_INPUT_STREAM (data), 4, cancellable, error) < 0)
+    goto out;
+  peek = g_buffered_input_stream_peek_buffer (G_BUFFERED_INPUT_STREAM (data), &avail);
+  is_pack = avail >= 4 && memcmp (peek, "PACK", 4) == 0;
+  if (!is_pack &&
+      !read_bundle_header (data, path, refs, cancellable, error))
+    goto out;
+
+  r = git_repository_odb (&odb, repo);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_odb_write_pack (&writepack, odb, NULL, NULL);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  buf = g_malloc (EVTAG_BUNDLE_BUFSIZE);
+  while (TRUE)
+    {
+      gssize n = g_input_stream_read (G_INPUT_STREAM (data), buf, EVTAG_BUNDLE_BUFSIZE,
+                                      cancellable, error);
+      if (n < 0)
+        goto out;
+      if (n == 0)
+        break;
+      r = writepack->append (writepack, buf, (size_t)n, &stats);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+    }
+  r = writepack->commit (writepack, &stats);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  if (opt_verbose)
+    g_printerr ("Indexed %u objects from %s\n", stats.indexed_objects, path);
+
+  if (out_is_pack)
+    *out_is_pack = is_pack;
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Indexing %s: ", path);
+  g_free (buf);
+  if (writepack)
+    writepack->free (writepack);
+  if (odb)
+    git_odb_free (odb);
+  g_clear_object (&data);
+  g_clear_object (&in);
+  g_object_unref (file);
+  return ret;
+}
+
+static int
+collect_oid_cb (const git_oid *oid,
+                void          *payload)
+{
+  GArray *oids = payload;
+  g_array_append_val (oids, *oid);
+  return 0;
+}
+
+/* A bare pack has no refs, so each tag object in it is given one by
+ * its name.  This reads the header of every object, which for deltas
+ * means going down to their base, but packs are the rarer input.
+ */
+static gboolean
+add_pack_tag_refs (git_repository  *repo,
+                   const char      *path,
+                   GHashTable      *refs,
+                   GError         **error)
+{
+  gboolean ret = FALSE;
+  git_odb *odb = NULL;
+  GArray *oids = g_array_new (FALSE, FALSE, sizeof (git_oid));
+  guint i;
+  int r;
+
+  r = git_repository_odb (&odb, repo);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+  r = git_odb_foreach (odb, collect_oid_cb, oids);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  for (i = 0; i < oids->len; i++)
+    {
+      const git_oid *oid = &g_array_index (oids, git_oid, i);
+      git_otype otype;
+      size_t len;
+      git_tag *tag = NULL;
+      char *refname;
+      git_oid *target;
+
+      r = git_odb_read_header (&len, &otype, odb, oid);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+      if (otype != GIT_OBJ_TAG)
+        continue;
+
+      r = git_tag_lookup (&tag, repo, oid);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+      refname = g_strconcat ("refs/tags/", git_tag_name (tag), NULL);
+      git_tag_free (tag);
+
+      target = g_hash_table_lookup (refs, refname);
+      if (target && !git_oid_equal (target, oid))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Several tags named %s in %s; use a bundle",
+                       refname + strlen ("refs/tags/"), path);
+          g_free (refname);
+          goto out;
+        }
+      target = g_new (git_oid, 1);
+      git_oid_cpy (target, oid);
+      g_hash_table_replace (refs, refname, target);
+    }
+
+  ret = TRUE;
+ out:
+  g_array_unref (oids);
+  if (odb)
+    git_odb_free (odb);
+  return ret;
+}
+
+/* Replaces the current repository of @self with one holding the
+ * objects of --bundle and --submodule-bundle.  Nothing is cached in
+ * it, since it is removed on exit: the verify and manifest caches are
+ * off, and --checkpoint is refused.
+ */
+static gboolean
+open_bundle_repository (struct EvTag  *self,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  gboolean ret = FALSE;
+  git_repository *repo = NULL;
+  GHashTable *refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean is_pack = FALSE;
+  EvTagTimer timer;
+  guint i;
+  int r;
+
+  evtag_timer_start (&timer, EVTAG_PHASE_BUNDLE_INDEX);
+
+  opt_no_cache = TRUE;
+  opt_manifest_cache = FALSE;
+
+  if (!cancel_on_interrupt (cancellable, error))
+    goto out;
+  self->bundle_dir = g_dir_make_tmp ("git-evtag-bundle-XXXXXX", error);
+  if (!self->bundle_dir)
+    goto out;
+  r = git_repository_init (&repo, self->bundle_dir, TRUE);
+  if (!handle_libgit_ret (r, error))
+    goto out;
+
+  if (!index_bundle (repo, opt_bundle, refs, &is_pack, cancellable, error))
+    goto out;
+  if (is_pack && !add_pack_tag_refs (repo, opt_bundle, refs, error))
+    goto out;
+  for (i = 0; opt_submodule_bundles && opt_submodule_bundles[i]; i++)
+    {
+      if (!index_bundle (repo, opt_submodule_bundles[i], NULL, NULL, cancellable, error))
+        goto out;
+    }
+
+  /* Only now that the targets exist */
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      git_reference *ref = NULL;
+
+      r = git_reference_create (&ref, repo, key, value, TRUE, NULL);
+      if (!handle_libgit_ret (r, error))
+        goto out;
+      git_reference_free (ref);
+    }
+
+  if (self->top_repo)
+    git_repository_free (self->top_repo);
+  self->top_repo = repo;
+  repo = NULL;
+
+  ret = TRUE;
+ out:
+  evtag_timer_stop (self, &timer);
+  if (repo)
+    git_repository_free (repo);
+  g_hash_table_unref (refs);
+  return ret;
+}
+
+static gboolean
+git_evtag_builtin_verify (struct EvTag *self, int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *optcontext;
+  GPtrArray *tagnames = g_ptr_array_new_with_free_func (g_free);
+  char *line = NULL;
+  gboolean cached = FALSE;
+  gboolean batch;
+  int i;
+  
+  optcontext = g_option_context_new ("TAGNAME... - Verify signed tags");
+
+  if (!option_context_parse (optcontext, verify_options, &argc, &argv,
+                             cancellable, error))
+    goto out;
+
+  /* --bundle brings its own repository */
+  if (!evtag_start_command (self, opt_bundle == NULL, cancellable, error))
+    goto out;
+
+  if (opt_submodule_bundles && !opt_bundle)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "--submodule-bundle requires --bundle");
+      goto out;
+    }
+  if (opt_bundle && !open_bundle_repository (self, cancellable, error))
+    goto out;
+
+  if (opt_all || opt_tags_pattern)
+    {
+      if (!collect_tags (self->top_repo, opt_all ? "*" : opt_tags_pattern,
+                         tagnames, error))
+        goto out;
+    }
+  else if (argc < 2)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "A TAGNAME argument is required");
+      goto out;
+    }
+
+  /* Tags named as well as matched by --all or --tags are only
+   * verified once
+   */
+  for (i = 1; i < argc; i++)
+    {
+      if (!tagnames_contains (tagnames, argv[i]))
+        g_ptr_array_add (tagnames, g_strdup (argv[i]));
+    }
+  batch = opt_all || opt_tags_pattern || tagnames->len > 1;
+
+  if (!validate_checkpoint_options (error))
+    goto out;
+  if (opt_checkpoint && batch)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "--checkpoint only works when verifying a single tag");
+      goto out;
+    }
+
+  /* A batch audits tags of history, which need not be what is checked
+   * out, so the state of the working tree doesn't matter
+   */
+  if (!batch && !check_working_tree (self, cancellable, error))
+    goto out;
+
+  if (batch)
+    {
+      if (!verify_batch (self, tagnames, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      /* Nothing is checked out in a bare repository */
+      gboolean require_head = !git_repository_is_bare (self->top_repo);
+
+      if (!verify_one_tag (self, tagnames->pdata[0], require_head, &line, &cached,
+                           cancellable, error))
+        goto out;
+
+      if (cached)
+        g_print ("# git-evtag comment: Using cached checksum\n");
+      else
+        {
+          char *stats = get_stats (self);
+          g_print ("%s\n", stats);
+          g_free (stats);
+        }
+      g_print ("Successfully verified: %s\n", line);
+    }
+
+  ret = TRUE;
+ out:
+  g_free (line);
+  g_ptr_array_unref (tagnames);
+  return ret;
+}
+
+/* compute-from-tree computes the checksum of a commit from an exported
+ * source tree, a directory or a tar archive, instead of from the
+ * repository, so that a tarball can be checked against a signed tag.
+ * Only the commit objects, of the commit and of each submodule, come
+ * from elsewhere.  The tree and blob objects are synthesized: first
+ * the ids of the blobs are computed, mapping the files from --jobs
+ * threads; then the ids of the trees, bottom-up, which must match the
+ * commits; and finally the objects are hashed in the same order as
+ * checksum_commit_contents(), reading the files again, normally from
+ * the page cache.
+ */
+#define TAR_BLOCK_SIZE 512
+/* Chunk size when copying an archive from stdin or gunzipping it */
+#define EVTAG_TAR_READ_BUFSIZE (1024 * 1024)
+
+typedef struct EvTagTreeNode EvTagTreeNode;
+
+struct EvTagTreeNode {
+  char *name;
+  guint32 mode;
+  /* Of the blob, tree, or for submodules the commit */
+  git_oid oid;
+  /* Directories and submodules; by name while the tree is built */
+  GHashTable *entries;
+  /* ... and then in git order */
+  GPtrArray *children;
+  /* The tree object, and for submodules its id */
+  GBytes *tree;
+  git_oid tree_oid;
+  /* Blobs are either a file to map, or in memory */
+  char *path;
+  GBytes *data;
+  gsize size;
+  /* The commit object of a submodule */
+  GBytes *commit;
+};
+
+static void
+tree_node_free (gpointer data)
+{
+  EvTagTreeNode *node = data;
+
+  g_free (node->name);
+  g_free (node->path);
+  if (node->entries)
+    g_hash_table_unref (node->entries);
+  if (node->children)
+    g_ptr_array_unref (node->children);
+  if (node->tree)
+    g_bytes_unref (node->tree);
+  if (node->data)
+    g_bytes_unref (node->data);
+  if (node->commit)
+    g_bytes_unref (node->commit);
+  g_free (node);
+}
+
+static EvTagTreeNode *
+tree_node_new (const char *name,
+               guint32     mode)
+{
+  EvTagTreeNode *node = g_new0 (EvTagTreeNode, 1);
+
+  node->name = g_strdup (name);
+  node->mode = mode;
+  if (mode == GIT_FILEMODE_TREE)
+    node->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, tree_node_free);
+  return node;
+}
+
+static void
+tree_node_insert (EvTagTreeNode *dir,
+                  EvTagTreeNode *child)
+{
+  g_hash_table_replace (dir->entries, child->name, child);
+}
+
+/* Splits @path into its components, without the first @strip.  Sets
+ * @out_components to %NULL for paths that aren't content, such as
+ * the top directory or anything in a .git directory.
+ */
+static gboolean
+split_tree_path (const char   *path,
+                 int           strip,
+                 char       ***out_components,
+                 GError      **error)
+{
+  char **parts = g_strsplit (path, "/", -1);
+  GPtrArray *components = g_ptr_array_new_with_free_func (g_free);
+  gboolean ret = FALSE;
+  guint i;
+
+  *out_components = NULL;
+
+  for (i = 0; parts[i]; i++)
+    {
+      if (*parts[i] == '\0' || strcmp (parts[i], ".") == 0)
+        continue;
+      if (strcmp (parts[i], "..") == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Invalid path %s", path);
+          goto out;
+        }
+      if (strip > 0)
+        {
+          strip--;
+          continue;
+        }
+      /* Repository metadata, including the .git file of submodules */
+      if (strcmp (parts[i], ".git") == 0)
+        {
+          ret = TRUE;
+          goto out;
+        }
+      g_ptr_array_add (components, g_strdup (parts[i]));
+    }
+
+  if (components->len > 0)
+    {
+      g_ptr_array_add (components, NULL);
+      g_ptr_array_set_free_func (components, NULL);
+      *out_components = (char**)g_ptr_array_free (components, FALSE);
+      components = NULL;
+    }
+  ret = TRUE;
+ out:
+  if (components)
+    g_ptr_array_unref (components);
+  g_strfreev (parts);
+  return ret;
+}
+
+/* Returns the directory @components, creating it as needed */
+static EvTagTreeNode *
+tree_node_ensure_dir (EvTagTreeNode  *root,
+                      char          **components,
+                      guint           n_components,
+                      GError        **error)
+{
+  EvTagTreeNode *dir = root;
+  guint i;
+
+  for (i = 0; i < n_components; i++)
+    {
+      EvTagTreeNode *child = g_hash_table_lookup (dir->entries, components[i]);
+
+      if (!child)
+        {
+          child = tree_node_new (components[i], GIT_FILEMODE_TREE);
+          tree_node_insert (dir, child);
+        }
+      else if (!child->entries)
+        {
+          char *path = g_strjoinv ("/", components);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s is not a directory", path);
+          g_free (path);
+          return NULL;
+        }
+      dir = child;
+    }
+  return dir;
+}
+
+static gboolean
+scan_directory (EvTagTreeNode  *dir,
+                const char     *path,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  gboolean ret = FALSE;
+  GDir *d = NULL;
+  const char *name;
+  char *child_path = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  d = g_dir_open (path, 0, error);
+  if (!d)
+    goto out;
+
+  while ((name = g_dir_read_name (d)) != NULL)
+    {
+      struct stat stbuf;
+      EvTagTreeNode *child;
+
+      /* Repository metadata, including the .git file of submodules */
+      if (strcmp (name, ".git") == 0)
+        continue;
+
+      g_free (child_path);
+      child_path = g_build_filename (path, name, NULL);
+      if (lstat (child_path, &stbuf) < 0)
+        {
+          int errsv = errno;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Reading %s: %s", child_path, g_strerror (errsv));
+          goto out;
+        }
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          child = tree_node_new (name, GIT_FILEMODE_TREE);
+          tree_node_insert (dir, child);
+          if (!scan_directory (child, child_path, cancellable, error))
+            goto out;
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          /* Like git, only the owner's execute bit counts */
+          child = tree_node_new (name, (stbuf.st_mode & S_IXUSR) ?
+                                 GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB);
+          child->path = child_path;
+          child_path = NULL;
+          tree_node_insert (dir, child);
+        }
+      else if (S_ISLNK (stbuf.st_mode))
+        {
+          char *target = g_file_read_link (child_path, error);
+
+          if (!target)
+            goto out;
+          child = tree_node_new (name, GIT_FILEMODE_LINK);
+          child->data = g_bytes_new_take (target, strlen (target));
+          tree_node_insert (dir, child);
+        }
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Unsupported file type: %s", child_path);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_free (child_path);
+  if (d)
+    g_dir_close (d);
+  return ret;
+}
+
+/* Octal, or base-256 for GNU tar's large numbers */
+static gboolean
+tar_parse_number (const char *field,
+                  gsize       len,
+                  guint64    *out_value)
+{
+  guint64 value = 0;
+  gsize i = 0;
+
+  if ((guchar)field[0] & 0x80)
+    {
+      value = (guchar)field[0] & 0x7f;
+      for (i = 1; i < len; i++)
+        value = (value << 8) | (guchar)field[i];
+      *out_value = value;
+      return TRUE;
+    }
+
+  while (i < len && field[i] == ' ')
+    i++;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    value = (value << 3) | (guint64)(field[i] - '0');
+  if (i < len && field[i] != ' ' && field[i] != '\0')
+    return FALSE;
+  *out_value = value;
+  return TRUE;
+}
+
+static gboolean
+tar_header_is_valid (const guint8 *header)
+{
+  guint64 expected;
+  guint64 sum = 0;
+  guint i;
+
+  if (!tar_parse_number ((const char*)header + 148, 8, &expected))
+    return FALSE;
+  /* The checksum field itself counts as spaces */
+  for (i = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += (i >= 148 && i < 156) ? ' ' : header[i];
+  return sum == expected;
+}
+
+static char *
+tar_string (const guint8 *field,
+            gsize         len)
+{
+  return g_strndup ((const char*)field, len);
+}
+
+/* Each pax record is "LENGTH KEY=VALUE\n"; only the path, link target
+ * and size matter here.
+ */
+static gboolean
+tar_parse_pax (const char  *data,
+               gsize        len,
+               char       **inout_path,
+               char       **inout_linkpath,
+               gint64      *inout_size)
+{
+  const char *p = data;
+  const char *end = data + len;
+
+  while (p < end && *p != '\0')
+    {
+      guint64 reclen;
+      char *endnum;
+      const char *key;
+      const char *eq;
+      const char *recend;
+      char *value;
+
+      reclen = g_ascii_strtoull (p, &endnum, 10);
+      if (endnum == p || *endnum != ' ' || reclen > (guint64)(end - p))
+        return FALSE;
+      recend = p + reclen;
+      if (recend[-1] != '\n')
+        return FALSE;
+      key = endnum + 1;
+      eq = memchr (key, '=', recend - key);
+      if (!eq)
+        return FALSE;
+      value = g_strndup (eq + 1, recend - 1 - (eq + 1));
+
+      if (eq - key == 4 && memcmp (key, "path", 4) == 0)
+        {
+          g_free (*inout_path);
+          *inout_path = value;
+        }
+      else if (eq - key == 8 && memcmp (key, "linkpath", 8) == 0)
+        {
+          g_free (*inout_linkpath);
+          *inout_linkpath = value;
+        }
+      else
+        {
+          if (eq - key == 4 && memcmp (key, "size", 4) == 0)
+            *inout_size = (gint64) g_ascii_strtoull (value, NULL, 10);
+          g_free (value);
+        }
+      p = recend;
+    }
+  return TRUE;
+}
+
+/* Adds the entry of a tar archive at @name */
+static gboolean
+tar_add_entry (EvTagTreeNode  *root,
+               GBytes         *archive,
+               const guint8   *header,
+               const char     *name,
+               const char     *linkname,
+               gsize           offset,
+               gsize           size,
+               int             strip,
+               GError        **error)
+{
+  gboolean ret = FALSE;
+  char typeflag = (char)header[156];
+  char **components = NULL;
+  char **link_components = NULL;
+  guint n;
+  guint64 mode;
+  EvTagTreeNode *dir;
+  EvTagTreeNode *child;
+
+  if (!split_tree_path (name, strip, &components, error))
+    goto out;
+  if (!components)
+    {
+      ret = TRUE;
+      goto out;
+    }
+  n = g_strv_length (components);
+
+  if (typeflag == '5' || g_str_has_suffix (name, "/"))
+    {
+      ret = tree_node_ensure_dir (root, components, n, error) != NULL;
+      goto out;
+    }
+
+  dir = tree_node_ensure_dir (root, components, n - 1, error);
+  if (!dir)
+    goto out;
+
+  switch (typeflag)
+    {
+    case '0':
+    case '\0':
+    case '7':
+      if (!tar_parse_number ((const char*)header + 100, 8, &mode))
+        mode = 0644;
+      child = tree_node_new (components[n-1], (mode & S_IXUSR) ?
+                             GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB);
+      child->data = g_bytes_new_from_bytes (archive, offset, size);
+      break;
+    case '2':
+      child = tree_node_new (components[n-1], GIT_FILEMODE_LINK);
+      child->data = g_bytes_new (linkname, strlen (linkname));
+      break;
+    case '1':
+      {
+        EvTagTreeNode *target = NULL;
+        EvTagTreeNode *link_dir = NULL;
+        guint link_n;
+
+        if (!split_tree_path (linkname, strip, &link_components, error))
+          goto out;
+        if (link_components)
+          {
+            link_n = g_strv_length (link_components);
+            link_dir = tree_node_ensure_dir (root, link_components, link_n - 1, NULL);
+            if (link_dir)
+              target = g_hash_table_lookup (link_dir->entries, link_components[link_n-1]);
+          }
+        if (!target || !target->data)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "Hard link %s to missing file %s", name, linkname);
+            goto out;
+          }
+        child = tree_node_new (components[n-1], target->mode);
+        child->data = g_bytes_ref (target->data);
+      }
+      break;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported tar entry type '%c' for %s", typeflag, name);
+      goto out;
+    }
+
+  /* As when extracting, a later entry replaces an earlier one */
+  tree_node_insert (dir, child);
+
+  ret = TRUE;
  out:
-  return r;
+  g_strfreev (link_components);
+  g_strfreev (components);
+  return ret;
 }
 
+/* Reads a ustar, pax or GNU tar archive; the blobs point into
+ * @archive.
+ */
 static gboolean
-compute_and_append_legacy_archive_checksum (const char   *commit,
-                                            GString      *buf,
-                                            GCancellable *cancellable,
-                                            GError      **error)
+read_tar (EvTagTreeNode  *root,
+          GBytes         *archive,
+          int             strip,
+          GError        **error)
 {
   gboolean ret = FALSE;
-  const char *archive_argv[] = {"git", "archive", "--format=tar", commit, NULL};
-  GSubprocess *gitarchive_proc = NULL;
-  GInputStream *gitarchive_output = NULL;
-  guint64 legacy_checksum_start;
-  guint64 legacy_checksum_end;
-  GChecksum *legacy_archive_sha256 = g_checksum_new (G_CHECKSUM_SHA256);
-  gssize bytes_read;
-  char readbuf[4096];
-  char *gitversion = NULL;
-  int wait_status;
-  char *nl;
+  gsize len;
+  const guint8 *data = g_bytes_get_data (archive, &len);
+  gsize offset = 0;
+  char *pax_path = NULL;
+  char *pax_linkpath = NULL;
+  gint64 pax_size = -1;
+  char *long_name = NULL;
+  char *long_link = NULL;
+  char *name = NULL;
+  char *linkname = NULL;
+  static const guint8 zero_block[TAR_BLOCK_SIZE] = { 0, };
 
-  legacy_checksum_start = g_get_monotonic_time ();
+  while (TRUE)
+    {
+      const guint8 *header = data + offset;
+      guint64 size;
+      gsize content;
+      char typeflag;
 
-  gitarchive_proc = g_subprocess_newv (archive_argv, G_SUBPROCESS_FLAGS_STDOUT_PIPE, error);
+      /* The end of archive blocks are sometimes left out */
+      if (offset == len)
+        break;
+      if (len - offset < TAR_BLOCK_SIZE)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Truncated tar archive");
+          goto out;
+        }
+      if (memcmp (header, zero_block, TAR_BLOCK_SIZE) == 0)
+        break;
+      if (!tar_header_is_valid (header) ||
+          !tar_parse_number ((const char*)header + 124, 12, &size))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Invalid tar header at offset %" G_GSIZE_FORMAT, offset);
+          goto out;
+        }
+      if (pax_size >= 0)
+        size = (guint64)pax_size;
 
-  if (!gitarchive_proc)
-    goto out;
-          
-  gitarchive_output = g_subprocess_get_stdout_pipe (gitarchive_proc);
-          
-  while ((bytes_read = g_input_stream_read (gitarchive_output, readbuf, sizeof (readbuf),
-                                            cancellable, error)) > 0)
-    g_checksum_update (legacy_archive_sha256, (guint8*)readbuf, bytes_read);
-  if (bytes_read < 0)
-    goto out;
-  legacy_checksum_end = g_get_monotonic_time ();
+      content = offset + TAR_BLOCK_SIZE;
+      if (size > len - content)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Truncated tar archive");
+          goto out;
+        }
+      offset = content + ((size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE) * TAR_BLOCK_SIZE;
+      if (offset > len)
+        offset = len;
 
-  g_string_append_printf (buf, "# git-evtag comment: Computed legacy checksum in %0.1fs\n",
-                          (double)(legacy_checksum_end - legacy_checksum_start) / (double) G_USEC_PER_SEC);
+      typeflag = (char)header[156];
+      switch (typeflag)
+        {
+        case 'x':
+          if (!tar_parse_pax ((const char*)data + content, size,
+                              &pax_path, &pax_linkpath, &pax_size))
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Invalid pax header at offset %" G_GSIZE_FORMAT, content);
+              goto out;
+            }
+          continue;
+        case 'g':
+          /* Global headers, such as the commit id from `git archive` */
+          continue;
+        case 'L':
+          g_free (long_name);
+          long_name = tar_string (data + content, size);
+          continue;
+        case 'K':
+          g_free (long_link);
+          long_link = tar_string (data + content, size);
+          continue;
+        default:
+          break;
+        }
 
-  g_string_append (buf, LEGACY_EVTAG_ARCHIVE_TAR);
-  g_string_append_c (buf, ' ');
-  g_string_append (buf, g_checksum_get_string (legacy_archive_sha256));
-  g_string_append_c (buf, '\n');
+      g_free (name);
+      if (pax_path)
+        name = g_strdup (pax_path);
+      else if (long_name)
+        name = g_strdup (long_name);
+      else if (memcmp (header + 257, "ustar", 5) == 0 && header[345] != '\0')
+        {
+          char *prefix = tar_string (header + 345, 155);
+          char *base = tar_string (header, 100);
+          name = g_strconcat (prefix, "/", base, NULL);
+          g_free (base);
+          g_free (prefix);
+        }
+      else
+        name = tar_string (header, 100);
+
+      g_free (linkname);
+      if (pax_linkpath)
+        linkname = g_strdup (pax_linkpath);
+      else if (long_link)
+        linkname = g_strdup (long_link);
+      else
+        linkname = tar_string (header + 157, 100);
+
+      if (!tar_add_entry (root, archive, header, name, linkname,
+                          content, size, strip, error))
+        goto out;
 
-  if (!g_spawn_command_line_sync ("git --version", &gitversion, NULL, &wait_status, error))
-    goto out;
-  if (!g_spawn_check_wait_status (wait_status, error))
+      g_clear_pointer (&pax_path, g_free);
+      g_clear_pointer (&pax_linkpath, g_free);
+      g_clear_pointer (&long_name, g_free);
+      g_clear_pointer (&long_link, g_free);
+      pax_size = -1;
+    }
+
+  ret = TRUE;
+ out:
+  g_free (linkname);
+  g_free (name);
+  g_free (long_link);
+  g_free (long_name);
+  g_free (pax_linkpath);
+  g_free (pax_path);
+  return ret;
+}
+
+/* An archive from stdin, or one that is gzipped, is copied to an
+ * unlinked file in the temporary directory and mapped, like one given
+ * by path.  The tree refers into the archive until the files are
+ * hashed, and the kernel can drop pages of a file mapping, unlike a
+ * heap buffer, so a large archive takes space in $TMPDIR rather than
+ * memory.  @in is %NULL for stdin.
+ */
+static GBytes *
+spill_tar_archive (GInputStream  *in,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  GBytes *ret = NULL;
+  char *tmppath = NULL;
+  guint8 *buf = g_malloc (EVTAG_TAR_READ_BUFSIZE);
+  GMappedFile *map = NULL;
+  int fd;
+
+  fd = g_file_open_tmp ("git-evtag-XXXXXX.tar", &tmppath, error);
+  if (fd < 0)
     goto out;
-          
-  nl = strchr (gitversion, '\n');
-  if (!nl)
+  /* Removed when closed, even if we are interrupted */
+  (void) unlink (tmppath);
+
+  while (TRUE)
     {
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "git --version returned invalid content without a newline");
-      goto out;
-    }
+      gssize n;
+      gssize written = 0;
 
-  *nl = '\0';
-  g_strchomp (gitversion);
+      if (in)
+        {
+          n = g_input_stream_read (in, buf, EVTAG_TAR_READ_BUFSIZE, cancellable, error);
+          if (n < 0)
+            goto out;
+        }
+      else
+        {
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            goto out;
+          n = read (0, buf, EVTAG_TAR_READ_BUFSIZE);
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n < 0)
+            {
+              int errsv = errno;
+              g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                           "Reading stdin: %s", g_strerror (errsv));
+              goto out;
+            }
+        }
+      if (n == 0)
+        break;
 
-  g_string_append (buf, LEGACY_EVTAG_ARCHIVE_TAR_GITVERSION);
-  g_string_append_c (buf, ' ');
-  g_string_append (buf, gitversion);
-  g_string_append_c (buf, '\n');
+      while (written < n)
+        {
+          ssize_t w = write (fd, buf + written, n - written);
+          if (w < 0 && errno == EINTR)
+            continue;
+          if (w < 0)
+            {
+              int errsv = errno;
+              g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                           "Writing %s: %s", tmppath, g_strerror (errsv));
+              goto out;
+            }
+          written += w;
+        }
+    }
 
-  ret = TRUE;
+  map = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!map)
+    goto out;
+  ret = g_mapped_file_get_bytes (map);
  out:
+  if (map)
+    g_mapped_file_unref (map);
+  if (fd >= 0)
+    (void) close (fd);
+  g_free (buf);
+  g_free (tmppath);
   return ret;
 }
 
-static gboolean
-validate_at_head (struct EvTag  *self,
-                  git_oid       *specified_oid,
+/* Maps the archive @path, or stdin for "-", and decompresses it if it
+ * is gzipped; see spill_tar_archive().
+ */
+static GBytes *
+load_tar_archive (const char    *path,
+                  GCancellable  *cancellable,
                   GError       **error)
 {
-  gboolean ret = FALSE;
-  git_oid head_oid;
+  GBytes *archive = NULL;
+  gsize len;
+  const guint8 *data;
+
+  if (strcmp (path, "-") == 0)
+    {
+      archive = spill_tar_archive (NULL, cancellable, error);
+      if (!archive)
+        return NULL;
+    }
+  else
+    {
+      GMappedFile *map = g_mapped_file_new (path, FALSE, error);
+
+      if (!map)
+        return NULL;
+      archive = g_mapped_file_get_bytes (map);
+      g_mapped_file_unref (map);
+    }
+
+  data = g_bytes_get_data (archive, &len);
+  if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    {
+      GInputStream *compressed = g_memory_input_stream_new_from_bytes (archive);
+      GZlibDecompressor *decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+      GInputStream *in = g_converter_input_stream_new (compressed, G_CONVERTER (decompressor));
+
+      g_bytes_unref (archive);
+      archive = spill_tar_archive (in, cancellable, error);
+      if (!archive)
+        g_prefix_error (error, "Decompressing %s: ", path);
+      g_object_unref (in);
+      g_object_unref (decompressor);
+      g_object_unref (compressed);
+    }
+  else if ((len >= 6 && memcmp (data, "\xfd" "7zXZ\0", 6) == 0) ||
+           (len >= 4 && memcmp (data, "\x28\xb5\x2f\xfd", 4) == 0) ||
+           (len >= 3 && memcmp (data, "BZh", 3) == 0))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Only gzip compression is supported; decompress %s to stdin and use -",
+                   path);
+      g_bytes_unref (archive);
+      archive = NULL;
+    }
+  return archive;
+}
+
+static gboolean
+load_commit_object (const char  *path,
+                    GBytes     **out_commit,
+                    git_oid     *out_oid,
+                    GError     **error)
+{
+  char *contents;
+  gsize len;
   int r;
 
-  r = git_reference_name_to_id (&head_oid, self->top_repo, "HEAD");
+  if (!g_file_get_contents (path, &contents, &len, error))
+    return FALSE;
+  r = git_odb_hash (out_oid, contents, len, GIT_OBJ_COMMIT);
   if (!handle_libgit_ret (r, error))
-    goto out;
+    {
+      g_free (contents);
+      return FALSE;
+    }
+  *out_commit = g_bytes_new_take (contents, len);
+  return TRUE;
+}
 
-  /* We have this restriction due to submodules; we require them to be
-   * checked out and initialized.
-   */
-  if (git_oid_cmp (&head_oid, specified_oid) != 0)
+/* Turns the directories given by --submodule-commit into gitlinks */
+static gboolean
+tree_add_submodules (EvTagTreeNode  *root,
+                     char          **specs,
+                     GError        **error)
+{
+  guint i;
+
+  for (i = 0; specs && specs[i]; i++)
     {
-      char head_oid_hexstr[GIT_OID_HEXSZ+1];
-      char specified_oid_hexstr[GIT_OID_HEXSZ+1];
+      const char *eq = strchr (specs[i], '=');
+      char *path;
+      char **components = NULL;
+      EvTagTreeNode *node = NULL;
+      gboolean ok;
 
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Target %s is not HEAD (%s); currently git-evtag can only tag or verify HEAD in a pristine checkout",
-                   git_oid_tostr (specified_oid_hexstr, sizeof (specified_oid_hexstr), specified_oid),
-                   git_oid_tostr (head_oid_hexstr, sizeof (head_oid_hexstr), &head_oid));
-      goto out;
+      if (!eq || eq == specs[i])
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid --submodule-commit %s, expected PATH=FILE", specs[i]);
+          return FALSE;
+        }
+
+      path = g_strndup (specs[i], eq - specs[i]);
+      ok = split_tree_path (path, 0, &components, error);
+      if (ok && !components)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid submodule path %s", path);
+          ok = FALSE;
+        }
+      if (ok)
+        node = tree_node_ensure_dir (root, components, g_strv_length (components), error);
+      if (node && node->mode == GIT_FILEMODE_COMMIT)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Duplicate --submodule-commit for %s", path);
+          node = NULL;
+        }
+      if (node)
+        {
+          node->mode = GIT_FILEMODE_COMMIT;
+          ok = load_commit_object (eq + 1, &node->commit, &node->oid, error);
+        }
+      g_strfreev (components);
+      g_free (path);
+      if (!node || !ok)
+        return FALSE;
     }
+  return TRUE;
+}
+
+/* As git sorts tree entries: by name, as if trees had a trailing slash */
+static int
+compare_tree_nodes (gconstpointer a,
+                    gconstpointer b)
+{
+  const EvTagTreeNode *node_a = *(EvTagTreeNode * const *)a;
+  const EvTagTreeNode *node_b = *(EvTagTreeNode * const *)b;
+  gsize len_a = strlen (node_a->name);
+  gsize len_b = strlen (node_b->name);
+  gsize len = MIN (len_a, len_b);
+  int c = memcmp (node_a->name, node_b->name, len);
+  guchar c_a, c_b;
+
+  if (c != 0)
+    return c;
+  c_a = len < len_a ? (guchar)node_a->name[len] :
+    node_a->mode == GIT_FILEMODE_TREE ? '/' : '\0';
+  c_b = len < len_b ? (guchar)node_b->name[len] :
+    node_b->mode == GIT_FILEMODE_TREE ? '/' : '\0';
+  return c_a < c_b ? -1 : c_a > c_b ? 1 : 0;
+}
+
+/* Sorts the entries of @dir, leaving out empty directories as git
+ * does, and collects the blobs under it.
+ */
+static void
+tree_node_finish (EvTagTreeNode *dir,
+                  GPtrArray     *blobs)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  dir->children = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, dir->entries);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      EvTagTreeNode *child = value;
+
+      if (child->entries)
+        {
+          tree_node_finish (child, blobs);
+          if (child->mode == GIT_FILEMODE_TREE && child->children->len == 0)
+            continue;
+        }
+      g_ptr_array_add (dir->children, child);
+    }
+  g_ptr_array_sort (dir->children, compare_tree_nodes);
+
+  for (i = 0; i < dir->children->len; i++)
+    {
+      EvTagTreeNode *child = dir->children->pdata[i];
+      if (!child->entries)
+        g_ptr_array_add (blobs, child);
+    }
+}
+
+typedef struct {
+  GCancellable *cancellable;
+  GError *error;
+  GMutex lock;
+} EvTagBlobIds;
+
+static void
+blob_id_thread (gpointer data,
+                gpointer user_data)
+{
+  EvTagTreeNode *node = data;
+  EvTagBlobIds *ids = user_data;
+  GMappedFile *map = NULL;
+  const char *contents;
+  gsize len;
+  GError *local_error = NULL;
+  int r;
+
+  if (g_cancellable_is_cancelled (ids->cancellable))
+    return;
+
+  if (node->path)
+    {
+      map = g_mapped_file_new (node->path, FALSE, &local_error);
+      if (!map)
+        goto out;
+      contents = g_mapped_file_get_contents (map);
+      len = g_mapped_file_get_length (map);
+    }
+  else
+    contents = g_bytes_get_data (node->data, &len);
+
+  node->size = len;
+  r = git_odb_hash (&node->oid, contents ? contents : "", len, GIT_OBJ_BLOB);
+  (void) handle_libgit_ret (r, &local_error);
 
-  ret = TRUE;
  out:
-  return ret;
+  if (map)
+    g_mapped_file_unref (map);
+  if (local_error)
+    {
+      g_mutex_lock (&ids->lock);
+      if (!ids->error)
+        ids->error = local_error;
+      else
+        g_error_free (local_error);
+      g_mutex_unlock (&ids->lock);
+    }
 }
 
 static gboolean
-checksum_commit_recurse (struct EvTag      *self,
-                         git_oid           *specified_oid,
-                         guint64           *out_elapsed_time,
-                         GCancellable      *cancellable,
-                         GError           **error)
+compute_blob_ids (GPtrArray     *blobs,
+                  guint          n_jobs,
+                  GCancellable  *cancellable,
+                  GError       **error)
 {
   gboolean ret = FALSE;
-  int r;
-  guint64 checksum_start_time;
-  guint64 checksum_end_time;
-                         
-  checksum_start_time = g_get_monotonic_time ();
-  {
-    struct TreeWalkData twdata = { FALSE, self, self->top_repo, NULL, cancellable, error };
-    
-    r = git_repository_odb (&twdata.odb, self->top_repo);
-    if (!handle_libgit_ret (r, error))
-      goto out;
-    
-    if (!checksum_commit_contents (&twdata, specified_oid, cancellable, error))
+  EvTagBlobIds ids = { cancellable, NULL, };
+  GThreadPool *pool;
+  guint i;
+
+  g_mutex_init (&ids.lock);
+  pool = g_thread_pool_new (blob_id_thread, &ids, n_jobs, FALSE, error);
+  if (!pool)
+    goto out;
+  for (i = 0; i < blobs->len; i++)
+    {
+      if (!g_thread_pool_push (pool, blobs->pdata[i], error))
+        break;
+    }
+  g_thread_pool_free (pool, FALSE, TRUE);
+  if (i < blobs->len)
+    goto out;
+
+  if (ids.error)
+    {
+      g_propagate_error (error, ids.error);
+      ids.error = NULL;
       goto out;
-  }
-  checksum_end_time = g_get_monotonic_time ();
+    }
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
 
   ret = TRUE;
-  if (out_elapsed_time)
-    *out_elapsed_time = checksum_end_time - checksum_start_time;
  out:
+  g_clear_error (&ids.error);
+  g_mutex_clear (&ids.lock);
   return ret;
 }
 
+/* Builds the tree objects bottom-up, checking that each submodule
+ * matches its commit.  @path is that of @dir, for errors.
+ */
 static gboolean
-git_evtag_builtin_sign (struct EvTag *self, int argc, char **argv, GCancellable *cancellable, GError **error)
+compute_tree_ids (EvTagTreeNode  *dir,
+                  GString        *path,
+                  GError        **error)
 {
-  gboolean ret = FALSE;
+  GString *buf = g_string_new ("");
+  gsize pathlen = path->len;
+  git_oid *tree_oid = dir->mode == GIT_FILEMODE_COMMIT ? &dir->tree_oid : &dir->oid;
+  gsize len;
+  guint i;
   int r;
-  const char *tagname;
-  git_object *obj = NULL;
-  git_oid specified_oid;
-  GOptionContext *optcontext;
-  guint64 elapsed_ns;
-  char commit_oid_hexstr[GIT_OID_HEXSZ+1];
-
-  optcontext = g_option_context_new ("TAGNAME - Create a new GPG signed tag");
-
-  if (!option_context_parse (optcontext, sign_options, &argc, &argv,
-                             cancellable, error))
-    goto out;
 
-  if (argc < 2)
+  for (i = 0; i < dir->children->len; i++)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "A TAGNAME argument is required");
-      goto out;
+      EvTagTreeNode *child = dir->children->pdata[i];
+
+      if (child->entries)
+        {
+          gboolean ok;
+
+          if (pathlen > 0)
+            g_string_append_c (path, '/');
+          g_string_append (path, child->name);
+          ok = compute_tree_ids (child, path, error);
+          g_string_truncate (path, pathlen);
+          if (!ok)
+            goto err;
+        }
+      g_string_append_printf (buf, "%o %s", child->mode, child->name);
+      g_string_append_c (buf, '\0');
+      g_string_append_len (buf, (const char*)child->oid.id, GIT_OID_RAWSZ);
     }
-  else if (argc > 2)
+
+  len = buf->len;
+  dir->tree = g_bytes_new_take (g_string_free (buf, FALSE), len);
+  buf = NULL;
+  r = git_odb_hash (tree_oid, g_bytes_get_data (dir->tree, NULL), len, GIT_OBJ_TREE);
+  if (!handle_libgit_ret (r, error))
+    goto err;
+
+  if (dir->mode == GIT_FILEMODE_COMMIT)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
-      goto out;
+      git_oid expected;
+      char expected_hexstr[GIT_OID_HEXSZ+1];
+      char actual_hexstr[GIT_OID_HEXSZ+1];
+
+      if (!parse_commit_tree_data (g_bytes_get_data (dir->commit, NULL),
+                                   g_bytes_get_size (dir->commit),
+                                   &dir->oid, &expected, error))
+        goto err;
+      if (!git_oid_equal (&expected, tree_oid))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Submodule %s has tree %s, but its commit has tree %s",
+                       path->str,
+                       git_oid_tostr (actual_hexstr, sizeof (actual_hexstr), tree_oid),
+                       git_oid_tostr (expected_hexstr, sizeof (expected_hexstr), &expected));
+          goto err;
+        }
     }
-  tagname = argv[1];
 
-  r = git_revparse_single (&obj, self->top_repo, "HEAD");
-  if (!handle_libgit_ret (r, error))
-    goto out;
-  specified_oid = *git_object_id (obj);
-  git_oid_fmt (commit_oid_hexstr, &specified_oid);
-  commit_oid_hexstr[sizeof(commit_oid_hexstr)-1] = '\0';
+  return TRUE;
 
-  if (!validate_at_head (self, &specified_oid, error))
-    goto out;
+ err:
+  if (buf)
+    g_string_free (buf, TRUE);
+  return FALSE;
+}
 
-  if (!checksum_commit_recurse (self, &specified_oid, &elapsed_ns,
-                                cancellable, error))
-    goto out;
+static void
+checksum_bytes (struct EvTag  *self,
+                const git_oid *oid,
+                git_otype      otype,
+                GBytes        *bytes)
+{
+  gsize len;
+  const guint8 *data = g_bytes_get_data (bytes, &len);
 
-  if (opt_print_only)
-    {
-      char *stats = get_stats (self);
-      g_print ("%s\n", stats);
-      g_free (stats);
-      g_print ("%s %s\n", EVTAG_SHA512, g_checksum_get_string (self->checksum));
-    }
-  else
-    {
-      const char *editor;
-      int tmpfd;
-      char *temppath;
-      char *editor_child_argv[] = { NULL, NULL, NULL };
-      GPtrArray *gittag_child_argv = g_ptr_array_new ();
-      GString *buf = g_string_new ("\n\n");
-      gboolean have_evtag;
+  checksum_object_data (self, oid, otype, data, len);
+}
 
-      tmpfd = g_file_open_tmp ("git-evtag-XXXXXX.md", &temppath, error);
-      if (tmpfd < 0)
-        goto out;
-      (void) close (tmpfd);
+static gboolean
+checksum_blob_node (struct EvTag   *self,
+                    EvTagTreeNode  *node,
+                    GError        **error)
+{
+  GMappedFile *map;
 
-      g_string_append_printf (buf, "# git-evtag comment: Computed checksum in %0.1fs\n",
-                              (double)(elapsed_ns) / (double) G_USEC_PER_SEC);
+  if (!node->path)
+    {
+      checksum_bytes (self, &node->oid, GIT_OBJ_BLOB, node->data);
+      return TRUE;
+    }
 
-      {
-        char *stats = get_stats (self);
-        g_string_append (buf, stats);
-        g_string_append_c (buf, '\n');
-        g_free (stats);
-      }
-      g_string_append (buf, EVTAG_SHA512);
-      g_string_append_c (buf, ' ');
-      g_string_append (buf, g_checksum_get_string (self->checksum));
-      g_string_append_c (buf, '\n');
+  map = g_mapped_file_new (node->path, FALSE, error);
+  if (!map)
+    return FALSE;
+  if (g_mapped_file_get_length (map) != node->size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "%s changed while it was being read", node->path);
+      g_mapped_file_unref (map);
+      return FALSE;
+    }
+  checksum_object_data (self, &node->oid, GIT_OBJ_BLOB,
+                        (const guint8*)g_mapped_file_get_contents (map), node->size);
+  g_mapped_file_unref (map);
+  return TRUE;
+}
 
-      if (opt_with_legacy_archive_tag)
-        {
-          if (!compute_and_append_legacy_archive_checksum (commit_oid_hexstr, buf,
-                                                           cancellable, error))
-            goto out;
-        }
-      
-      if (!g_file_set_contents (temppath, buf->str, -1, error))
-        goto out;
-      g_string_free (buf, TRUE);
+/* The same order as checksum_tree() */
+static gboolean
+checksum_tree_node (struct EvTag   *self,
+                    EvTagTreeNode  *dir,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  guint i;
 
-      editor = getenv ("EDITOR");
-      if (!editor)
-        editor = "vi";
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
 
-      editor_child_argv[0] = (char*)editor;
-      editor_child_argv[1] = (char*)temppath;
-      if (!spawn_sync_require_success (editor_child_argv, 
-                                       G_SPAWN_SEARCH_PATH | G_SPAWN_CHILD_INHERITS_STDIN,
-                                       error))
-        goto out;
+  checksum_bytes (self, dir->mode == GIT_FILEMODE_COMMIT ? &dir->tree_oid : &dir->oid,
+                  GIT_OBJ_TREE, dir->tree);
 
-      if (!check_file_has_evtag (temppath, &have_evtag, error))
-        goto out;
+  for (i = 0; i < dir->children->len; i++)
+    {
+      EvTagTreeNode *child = dir->children->pdata[i];
 
-      if (!have_evtag)
-        {
-          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                               "Aborting tag due to deleted Git-EVTag line"); 
-          goto out;
-        }
-      
-      g_ptr_array_add (gittag_child_argv, "git");
-      g_ptr_array_add (gittag_child_argv, "tag");
-      if (!opt_no_signature)
-        g_ptr_array_add (gittag_child_argv, "-s");
-      if (opt_keyid)
+      if (child->mode == GIT_FILEMODE_COMMIT)
         {
-          g_ptr_array_add (gittag_child_argv, "--local-user");
-          g_ptr_array_add (gittag_child_argv, opt_keyid);
+          self->n_submodules++;
+          checksum_bytes (self, &child->oid, GIT_OBJ_COMMIT, child->commit);
         }
-      g_ptr_array_add (gittag_child_argv, "-F");
-      g_ptr_array_add (gittag_child_argv, temppath);
-      g_ptr_array_add (gittag_child_argv, (char*)tagname);
-      g_ptr_array_add (gittag_child_argv, (char*)commit_oid_hexstr);
-      g_ptr_array_add (gittag_child_argv, NULL);
-      if (!spawn_sync_require_success ((char**)gittag_child_argv->pdata,
-                                       G_SPAWN_SEARCH_PATH,
-                                       error))
+      if (child->entries)
         {
-          g_printerr ("Saved tag message in: %s\n", temppath);
-          goto out;
+          if (!checksum_tree_node (self, child, cancellable, error))
+            return FALSE;
         }
-      (void) unlink (temppath);
-      g_ptr_array_free (gittag_child_argv, TRUE);
+      else if (!checksum_blob_node (self, child, error))
+        return FALSE;
     }
-
-  ret = TRUE;
- out:
-  return ret;
+  return TRUE;
 }
 
 static gboolean
-git_evtag_builtin_verify (struct EvTag *self, int argc, char **argv, GCancellable *cancellable, GError **error)
+git_evtag_builtin_compute_from_tree (struct EvTag *self, int argc, char **argv, GCancellable *cancellable, GError **error)
 {
   gboolean ret = FALSE;
-  int r;
-  gboolean verified = FALSE;
   GOptionContext *optcontext;
-  git_oid tag_oid;
-  git_object *obj = NULL;
-  char *long_tagname = NULL;
-  git_tag *tag;
-  const char *tagname;
-  const char *message;
-  git_oid specified_oid;
-  const char *nl;
-  guint64 elapsed_ns;
-  const char *expected_checksum;
-  char commit_oid_hexstr[GIT_OID_HEXSZ+1];
-  char tag_oid_hexstr[GIT_OID_HEXSZ+1];
-  char *git_verify_tag_argv[] = {"git", "verify-tag", NULL, NULL };
-  
-  optcontext = g_option_context_new ("TAGNAME - Verify a signed tag");
-
-  if (!option_context_parse (optcontext, verify_options, &argc, &argv,
+  const char *source;
+  EvTagTreeNode *root = NULL;
+  GBytes *commit = NULL;
+  GBytes *archive = NULL;
+  git_oid commit_oid;
+  git_oid expected_tree;
+  GPtrArray *blobs = g_ptr_array_new ();
+  GString *path = g_string_new ("");
+  guint n_jobs;
+  EvTagTimer timer = { 0, };
+  char expected_hexstr[GIT_OID_HEXSZ+1];
+  char actual_hexstr[GIT_OID_HEXSZ+1];
+
+  optcontext = g_option_context_new ("COMMIT-FILE DIRECTORY|ARCHIVE - Compute the checksum of a commit from an exported tree");
+
+  if (!option_context_parse (optcontext, compute_from_tree_options, &argc, &argv,
                              cancellable, error))
     goto out;
 
-  if (argc < 2)
+  if (!evtag_start_command (self, FALSE, cancellable, error))
+    goto out;
+
+  if (argc != 3)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "A TAGNAME argument is required");
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Expected the commit object file and a directory or tar archive");
       goto out;
     }
-  else if (argc > 2)
+  if (opt_strip_components < 0)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --strip-components %d", opt_strip_components);
       goto out;
     }
+  source = argv[2];
 
-  tagname = argv[1];
-
-  long_tagname = g_strconcat ("refs/tags/", tagname, NULL);
-
-  r = git_reference_name_to_id (&tag_oid, self->top_repo, long_tagname);
-  if (!handle_libgit_ret (r, error))
-    goto out;
-  r = git_tag_lookup (&tag, self->top_repo, &tag_oid);
-  if (!handle_libgit_ret (r, error))
-    goto out;
-  r = git_tag_target (&obj, tag);
-  if (!handle_libgit_ret (r, error))
+  if (!load_commit_object (argv[1], &commit, &commit_oid, error))
     goto out;
-  specified_oid = *git_object_id (obj);
-
-  git_oid_fmt (commit_oid_hexstr, &specified_oid);
-  commit_oid_hexstr[sizeof(commit_oid_hexstr)-1] = '\0';
-
-  if (!validate_at_head (self, &specified_oid, error))
+  if (!parse_commit_tree_data (g_bytes_get_data (commit, NULL), g_bytes_get_size (commit),
+                               &commit_oid, &expected_tree, error))
     goto out;
 
-  message = git_tag_message (tag);
-
-  if (!git_oid_tostr (tag_oid_hexstr, sizeof (tag_oid_hexstr), git_tag_id (tag)))
-    g_assert_not_reached ();
-  
-  if (!opt_no_signature)
+  evtag_timer_start (&timer, EVTAG_PHASE_TREE_IDS);
+  root = tree_node_new ("", GIT_FILEMODE_TREE);
+  if (strcmp (source, "-") != 0 && g_file_test (source, G_FILE_TEST_IS_DIR))
     {
-      git_verify_tag_argv[2] = tag_oid_hexstr;
-      if (!spawn_sync_require_success (git_verify_tag_argv, G_SPAWN_SEARCH_PATH, error))
+      if (!scan_directory (root, source, cancellable, error))
         goto out;
     }
-
-  if (!checksum_commit_recurse (self, &specified_oid, &elapsed_ns,
-                                cancellable, error))
-    goto out;
-
-  expected_checksum = g_checksum_get_string (self->checksum);
-  
-  while (TRUE)
+  else
     {
-      nl = strchr (message, '\n');
-
-      if (g_str_has_prefix (message, EVTAG_SHA512))
+      archive = load_tar_archive (source, cancellable, error);
+      if (!archive)
+        goto out;
+      if (!read_tar (root, archive, opt_strip_components, error))
         {
-          char *line;
-          if (nl)
-            line = g_strndup (message, nl - message);
-          else
-            line = g_strdup (message);
-              
-          g_strchomp (line);
-
-          if (!verify_line (expected_checksum, line, commit_oid_hexstr, error))
-            goto out;
-              
-          {
-            char *stats = get_stats (self);
-            g_print ("%s\n", stats);
-            g_free (stats);
-          }
-          g_print ("Successfully verified: %s\n", line);
-          verified = TRUE;
-          break;
+          g_prefix_error (error, "Reading %s: ", source);
+          goto out;
         }
-          
-      if (!nl)
-        break;
-      message = nl + 1;
     }
-  
-  if (!verified)
+
+  if (!tree_add_submodules (root, opt_submodule_commits, error))
+    goto out;
+  tree_node_finish (root, blobs);
+
+  n_jobs = opt_jobs > 0 ? (guint)opt_jobs : g_get_num_processors ();
+  self->n_jobs_used = n_jobs;
+  if (!compute_blob_ids (blobs, n_jobs, cancellable, error))
+    goto out;
+  if (!compute_tree_ids (root, path, error))
+    goto out;
+  evtag_timer_stop (self, &timer);
+
+  if (!git_oid_equal (&root->oid, &expected_tree))
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Failed to find %s in tag message",
-                   EVTAG_SHA512);
+                   "%s has tree %s, but the commit has tree %s", source,
+                   git_oid_tostr (actual_hexstr, sizeof (actual_hexstr), &root->oid),
+                   git_oid_tostr (expected_hexstr, sizeof (expected_hexstr), &expected_tree));
       goto out;
     }
 
+  if (self->progress)
+    {
+      self->progress_start = self->progress_last = g_get_monotonic_time ();
+      self->expected_blobs = blobs->len;
+    }
+
+  evtag_timer_start (&timer, EVTAG_PHASE_CHECKSUM);
+  checksum_bytes (self, &commit_oid, GIT_OBJ_COMMIT, commit);
+  if (!checksum_tree_node (self, root, cancellable, error))
+    goto out;
+  evtag_timer_stop (self, &timer);
+
+  if (self->progress)
+    evtag_progress_update (self, TRUE);
+
+  {
+    char *stats = get_stats (self);
+    g_print ("%s\n", stats);
+    g_free (stats);
+  }
+  g_print ("%s %s\n", EVTAG_SHA512, evtag_hash_get_string (self->checksum.hash));
+
   ret = TRUE;
  out:
+  evtag_timer_stop (self, &timer);
+  g_string_free (path, TRUE);
+  g_ptr_array_unref (blobs);
+  if (root)
+    tree_node_free (root);
+  if (archive)
+    g_bytes_unref (archive);
+  if (commit)
+    g_bytes_unref (commit);
   return ret;
 }
 
@@ -896,13 +8470,11 @@ submain (struct EvTag *self,
          GError **error)
 {
   gboolean ret = FALSE;
-  git_status_options statusopts = GIT_STATUS_OPTIONS_INIT;
   GCancellable *cancellable = NULL;
   const char *command_name = NULL;
   Subcommand *command;
   char *prgname = NULL;
   int in, out;
-  int r;
 
   /*
    * Parse the global options. We rearrange the options as
@@ -974,29 +8546,34 @@ submain (struct EvTag *self,
   prgname = g_strdup_printf ("%s %s", g_get_prgname (), command_name);
   g_set_prgname (prgname);
 
-  r = git_repository_open_ext (&self->top_repo, ".", 0, NULL);
-  if (!handle_libgit_ret (r, error))
-    goto out;
+  self->checksum.hash = evtag_hash_new ();
 
-  r = git_status_init_options (&statusopts, GIT_STATUS_OPTIONS_VERSION);
-  if (!handle_libgit_ret (r, error))
-    goto out;
+  cancellable = g_cancellable_new ();
 
-  {
-    struct TreeWalkData twdata = { FALSE, self, self->top_repo, NULL, cancellable, error };
-    r = git_status_foreach_ext (self->top_repo, &statusopts, status_cb, &twdata);
-    if (twdata.caught_error)
-      goto out;
-    if (!handle_libgit_ret (r, error))
-      goto out;
-  }
+  ret = command->fn (self, argc, argv, cancellable, error);
 
-  self->checksum = g_checksum_new (G_CHECKSUM_SHA512); 
+  if (self->watchdog && watchdog_stop (self->watchdog) && !ret &&
+      g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_clear_error (error);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                   "Timed out after %d seconds", opt_timeout);
+    }
+  self->watchdog = NULL;
+  g_clear_object (&cancellable);
 
-  if (!command->fn (self, argc, argv, cancellable, error))
-    goto out;
+  if (opt_stats_json)
+    {
+      GError *local_error = NULL;
+
+      /* Statistics are useful for failures too, and shouldn't cause one */
+      if (!write_stats_json (self, command_name, ret ? NULL : *error, &local_error))
+        {
+          g_printerr ("warning: Failed to write statistics: %s\n", local_error->message);
+          g_clear_error (&local_error);
+        }
+    }
 
-  ret = TRUE;
  out:
   return ret;
 }
@@ -1022,10 +8599,33 @@ main (int    argc,
     goto out;
 
  out:
+  if (self.object_cache)
+    object_cache_free (self.object_cache);
+  if (self.readahead)
+    readahead_free (self.readahead);
+  if (self.v1_digests)
+    g_hash_table_unref (self.v1_digests);
+  if (self.shared_repos)
+    g_hash_table_unref (self.shared_repos);
+  if (self.shared_odbs)
+    g_hash_table_unref (self.shared_odbs);
   if (self.top_repo)
     git_repository_free (self.top_repo);
-  if (self.checksum)
-    g_checksum_free (self.checksum);
+  if (self.bundle_dir)
+    {
+      GError *rm_error = NULL;
+
+      if (!remove_recursive (self.bundle_dir, &rm_error))
+        {
+          g_printerr ("warning: Failed to remove temporary repository: %s\n", rm_error->message);
+          g_clear_error (&rm_error);
+        }
+      g_free (self.bundle_dir);
+    }
+  if (self.checksum.hash)
+    evtag_hash_free (self.checksum.hash);
+  if (self.cache_key)
+    g_bytes_unref (self.cache_key);
   if (local_error)
     {
       int is_tty = isatty (1);
@@ -0,0 +1,336 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks of the hot paths of the checksum, on synthetic
+ * objects in an in-memory object database, so that changes to the
+ * hash backends or to allocations can be measured without the noise
+ * of reading a repository; tests/evtag-benchmark covers the whole
+ * program.  Objects go through evtag_checksum_odb_object(), as in
+ * git-evtag.
+ *
+ * Each case is repeated until it has run for --min-time, and reports
+ * the time per object and the throughput over the bytes hashed,
+ * headers included.
+ */
+
+#include "config.h"
+
+#include "evtag-core.h"
+
+#include <git2/sys/mempack.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int opt_min_time = 200;
+static char *opt_backend;
+static char *opt_filter;
+
+static GOptionEntry entries[] = {
+  { "min-time", 0, 0, G_OPTION_ARG_INT, &opt_min_time, "Run each case for at least MSEC milliseconds (default: 200)", "MSEC" },
+  { "backend", 0, 0, G_OPTION_ARG_STRING, &opt_backend, "Only use the SHA-512 backend NAME", "NAME" },
+  { "filter", 0, 0, G_OPTION_ARG_STRING, &opt_filter, "Only run the cases whose name contains STRING", "STRING" },
+  { NULL }
+};
+
+typedef struct {
+  const char *name;
+  /* For each object of the case */
+  git_otype otype;
+  gsize size;
+  guint n_objects;
+  /* A fresh hash per object, as for Git-EVTag-v1, instead of one
+   * running hash as for v0.
+   */
+  gboolean per_object;
+} BenchCase;
+
+static const BenchCase blob_cases[] = {
+  { "blob-64B", GIT_OBJ_BLOB, 64, 100000, FALSE },
+  { "blob-4KiB", GIT_OBJ_BLOB, 4096, 10000, FALSE },
+  { "blob-1MiB", GIT_OBJ_BLOB, 1024 * 1024, 64, FALSE },
+  { "blob-64B-v1", GIT_OBJ_BLOB, 64, 100000, TRUE },
+  { "blob-1MiB-v1", GIT_OBJ_BLOB, 1024 * 1024, 64, TRUE },
+};
+
+#define TREE_ENTRIES 100000
+
+/* Defeats dead code elimination of the hashing */
+static volatile guint8 sink;
+
+static gboolean
+case_selected (const char *name)
+{
+  return !opt_filter || strstr (name, opt_filter) != NULL;
+}
+
+static void
+report (const char *name,
+        const char *backend,
+        guint64     n_objects,
+        guint64     n_bytes,
+        gint64      elapsed_usec)
+{
+  double ns_per_object = (double)elapsed_usec * 1000 / n_objects;
+  double gb_per_sec = elapsed_usec > 0 ? (double)n_bytes / elapsed_usec / 1000 : 0;
+
+  g_print ("%-16s %-11s %10" G_GUINT64_FORMAT " objects %12.1f ns/object %8.3f GB/s\n",
+           name, backend, n_objects, ns_per_object, gb_per_sec);
+}
+
+static guint8 *
+random_data (GRand *rand,
+             gsize  size)
+{
+  guint8 *data = g_malloc (size);
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    data[i] = g_rand_int (rand) & 0xff;
+  return data;
+}
+
+/* Stores @data in @odb, and reads it back as git-evtag would */
+static git_odb_object *
+make_object (git_odb      *odb,
+             git_otype     otype,
+             const guint8 *data,
+             gsize         size)
+{
+  git_oid oid;
+  git_odb_object *object;
+
+  if (git_odb_write (&oid, odb, data, size, otype) != 0 ||
+      git_odb_read (&object, odb, &oid) != 0)
+    g_error ("Failed to store a synthetic object");
+  return object;
+}
+
+static void
+finish_hash (EvTagHash *hash)
+{
+  guint8 digest[EVTAG_SHA512_DIGEST_LEN];
+
+  evtag_hash_get_digest (hash, digest);
+  sink ^= digest[0];
+  evtag_hash_free (hash);
+}
+
+static guint64
+checksum_bytes (const EvTagChecksum *checksum)
+{
+  return checksum->commit_bytes + checksum->tree_bytes + checksum->blob_bytes;
+}
+
+static void
+bench_objects (const BenchCase        *bench,
+               const EvTagHashBackend *backend,
+               git_odb_object         *object)
+{
+  gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+  guint64 n_objects = 0;
+  guint64 n_bytes = 0;
+
+  do
+    {
+      EvTagChecksum checksum = { 0, };
+      guint i;
+
+      checksum.hash = evtag_hash_new_with_backend (backend);
+      for (i = 0; i < bench->n_objects; i++)
+        {
+          evtag_checksum_odb_object (&checksum, object);
+          if (bench->per_object)
+            {
+              finish_hash (checksum.hash);
+              checksum.hash = evtag_hash_new_with_backend (backend);
+            }
+        }
+      finish_hash (checksum.hash);
+      n_bytes += checksum_bytes (&checksum);
+      n_objects += bench->n_objects;
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (elapsed < (gint64)opt_min_time * 1000);
+
+  report (bench->name, backend->name, n_objects, n_bytes, elapsed);
+}
+
+/* A tree of @n_entries blobs with distinct names, in git's order */
+static GByteArray *
+make_tree (GRand *rand,
+           guint  n_entries)
+{
+  GByteArray *tree = g_byte_array_new ();
+  guint i;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      char *entry = g_strdup_printf ("%s file-%08u.c", i % 10 == 0 ? "100755" : "100644", i);
+      guint8 *oid = random_data (rand, GIT_OID_RAWSZ);
+
+      g_byte_array_append (tree, (guint8*)entry, strlen (entry) + 1);
+      g_byte_array_append (tree, oid, GIT_OID_RAWSZ);
+      g_free (oid);
+      g_free (entry);
+    }
+  return tree;
+}
+
+/* What checksum_tree() does for a tree, without the reads of its
+ * entries: hash it, parse it and dispatch on each entry.  Each entry
+ * counts as an object.
+ */
+static void
+bench_tree (const char             *name,
+            const EvTagHashBackend *backend,
+            git_odb_object         *tree)
+{
+  GArray *entries = g_array_sized_new (FALSE, FALSE, sizeof (EvTagTreeEntry), TREE_ENTRIES);
+  gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+  guint64 n_objects = 0;
+  guint64 n_bytes = 0;
+
+  do
+    {
+      EvTagChecksum checksum = { 0, };
+      guint n_blobs = 0;
+      guint i;
+
+      checksum.hash = evtag_hash_new_with_backend (backend);
+      evtag_checksum_odb_object (&checksum, tree);
+      g_array_set_size (entries, 0);
+      if (!evtag_parse_tree_data (git_odb_object_data (tree), git_odb_object_size (tree), entries))
+        g_error ("Failed to parse the synthetic tree");
+      for (i = 0; i < entries->len; i++)
+        {
+          EvTagTreeEntry *entry = &g_array_index (entries, EvTagTreeEntry, i);
+
+          if (evtag_tree_entry_type (entry) == GIT_OBJ_BLOB)
+            n_blobs++;
+        }
+      g_assert (n_blobs == TREE_ENTRIES);
+      finish_hash (checksum.hash);
+      n_bytes += checksum_bytes (&checksum);
+      n_objects += entries->len;
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (elapsed < (gint64)opt_min_time * 1000);
+
+  report (name, backend->name, n_objects, n_bytes, elapsed);
+  g_array_unref (entries);
+}
+
+static void
+bench_header (const char *name)
+{
+  static const gsize sizes[] = { 0, 64, 4096, 1024 * 1024, G_MAXSIZE };
+  char header[EVTAG_OBJECT_HEADER_MAX];
+  gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+  guint64 n_objects = 0;
+  guint64 n_bytes = 0;
+
+  do
+    {
+      guint i;
+
+      for (i = 0; i < 100000; i++)
+        {
+          n_bytes += evtag_object_header (GIT_OBJ_BLOB, sizes[i % G_N_ELEMENTS (sizes)], header);
+          sink ^= header[5];
+        }
+      n_objects += 100000;
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (elapsed < (gint64)opt_min_time * 1000);
+
+  report (name, "-", n_objects, n_bytes, elapsed);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  GOptionContext *optcontext;
+  GError *local_error = NULL;
+  GRand *rand = g_rand_new_with_seed (42);
+  const EvTagHashBackend *const *backend;
+  git_odb_backend *mempack;
+  git_odb *odb;
+  git_odb_object *blobs[G_N_ELEMENTS (blob_cases)];
+  git_odb_object *tree_object;
+  guint8 *data;
+  GByteArray *tree;
+  gsize max_size = 0;
+  guint i;
+
+  optcontext = g_option_context_new ("- Benchmark hashing objects and walking trees");
+  g_option_context_add_main_entries (optcontext, entries, NULL);
+  if (!g_option_context_parse (optcontext, &argc, &argv, &local_error))
+    {
+      g_printerr ("error: %s\n", local_error->message);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (optcontext);
+
+#ifdef HAVE_GIT_LIBGIT2_INIT
+  git_libgit2_init ();
+#else
+  git_threads_init ();
+#endif
+  if (git_mempack_new (&mempack) != 0 ||
+      git_odb_new (&odb) != 0 ||
+      git_odb_add_backend (odb, mempack, 1) != 0)
+    g_error ("Failed to create an in-memory object database");
+
+  for (i = 0; i < G_N_ELEMENTS (blob_cases); i++)
+    max_size = MAX (max_size, blob_cases[i].size);
+  data = random_data (rand, max_size);
+  for (i = 0; i < G_N_ELEMENTS (blob_cases); i++)
+    blobs[i] = make_object (odb, blob_cases[i].otype, data, blob_cases[i].size);
+  tree = make_tree (rand, TREE_ENTRIES);
+  tree_object = make_object (odb, GIT_OBJ_TREE, tree->data, tree->len);
+
+  g_print ("# sha512: %s (cpu: %s)\n", evtag_hash_backend ()->name, evtag_hash_cpu_features ());
+
+  if (case_selected ("object-header"))
+    bench_header ("object-header");
+
+  for (backend = evtag_hash_backends; *backend; backend++)
+    {
+      if (opt_backend && strcmp (opt_backend, (*backend)->name) != 0)
+        continue;
+
+      for (i = 0; i < G_N_ELEMENTS (blob_cases); i++)
+        {
+          if (case_selected (blob_cases[i].name))
+            bench_objects (&blob_cases[i], *backend, blobs[i]);
+        }
+      if (case_selected ("tree-100k"))
+        bench_tree ("tree-100k", *backend, tree_object);
+    }
+
+  git_odb_object_free (tree_object);
+  for (i = 0; i < G_N_ELEMENTS (blob_cases); i++)
+    git_odb_object_free (blobs[i]);
+  git_odb_free (odb);
+  g_byte_array_unref (tree);
+  g_free (data);
+  g_rand_free (rand);
+  return EXIT_SUCCESS;
+}
@@ -178,6 +178,16 @@ setup_test_repository () {
     cd $oldpwd
 }
 
+# Leaves a fresh clone of coolproject2, with its submodules, as the
+# current directory; arguments are passed to `git submodule update`.
+setup_coolproject2_clone () {
+    cd ${test_tmpdir}
+    rm coolproject2 -rf
+    git clone repos/coolproject2 >&2
+    cd coolproject2
+    trusted_git_submodule update --init "$@" >&2
+}
+
 create_editor_script() {
     cat >${test_tmpdir}/editor.sh <<EOF
 #!/bin/sh
@@ -19,10 +19,15 @@ set -e
 set -x
 set -o pipefail
 
-echo "1..7"
+echo "1..28"
 
 . $(dirname $0)/libtest.sh
 
+# The checksum of v2015.1 in coolproject, and in coolproject2, which
+# most of the tests use
+COOLPROJECT_TAG='Git-EVTag-v0-SHA512: 58e9834248c054f844f00148a030876f77eb85daa3caa15a20f3061f181403bae7b7e497fca199d25833b984c60f3202b16ebe0ed3a36e6b82f33618d75c569d'
+TAG='Git-EVTag-v0-SHA512: 8ef922041663821b8208d6e1037adbd51e0b19cc4dd3314436b3078bdae4073a616e6e289891fa5ad9f798630962a33350f6035fffec6ca3c499bc01f07c3d0a'
+
 setup_test_repository
 cd ${test_tmpdir}
 create_editor_script 'Release 2015.1'
@@ -36,14 +41,13 @@ git show refs/tags/v2015.1 > tag.txt
 sed -e 's/^/#tag.txt /' < tag.txt
 ${SRCDIR}/git-evtag-compute-py HEAD > tag-py.txt
 sed -e 's/^/#tag-py.txt /' < tag-py.txt
-TAG='Git-EVTag-v0-SHA512: 58e9834248c054f844f00148a030876f77eb85daa3caa15a20f3061f181403bae7b7e497fca199d25833b984c60f3202b16ebe0ed3a36e6b82f33618d75c569d'
-assert_file_has_content tag.txt "${TAG}"
+assert_file_has_content tag.txt "${COOLPROJECT_TAG}"
 with_editor_script git evtag verify v2015.1 | tee verify.out >&2
-assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content verify.out "Successfully verified: ${COOLPROJECT_TAG}"
 # Also test subdirectory
 (cd src && with_editor_script git evtag verify v2015.1 | tee ../verify2.out) >&2
-assert_file_has_content verify2.out "Successfully verified: ${TAG}"
-assert_file_has_content tag-py.txt "${TAG}"
+assert_file_has_content verify2.out "Successfully verified: ${COOLPROJECT_TAG}"
+assert_file_has_content tag-py.txt "${COOLPROJECT_TAG}"
 
 rm -f tag.txt
 rm -f verify.out
@@ -88,8 +92,8 @@ trusted_git_submodule update --init >&2
 with_editor_script git evtag sign --with-legacy-archive-tag -u 472CDAFA v2015.1 >&2
 git show refs/tags/v2015.1 > tag.txt
 assert_file_has_content tag.txt 'ExtendedVerify-SHA256-archive-tar: 83991ee23a027d97ad1e06432ad87c6685e02eac38706e7fbfe6e5e781939dab'
-gitversion=$(git --version)
-assert_file_has_content tag.txt "ExtendedVerify-git-version: ${gitversion}"
+assert_file_has_content tag.txt "ExtendedVerify-git-version: $(git --version)"
+assert_file_has_content tag.txt "ExtendedVerify-archive-writer: git-evtag "
 with_editor_script git evtag verify v2015.1 | tee verify.out >&2
 assert_file_has_content verify.out 'Successfully verified: Git-EVTag-v0-SHA512: 58e9834248c054f844f00148a030876f77eb85daa3caa15a20f3061f181403bae7b7e497fca199d25833b984c60f3202b16ebe0ed3a36e6b82f33618d75c569d'
 rm -f tag.txt
@@ -116,12 +120,9 @@ echo "ok checksum-only tag + verify"
 
 cd ${test_tmpdir}
 rm coolproject -rf
-git clone repos/coolproject2 >&2
-cd coolproject2
-trusted_git_submodule update --init >&2
+setup_coolproject2_clone
 with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
 git show refs/tags/v2015.1 > tag.txt
-TAG='Git-EVTag-v0-SHA512: 8ef922041663821b8208d6e1037adbd51e0b19cc4dd3314436b3078bdae4073a616e6e289891fa5ad9f798630962a33350f6035fffec6ca3c499bc01f07c3d0a'
 assert_file_has_content tag.txt "${TAG}"
 with_editor_script git evtag verify v2015.1 | tee verify.out >&2
 assert_file_has_content verify.out "Successfully verified: ${TAG}"
@@ -134,3 +135,488 @@ assert_file_has_content tag-py.txt "${TAG}"
 rm -f tag.txt
 rm -f verify.out
 echo "ok tag + verify with nested submodules"
+
+# git-rustevtag is only built with --enable-rust or when cargo is found
+if command -v git-rustevtag >/dev/null; then
+    for jobs in "-j 1" ""; do
+        git rustevtag sign --print-only ${jobs} v2015.1-rust > tag-rust.txt
+        assert_file_has_content tag-rust.txt "${TAG}"
+    done
+    git rustevtag sign --print-only v2015.1-rust HEAD~0 > tag-rust.txt
+    assert_file_has_content tag-rust.txt "${TAG}"
+    git rustevtag verify v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified ${TAG}"
+    rm -f tag-rust.txt verify.out
+    echo "ok rust implementation"
+else
+    echo "ok rust implementation # SKIP git-rustevtag not built"
+fi
+
+setup_coolproject2_clone
+for jobs in 1 2 8; do
+    git evtag sign --print-only --jobs=${jobs} v2015.1 > print-${jobs}.txt
+    assert_file_has_content print-${jobs}.txt "${TAG}"
+done
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+git evtag verify -j 3 v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+echo "ok sign + verify with --jobs"
+
+cd ${test_tmpdir}
+rm bigfiles -rf
+git init bigfiles >&2
+cd bigfiles
+# Larger than EVTAG_STREAM_THRESHOLD
+seq 1 2000000 > big.txt
+# The same streamed blob twice, as well as a small one
+cp big.txt big-copy.txt
+echo small > small.txt
+echo small > small-copy.txt
+git add big.txt big-copy.txt small.txt small-copy.txt
+git commit -m 'Add a big file' >&2
+${SRCDIR}/git-evtag-compute-py HEAD > tag-py.txt
+BIG_TAG=$(grep '^Git-EVTag-v0-SHA512: ' tag-py.txt)
+git evtag sign --print-only v1 > print-loose.txt
+assert_file_has_content print-loose.txt "${BIG_TAG}"
+git evtag sign --print-only --jobs=1 v1 > print-loose-1.txt
+assert_file_has_content print-loose-1.txt "${BIG_TAG}"
+# Packed objects can't be streamed, make sure the fallback works
+git gc -q >&2
+git evtag sign --print-only v1 > print-packed.txt
+assert_file_has_content print-packed.txt "${BIG_TAG}"
+echo "ok large blobs"
+
+setup_coolproject2_clone
+git evtag --version > version.txt
+assert_file_has_content version.txt "sha512: "
+for backend in glib openssl openssl-ctx builtin; do
+    if grep -q '+openssl' version.txt || test ${backend} = glib; then
+        GIT_EVTAG_SHA512_BACKEND=${backend} git evtag sign --print-only -v v2015.1 > print-${backend}.txt
+        assert_file_has_content print-${backend}.txt "sha512=${backend}"
+        assert_file_has_content print-${backend}.txt "${TAG}"
+    fi
+done
+echo "ok sha512 backends"
+
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+git evtag verify v2015.1 > verify.out
+assert_not_file_has_content verify.out "Using cached checksum"
+git evtag verify v2015.1 > verify.out
+assert_file_has_content verify.out "Using cached checksum"
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+git evtag verify --no-cache v2015.1 > verify.out
+assert_not_file_has_content verify.out "Using cached checksum"
+# Keyed by the commit, not by what is checked out
+trusted_git_submodule deinit --all >&2
+git evtag verify v2015.1 > verify.out
+assert_file_has_content verify.out "Using cached checksum"
+trusted_git_submodule update --init >&2
+# Tampered entries are ignored
+for f in .git/evtag/verify-cache/*; do
+    (echo 0000; tail -n 1 $f) > $f.tmp && mv $f.tmp $f
+done
+git evtag verify v2015.1 > verify.out 2>err.txt
+assert_file_has_content err.txt "Ignoring invalid cache entry"
+assert_not_file_has_content verify.out "Using cached checksum"
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+echo "ok verify cache"
+
+setup_coolproject2_clone
+git evtag sign --print-only --manifest-cache v2015.1 > print-1.txt
+assert_file_has_content print-1.txt "${TAG}"
+# One per root tree; both submodules are at the same commit
+ls .git/evtag/manifests > manifests.txt
+test $(wc -l < manifests.txt) = 2
+git evtag sign --print-only --manifest-cache v2015.1 > print-2.txt
+assert_file_has_content print-2.txt "${TAG}"
+cmp print-1.txt print-2.txt
+# Tampered manifests are ignored
+for f in .git/evtag/manifests/*; do
+    printf 'x' | dd of=$f bs=1 seek=9 conv=notrunc 2>/dev/null
+done
+git evtag sign --print-only --manifest-cache v2015.1 > print-3.txt 2>err.txt
+assert_file_has_content err.txt "Ignoring invalid manifest"
+assert_file_has_content print-3.txt "${TAG}"
+echo "ok manifest cache"
+
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+echo 'more cool' > src/cool2.c
+git add src/cool2.c
+git commit -m 'Add cool2' >&2
+with_editor_script git evtag sign -u 472CDAFA v2015.2 >&2
+# Tags other than HEAD can be verified in a batch
+git checkout -q HEAD^ >&2
+git evtag verify v2015.1 v2015.2 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified v2015.1: ${TAG}"
+assert_file_has_content verify.out "Successfully verified v2015.2: "
+# Local changes don't matter to a batch, and named tags aren't repeated
+echo 'local change' >> src/cool.c
+git evtag verify --all -j 2 v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified v2015.1: ${TAG}"
+assert_file_has_content verify.out "Successfully verified v2015.2: "
+test $(grep -c "verified v2015.1:" verify.out) = 1
+git checkout -q -- src/cool.c
+git tag -a -m 'Git-EVTag-v0-SHA512: 00' bogus HEAD >&2
+if git evtag verify --all --no-signature > verify.out 2>err.txt; then
+    assert_not_reached 'Expected failure due to bogus tag'
+fi
+assert_file_has_content verify.out "FAILED bogus: Invalid"
+assert_file_has_content verify.out "Successfully verified v2015.1: ${TAG}"
+assert_file_has_content err.txt "Failed to verify 1 of 3 tags"
+git evtag verify --tags='v2015.*' --no-signature > verify.out
+assert_not_file_has_content verify.out "bogus"
+echo "ok verify multiple tags"
+
+cd ${test_tmpdir}
+rm mirror.git store store2 -rf
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+cd ${test_tmpdir}
+git clone --bare repos/coolproject2 mirror.git >&2
+(cd coolproject2 && git push ../mirror.git v2015.1) >&2
+# Submodules are found by name in the store, without a working tree
+git clone --bare repos/subproject store/subproject >&2
+git clone --bare repos/subproject store/subprojects/subproject.git >&2
+cd mirror.git
+for jobs in 1 4; do
+    if git evtag verify --no-cache -j ${jobs} v2015.1 2>err.txt; then
+        assert_not_reached 'Expected failure due to missing submodules'
+    fi
+    assert_file_has_content err.txt "No repository found for submodule"
+    git evtag verify --no-cache -j ${jobs} --submodule-store=${test_tmpdir}/store v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified: ${TAG}"
+done
+# A directory that isn't a repository falls through to DIR/NAME.git
+mkdir -p ${test_tmpdir}/store2/subprojects
+git clone --bare ../repos/subproject ${test_tmpdir}/store2/subproject.git >&2
+mkdir ${test_tmpdir}/store2/subproject
+git clone --bare ../repos/subproject ${test_tmpdir}/store2/subprojects/subproject.git >&2
+git evtag verify --no-cache --submodule-store=${test_tmpdir}/store2 v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+echo "ok verify in bare repository"
+
+setup_coolproject2_clone
+touch unknownfile
+for mode in full stat none; do
+    git evtag sign --print-only -v --dirty-check=${mode} v2015.1 > print-${mode}.txt
+    assert_file_has_content print-${mode}.txt "dirty-check="
+    assert_file_has_content print-${mode}.txt "${TAG}"
+done
+echo 'super cool' > src/cool.c
+for mode in full stat; do
+    if git evtag sign --print-only --dirty-check=${mode} v2015.1 2>err.txt; then
+        assert_not_reached "expected failure due to dirty tree"
+    fi
+    assert_file_has_content err.txt 'Attempting to tag or verify dirty tree (src/cool.c)'
+done
+git evtag sign --print-only --dirty-check=none v2015.1 >&2
+git checkout src/cool.c >&2
+rm src/cool.c
+if git evtag sign --print-only --dirty-check=stat v2015.1 2>err.txt; then
+    assert_not_reached "expected failure due to deleted file"
+fi
+assert_file_has_content err.txt 'Attempting to tag or verify dirty tree'
+echo "ok dirty check modes"
+
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+git evtag verify --stats-json=${test_tmpdir}/stats.json v2015.1 >&2
+assert_file_has_content ${test_tmpdir}/stats.json '"success": true'
+assert_file_has_content ${test_tmpdir}/stats.json '"phases"'
+assert_file_has_content ${test_tmpdir}/stats.json '"hash": { "wall_seconds"'
+assert_file_has_content ${test_tmpdir}/stats.json '"largest_objects"'
+git evtag verify --no-cache -j 3 --stats-json=${test_tmpdir}/stats.json v2015.1 >&2
+assert_file_has_content ${test_tmpdir}/stats.json '"jobs": 3,'
+assert_file_has_content ${test_tmpdir}/stats.json '"hash": { "wall_seconds": [0-9.]*, "cpu_seconds": [0-9.]*, "count": [1-9]'
+echo 'super cool' > src/cool.c
+if git evtag verify --stats-json=${test_tmpdir}/stats.json v2015.1 2>err.txt; then
+    assert_not_reached "expected failure due to dirty tree"
+fi
+assert_file_has_content ${test_tmpdir}/stats.json '"success": false'
+echo "ok stats json"
+
+cd ${test_tmpdir}/coolproject2
+git checkout src/cool.c >&2
+git evtag verify --no-cache --progress --timeout=3600 v2015.1 >verify.out 2>err.txt
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content err.txt 'Checksummed [0-9]* objects'
+if git evtag verify --timeout=-1 v2015.1 2>err.txt; then
+    assert_not_reached "expected failure due to invalid timeout"
+fi
+assert_file_has_content err.txt 'Invalid --timeout'
+echo "ok progress and timeout"
+
+setup_coolproject2_clone
+for umask in default 0; do
+    if test ${umask} != default; then
+        git config tar.umask ${umask}
+    fi
+    git tag -d v2015.1 >&2 || true
+    with_editor_script git evtag sign --no-signature --with-legacy-archive-tag v2015.1 >&2
+    git show refs/tags/v2015.1 > tag.txt
+    archive_checksum=$(git archive --format=tar v2015.1 | sha256sum | cut -f 1 -d ' ')
+    assert_file_has_content tag.txt "ExtendedVerify-SHA256-archive-tar: ${archive_checksum}"
+    git evtag verify --no-signature --with-legacy-archive-tag v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified: ${TAG}"
+done
+echo '*.c export-ignore' > .git/info/attributes
+if git evtag verify --no-signature --with-legacy-archive-tag v2015.1 2>err.txt; then
+    assert_not_reached "expected legacy checksum mismatch"
+fi
+assert_file_has_content err.txt 'Invalid ExtendedVerify-SHA256-archive-tar'
+# Attributes make it run git archive, so that is the recorded writer
+git tag -d v2015.1 >&2
+with_editor_script git evtag sign --no-signature --with-legacy-archive-tag v2015.1 >&2
+git show refs/tags/v2015.1 > tag.txt
+assert_file_has_content tag.txt "ExtendedVerify-git-version: $(git --version)"
+assert_file_has_content tag.txt "ExtendedVerify-archive-writer: git archive"
+rm .git/info/attributes
+echo "ok legacy archive checksum in process"
+
+# Entries that need more than a plain ustar header, compared with what
+# git archive writes
+cd ${test_tmpdir}
+rm archivetree -rf
+git init archivetree >&2
+cd archivetree
+longdir=$(printf 'directory-%s/' $(seq 1 12))
+mkdir -p ${longdir}
+echo 'deep' > ${longdir}file-with-a-rather-long-name-$(printf 'x%.0s' $(seq 1 100)).txt
+printf '#!/bin/sh\necho hello\n' > script.sh
+chmod a+x script.sh
+ln -s script.sh link
+ln -s ${longdir}target-$(printf 'y%.0s' $(seq 1 100)) long-link
+# Larger than EVTAG_STREAM_THRESHOLD
+seq 1 2000000 > big.txt
+git add .
+git commit -m 'Add unusual entries' >&2
+for packed in no yes; do
+    if test ${packed} = yes; then
+        git gc -q >&2
+    fi
+    for jobs in 1 4; do
+        git tag -d v1 >&2 || true
+        with_editor_script git evtag sign -j ${jobs} --no-signature --with-legacy-archive-tag v1 >&2
+        git show refs/tags/v1 > tag.txt
+        archive_checksum=$(git archive --format=tar v1 | sha256sum | cut -f 1 -d ' ')
+        assert_file_has_content tag.txt "ExtendedVerify-SHA256-archive-tar: ${archive_checksum}"
+        # git archive isn't run, so it's not git that produced it
+        assert_file_has_content tag.txt "ExtendedVerify-archive-writer: git-evtag "
+    done
+done
+echo "ok legacy archive of long paths, links, executables and large files"
+
+cd ${test_tmpdir}/coolproject2
+# Both submodules are the same repository, so its objects repeat
+for jobs in 1 4; do
+    git evtag verify --no-signature --no-cache -j ${jobs} --stats-json=${test_tmpdir}/stats.json v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified: ${TAG}"
+    assert_file_has_content ${test_tmpdir}/stats.json '"hits": [1-9]'
+done
+git evtag verify --no-signature --no-cache --object-cache-size=0 --stats-json=${test_tmpdir}/stats.json v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content ${test_tmpdir}/stats.json '"hits": 0'
+echo "ok object cache"
+
+cd ${test_tmpdir}/coolproject2
+git repack -a -d -q >&2
+trusted_git_submodule foreach git repack -a -d -q >&2
+for jobs in 1 4; do
+    git evtag verify --no-signature --no-cache -j ${jobs} --readahead=2 --stats-json=${test_tmpdir}/stats.json v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified: ${TAG}"
+    assert_file_has_content ${test_tmpdir}/stats.json '"requests": [1-9]'
+done
+git evtag verify --no-signature --no-cache --manifest-cache v2015.1 >&2
+git evtag verify --no-signature --no-cache --manifest-cache --readahead=2 v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+if git evtag verify --no-signature --readahead=-1 v2015.1 2>err.txt; then
+    assert_not_reached "expected invalid --readahead"
+fi
+assert_file_has_content err.txt 'Invalid --readahead'
+echo "ok readahead"
+
+setup_coolproject2_clone
+${SRCDIR}/git-evtag-compute-py --with-v1 HEAD > tag-py.txt
+TAG_V1=$(grep '^Git-EVTag-v1-SHA512: ' tag-py.txt)
+for jobs in 1 4; do
+    git evtag sign --print-only --with-v1 -j ${jobs} v2015.1 > print.txt
+    assert_file_has_content print.txt "${TAG}"
+    assert_file_has_content print.txt "${TAG_V1}"
+done
+with_editor_script git evtag sign --no-signature --with-v1 v2015.1 >&2
+git show refs/tags/v2015.1 > tag.txt
+assert_file_has_content tag.txt "${TAG_V1}"
+git evtag verify --no-signature --no-cache v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+git tag -a -m "${TAG_V1}" v2015.1-v1 HEAD >&2
+git evtag verify --no-signature v2015.1-v1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG_V1}"
+git tag -a -m 'Git-EVTag-v1-SHA512: 00' bogus-v1 HEAD >&2
+if git evtag verify --no-signature bogus-v1 2>err.txt; then
+    assert_not_reached "expected invalid v1 checksum"
+fi
+assert_file_has_content err.txt 'Invalid Git-EVTag-v1-SHA512'
+git evtag verify --no-signature --tags='v2015.1*' | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified v2015.1-v1: ${TAG_V1}"
+echo "ok v1 checksum"
+
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+git evtag verify --stats-json=${test_tmpdir}/stats.json v2015.1 2>err.txt | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content err.txt 'Good signature from'
+assert_file_has_content ${test_tmpdir}/stats.json '"gpg-verify"'
+# A custom gpg.program goes through git verify-tag instead
+git -c gpg.program=gpg evtag verify v2015.1 2>err.txt | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content err.txt 'Good signature from'
+# Same commit and checksum, but the signature no longer matches
+badtag=$(git cat-file tag v2015.1 | sed -e 's/^Release 2015.1/Release 2015.2/' | git mktag)
+git update-ref refs/tags/badsig ${badtag}
+for config in "" "-c gpg.program=gpg"; do
+    if git ${config} evtag verify badsig 2>err.txt; then
+        assert_not_reached "expected bad signature"
+    fi
+    assert_file_has_content err.txt 'BAD signature from'
+done
+git tag -a -m "${TAG}" unsigned HEAD >&2
+if git evtag verify unsigned 2>err.txt; then
+    assert_not_reached "expected missing signature"
+fi
+assert_file_has_content err.txt 'no signature found'
+echo "ok signature verification"
+
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+git bundle create ${test_tmpdir}/coolproject2.bundle v2015.1 >&2
+echo v2015.1 | git pack-objects --revs --include-tag --stdout > ${test_tmpdir}/coolproject2.pack
+git -C ${test_tmpdir}/repos/subproject bundle create ${test_tmpdir}/subproject.bundle --all >&2
+# Nothing needs to be cloned or checked out
+rm -rf ${test_tmpdir}/bundle-verify
+mkdir ${test_tmpdir}/bundle-verify
+cd ${test_tmpdir}/bundle-verify
+for input in coolproject2.bundle coolproject2.pack; do
+    git evtag verify --bundle=../${input} --submodule-bundle=../subproject.bundle v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified: ${TAG}"
+done
+git evtag verify --no-signature --bundle=../coolproject2.bundle --submodule-bundle=../subproject.bundle --all | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified v2015.1: ${TAG}"
+if git evtag verify --no-signature --bundle=../coolproject2.bundle v2015.1 2>err.txt; then
+    assert_not_reached "expected failure without the submodule bundle"
+fi
+if git evtag verify --no-signature --bundle=verify.out v2015.1 2>err.txt; then
+    assert_not_reached "expected failure for an invalid bundle"
+fi
+assert_file_has_content err.txt 'not a git bundle or pack'
+# The temporary repository is removed, after a failure too
+rm -rf ${test_tmpdir}/bundle-tmp
+mkdir ${test_tmpdir}/bundle-tmp
+TMPDIR=${test_tmpdir}/bundle-tmp git evtag verify --no-signature --manifest-cache \
+    --bundle=../coolproject2.bundle --submodule-bundle=../subproject.bundle v2015.1 >&2
+if TMPDIR=${test_tmpdir}/bundle-tmp git evtag verify --no-signature --bundle=verify.out v2015.1 2>err.txt; then
+    assert_not_reached "expected failure for an invalid bundle"
+fi
+test -z "$(ls -A ${test_tmpdir}/bundle-tmp)"
+# Nothing can be kept in it
+if git evtag verify --no-signature --checkpoint=${test_tmpdir}/bundle.ckpt \
+       --bundle=../coolproject2.bundle --submodule-bundle=../subproject.bundle v2015.1 2>err.txt; then
+    assert_not_reached "expected failure for --checkpoint with --bundle"
+fi
+assert_file_has_content err.txt "can't be used with --bundle"
+echo "ok verify from bundle"
+
+setup_coolproject2_clone
+git cat-file commit HEAD > ${test_tmpdir}/commit.txt
+git -C subproject cat-file commit HEAD > ${test_tmpdir}/subcommit.txt
+SUBMODULES="--submodule-commit=subproject=${test_tmpdir}/subcommit.txt --submodule-commit=subprojects/subproject=${test_tmpdir}/subcommit.txt"
+git evtag compute-from-tree ${SUBMODULES} ${test_tmpdir}/commit.txt . > ${test_tmpdir}/compute.out
+assert_file_has_content ${test_tmpdir}/compute.out "${TAG}"
+cd ${test_tmpdir}
+tar --exclude=.git -cf coolproject2.tar coolproject2
+gzip -c coolproject2.tar > coolproject2.tar.gz
+for archive in coolproject2.tar coolproject2.tar.gz; do
+    git evtag compute-from-tree -j 2 --strip-components=1 ${SUBMODULES} commit.txt ${archive} > compute.out
+    assert_file_has_content compute.out "${TAG}"
+done
+for archive in coolproject2.tar coolproject2.tar.gz; do
+    git evtag compute-from-tree --strip-components=1 ${SUBMODULES} commit.txt - < ${archive} > compute.out
+    assert_file_has_content compute.out "${TAG}"
+done
+# The submodule trees are checked against their commits
+if git evtag compute-from-tree --strip-components=1 commit.txt coolproject2.tar 2>err.txt; then
+    assert_not_reached "expected failure without the submodule commits"
+fi
+echo 'not released' > coolproject2/src/extra.c
+if git evtag compute-from-tree ${SUBMODULES} commit.txt coolproject2 2>err.txt; then
+    assert_not_reached "expected failure for a different tree"
+fi
+assert_file_has_content err.txt 'but the commit has tree'
+echo "ok compute from tree"
+
+cd ${test_tmpdir}
+rm subproject-mirror.git -rf
+git clone --mirror repos/subproject subproject-mirror.git >&2
+# Both submodules borrow their objects from the same mirror
+setup_coolproject2_clone --reference ${test_tmpdir}/subproject-mirror.git
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+for jobs in 1 4; do
+    git evtag verify --no-signature --no-cache -j ${jobs} --stats-json=${test_tmpdir}/stats.json v2015.1 | tee verify.out >&2
+    assert_file_has_content verify.out "Successfully verified: ${TAG}"
+    assert_file_has_content ${test_tmpdir}/stats.json '"submodule_repos": { "opened": 2, "reused": 0 }'
+done
+git evtag sign --print-only --with-v1 -j 4 v2015.1 > print.txt
+assert_file_has_content print.txt "${TAG}"
+# With --bundle, every submodule is read from the same repository
+cd ${test_tmpdir}/bundle-verify
+git evtag verify --no-signature --bundle=../coolproject2.bundle --submodule-bundle=../subproject.bundle \
+    --stats-json=${test_tmpdir}/stats.json v2015.1 | tee verify.out >&2
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content ${test_tmpdir}/stats.json '"submodule_repos": { "opened": 1, "reused": 1 }'
+echo "ok shared submodule object database"
+
+setup_coolproject2_clone
+with_editor_script git evtag sign -u 472CDAFA v2015.1 >&2
+SIGN_CHECKPOINT_ARGS="--dirty-check=none --checkpoint-interval=1"
+CHECKPOINT_ARGS="${SIGN_CHECKPOINT_ARGS} --no-signature --no-cache"
+# Interrupt the walk at the second submodule
+subgitdir=$(cd subprojects/subproject && git rev-parse --absolute-git-dir)
+mv ${subgitdir} ${subgitdir}.away
+if git evtag verify ${CHECKPOINT_ARGS} -j 1 --checkpoint=${test_tmpdir}/resumed.ckpt v2015.1 2>err.txt; then
+    assert_not_reached "expected failure without the submodule"
+fi
+assert_file_has_content err.txt "modules/subprojects/subproject.*No such file or directory"
+assert_file_has_content ${test_tmpdir}/resumed.ckpt '^Complete=false'
+mv ${subgitdir}.away ${subgitdir}
+# The state saved by libcrypto can be resumed with the portable SHA-512
+GIT_EVTAG_SHA512_BACKEND=builtin git evtag verify -v ${CHECKPOINT_ARGS} --checkpoint=${test_tmpdir}/resumed.ckpt v2015.1 > verify.out 2>err.txt
+assert_file_has_content err.txt "Resuming from checkpoint at "
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+assert_file_has_content verify.out "sha512=builtin"
+assert_file_has_content ${test_tmpdir}/resumed.ckpt '^Complete=true'
+# The same states at the same paths as a run that wasn't interrupted
+git evtag sign --print-only -v ${SIGN_CHECKPOINT_ARGS} --checkpoint=${test_tmpdir}/full.ckpt v2015.1 > print.txt
+assert_file_has_content print.txt "${TAG}"
+# Not piped into grep -q, which could fail the pipeline with SIGPIPE
+git evtag --version > version.txt
+if grep -q '+openssl' version.txt; then
+    assert_file_has_content print.txt "sha512=openssl-ctx"
+else
+    assert_file_has_content print.txt "sha512=builtin"
+fi
+cmp ${test_tmpdir}/resumed.ckpt.history ${test_tmpdir}/full.ckpt.history
+assert_file_has_content ${test_tmpdir}/full.ckpt.history ' subprojects/subproject$'
+assert_not_file_has_content ${test_tmpdir}/full.ckpt '^History'
+git evtag verify ${CHECKPOINT_ARGS} --checkpoint=${test_tmpdir}/full.ckpt v2015.1 > verify.out 2>err.txt
+assert_file_has_content err.txt "Using completed checkpoint"
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+sed -i -e "s/^Entries=/Entries=1/" ${test_tmpdir}/full.ckpt
+git evtag verify ${CHECKPOINT_ARGS} --checkpoint=${test_tmpdir}/full.ckpt v2015.1 > verify.out 2>err.txt
+assert_file_has_content err.txt "Ignoring invalid checkpoint"
+assert_file_has_content verify.out "Successfully verified: ${TAG}"
+if git evtag verify --manifest-cache --checkpoint=${test_tmpdir}/full.ckpt v2015.1 2>err.txt; then
+    assert_not_reached "expected failure with --manifest-cache"
+fi
+assert_file_has_content err.txt "can't be used with --manifest-cache"
+echo "ok resume from checkpoint"
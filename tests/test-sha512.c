@@ -0,0 +1,161 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks each SHA-512 backend against the FIPS 180-2 examples, and
+ * that the states saved for --checkpoint can be restored by every
+ * backend that supports it.  test-basic.sh only compares the backends
+ * with each other, which wouldn't catch a bug they share.
+ */
+
+#include "config.h"
+
+#include "evtag-core.h"
+
+#include <string.h>
+
+#define TWO_BLOCK_MESSAGE \
+  "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"
+
+typedef struct {
+  const char *message;
+  guint repeat;
+  const char *digest;
+} Sha512Vector;
+
+static const Sha512Vector vectors[] = {
+  { "", 1,
+    "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+    "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+  { "abc", 1,
+    "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+    "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+  { TWO_BLOCK_MESSAGE, 1,
+    "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+    "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909" },
+  /* One million "a", fed in pieces that don't line up with blocks */
+  { "aaaaaaaaaaaaaaaaaaaaaaaaa", 40000,
+    "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+    "de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" },
+};
+
+static void
+test_vectors (gconstpointer data)
+{
+  const EvTagHashBackend *backend = data;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      EvTagHash *hash = evtag_hash_new_with_backend (backend);
+      guint j;
+
+      for (j = 0; j < vectors[i].repeat; j++)
+        evtag_hash_update (hash, (const guint8*)vectors[i].message, strlen (vectors[i].message));
+      g_assert_cmpstr (evtag_hash_get_string (hash), ==, vectors[i].digest);
+      evtag_hash_free (hash);
+    }
+}
+
+/* Saves the state at every offset of a message spanning two blocks,
+ * and finishes it after a restore in each backend that can save.
+ */
+static void
+test_save_restore (gconstpointer data)
+{
+  const EvTagHashBackend *backend = data;
+  const guint8 *message = (const guint8*)TWO_BLOCK_MESSAGE;
+  gsize len = strlen (TWO_BLOCK_MESSAGE);
+  gsize split;
+
+  for (split = 0; split <= len; split++)
+    {
+      EvTagHash *hash = evtag_hash_new_with_backend (backend);
+      const EvTagHashBackend *const *iter;
+      GBytes *state;
+
+      evtag_hash_update (hash, message, split);
+      state = backend->save (hash->ctx);
+      evtag_hash_free (hash);
+
+      for (iter = evtag_hash_backends; *iter; iter++)
+        {
+          EvTagHash *restored;
+
+          if (!(*iter)->save)
+            continue;
+          restored = evtag_hash_new_with_backend (*iter);
+          g_assert_true ((*iter)->restore (restored->ctx, state));
+          evtag_hash_update (restored, message + split, len - split);
+          g_assert_cmpstr (evtag_hash_get_string (restored), ==, vectors[2].digest);
+          evtag_hash_free (restored);
+        }
+      g_bytes_unref (state);
+    }
+}
+
+/* A state whose length doesn't match its byte count */
+static void
+test_restore_invalid (gconstpointer data)
+{
+  const EvTagHashBackend *backend = data;
+  EvTagHash *hash = evtag_hash_new_with_backend (backend);
+  GBytes *state;
+  GBytes *truncated;
+  gsize len;
+
+  evtag_hash_update (hash, (const guint8*)"abc", 3);
+  state = backend->save (hash->ctx);
+  len = g_bytes_get_size (state);
+  g_assert_cmpuint (len, ==, 9 * 8 + 3);
+
+  truncated = g_bytes_new_from_bytes (state, 0, len - 1);
+  g_assert_false (backend->restore (hash->ctx, truncated));
+  g_bytes_unref (truncated);
+  truncated = g_bytes_new_from_bytes (state, 0, 8);
+  g_assert_false (backend->restore (hash->ctx, truncated));
+  g_bytes_unref (truncated);
+
+  g_bytes_unref (state);
+  evtag_hash_free (hash);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  const EvTagHashBackend *const *iter;
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (iter = evtag_hash_backends; *iter; iter++)
+    {
+      char *name = g_strdup_printf ("/sha512/%s/vectors", (*iter)->name);
+
+      g_test_add_data_func (name, *iter, test_vectors);
+      g_free (name);
+      if ((*iter)->save)
+        {
+          name = g_strdup_printf ("/sha512/%s/save-restore", (*iter)->name);
+          g_test_add_data_func (name, *iter, test_save_restore);
+          g_free (name);
+          name = g_strdup_printf ("/sha512/%s/restore-invalid", (*iter)->name);
+          g_test_add_data_func (name, *iter, test_restore_invalid);
+          g_free (name);
+        }
+    }
+
+  return g_test_run ();
+}